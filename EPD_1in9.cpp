@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include "EPD_1in9.h"
 #include "project_config.h"
+#if CORE_HAS_RECURRENT_SCHEDULE
+#include <Schedule.h>
+#endif
 
 //////////////////////////////////////full screen update LUT////////////////////////////////////////////
 
@@ -13,6 +16,47 @@ unsigned char DSPNUM_1in9_off[15]  = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 
 unsigned char VAR_Temperature=20; 
 
+// steps of a queued display sequence, see EPD_1in9_Poll
+enum {
+	EPD_1in9_STEP_LUT_5S,
+	EPD_1in9_STEP_LUT_GC,
+	EPD_1in9_STEP_LUT_DU_WB,
+	EPD_1in9_STEP_WRITE,   // write the image, wait for busy, then display off
+	EPD_1in9_STEP_WRITE1,  // same with the border data of EPD_1in9_Write_Screen1
+	EPD_1in9_STEP_PAUSE,   // wait EPD_1in9_PAUSE_MS
+	EPD_1in9_STEP_SLEEP,   // wait for busy, then power off and deep sleep
+	EPD_1in9_STEP_RESET,   // hold the controller in reset
+};
+
+// what the step in progress is waiting for
+enum {
+	EPD_1in9_WAIT_NONE,
+	EPD_1in9_WAIT_BUSY,
+	EPD_1in9_WAIT_PAUSE,
+};
+
+typedef struct {
+	unsigned char step;
+	unsigned char image[15];
+} EPD_1in9_Step;
+
+#define EPD_1in9_QUEUE_DEPTH   16
+#define EPD_1in9_PAUSE_MS      50
+#define EPD_1in9_BUSY_GUARD_MS 10  // the busy pin isn't asserted right away
+
+static EPD_1in9_Step EPD_1in9_Queue[EPD_1in9_QUEUE_DEPTH];
+static unsigned char EPD_1in9_Queue_Head = 0;
+static unsigned char EPD_1in9_Queue_Count = 0;
+static unsigned char EPD_1in9_Waiting = EPD_1in9_WAIT_NONE;
+static unsigned long EPD_1in9_Wait_Start;
+static volatile bool EPD_1in9_Busy_Released;
+#if CORE_HAS_RECURRENT_SCHEDULE
+static bool EPD_1in9_Scheduled = false;
+#endif
+static EPD_1in9_Callback EPD_1in9_Done = NULL;
+
+static bool EPD_1in9_Queue_Step(unsigned char step, const unsigned char *image);
+
 
 /******************************************************************************
 function :	GPIO Init
@@ -239,99 +283,281 @@ uint8_t EPD_1in9_init(void)
 
 void EPD_1in9_Write_Screen( unsigned char *image)
 {
-	Wire.beginTransmission(adds_com);
-	Wire.write(0xAC); // Close the sleep
-	Wire.write(0x2B); // turn on the power
-	Wire.write(0x40); // Write RAM address
-	Wire.write(0xA9); // Turn on the first SRAM
-	Wire.write(0xA8); // Shut down the first SRAM
-	Wire.endTransmission();
+	EPD_1in9_Queue_Write_Screen(image);
+	EPD_1in9_Start(NULL);
+	EPD_1in9_Wait();
+}
 
-	Wire.beginTransmission(adds_data);
-	for(char j = 0 ; j<15 ; j++ )
-		Wire.write(image[j]);
+void EPD_1in9_Write_Screen1( unsigned char *image)
+{
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_WRITE1, image);
+	EPD_1in9_Start(NULL);
+	EPD_1in9_Wait();
+}
 
-	Wire.write(0x00);
-	Wire.endTransmission();
+void EPD_1in9_sleep(void)
+{
+	EPD_1in9_Queue_Sleep();
+	EPD_1in9_Start(NULL);
+	EPD_1in9_Wait();
+}
 
+void EPD_1in9_Clear_Screen(void)
+{
+	EPD_1in9_Queue_Clear_Screen();
+	EPD_1in9_Start(NULL);
+	EPD_1in9_Wait();
+}
 
-	Wire.beginTransmission(adds_com);
-	Wire.write(0xAB); // Turn on the second SRAM
-	Wire.write(0xAA); // Shut down the second SRAM
-	Wire.write(0xAF); // display on
-	Wire.endTransmission();
+/******************************************************************************
+function :	Add a step to the display sequence
+parameter:
+    step  : EPD_1in9_STEP_*
+    image : 15 bytes of segment data for the write steps, copied (or NULL)
+return   :	false if the queue is full
+******************************************************************************/
+static bool EPD_1in9_Queue_Step(unsigned char step, const unsigned char *image)
+{
+	EPD_1in9_Step *entry;
 
-	EPD_1in9_ReadBusy();
-	//delay(2000);
-	
-	Wire.beginTransmission(adds_com);
-	Wire.write(0xAE); // display off
-	Wire.write(0x28); // HV OFF
-	Wire.write(0xAD); // sleep in	
-	Wire.endTransmission();
+	if (EPD_1in9_Queue_Count >= EPD_1in9_QUEUE_DEPTH)
+		return false;
+
+	entry = &EPD_1in9_Queue[(EPD_1in9_Queue_Head + EPD_1in9_Queue_Count) % EPD_1in9_QUEUE_DEPTH];
+	entry->step = step;
+	if (image)
+		memcpy(entry->image, image, sizeof(entry->image));
+	EPD_1in9_Queue_Count++;
+	return true;
 }
 
-void EPD_1in9_Write_Screen1( unsigned char *image)
+bool EPD_1in9_Queue_Write_Screen(const unsigned char *image)
 {
-	Wire.beginTransmission(adds_com);
-	Wire.write(0xAC); // Close the sleep
-	Wire.write(0x2B); // turn on the power
-	Wire.write(0x40); // Write RAM address
-	Wire.write(0xA9); // Turn on the first SRAM
-	Wire.write(0xA8); // Shut down the first SRAM
-	Wire.endTransmission();
+	return EPD_1in9_Queue_Step(EPD_1in9_STEP_WRITE, image);
+}
 
-	Wire.beginTransmission(adds_data);
-	for(char j = 0 ; j<15 ; j++ )
-		Wire.write(image[j]);
+bool EPD_1in9_Queue_Pause(void)
+{
+	return EPD_1in9_Queue_Step(EPD_1in9_STEP_PAUSE, NULL);
+}
 
-	Wire.write(0x03);
-	Wire.endTransmission();
+// the full refresh sequence of the waveshare example: clear with the boot
+// waveform, flash black and white with the GC waveform, then back to the
+// DU waveform for the partial refreshes
+bool EPD_1in9_Queue_Clear_Screen(void)
+{
+	if (EPD_1in9_Queue_Count + 9 > EPD_1in9_QUEUE_DEPTH)
+		return false;
+
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_LUT_5S, NULL);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_WRITE, DSPNUM_1in9_off);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_PAUSE, NULL);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_LUT_GC, NULL);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_WRITE1, DSPNUM_1in9_on);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_PAUSE, NULL);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_WRITE, DSPNUM_1in9_off);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_PAUSE, NULL);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_LUT_DU_WB, NULL);
+	return true;
+}
 
-	Wire.beginTransmission(adds_com);
-	Wire.write(0xAB); // Turn on the second SRAM
-	Wire.write(0xAA); // Shut down the second SRAM
-	Wire.write(0xAF); // display on
-	Wire.endTransmission();
+bool EPD_1in9_Queue_Sleep(void)
+{
+	if (EPD_1in9_Queue_Count + 3 > EPD_1in9_QUEUE_DEPTH)
+		return false;
 
-	EPD_1in9_ReadBusy();
-	//delay(2000);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_SLEEP, NULL);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_PAUSE, NULL);
+	EPD_1in9_Queue_Step(EPD_1in9_STEP_RESET, NULL);
+	return true;
+}
 
-	Wire.beginTransmission(adds_com);
-	Wire.write(0xAE); // display off
-	Wire.write(0x28); // HV OFF
-	Wire.write(0xAD); // sleep in	
-	Wire.endTransmission();
+/******************************************************************************
+function :	Busy pin interrupt, the controller finished a refresh
+parameter:
+******************************************************************************/
+static void ICACHE_RAM_ATTR EPD_1in9_Busy_ISR(void)
+{
+	EPD_1in9_Busy_Released = true;
+}
 
+static void EPD_1in9_Wait_Busy(void)
+{
+	EPD_1in9_Busy_Released = false;
+	attachInterrupt(digitalPinToInterrupt(EPD_BUSY_PIN), EPD_1in9_Busy_ISR, RISING);
+	EPD_1in9_Waiting = EPD_1in9_WAIT_BUSY;
+	EPD_1in9_Wait_Start = millis();
 }
 
-void EPD_1in9_sleep(void)
+// the pin is checked as well in case the refresh finished before the
+// interrupt was attached
+static bool EPD_1in9_Busy_Done(void)
 {
-	Wire.beginTransmission(adds_com);
-	Wire.write(0x28); // POWER_OFF
-	EPD_1in9_ReadBusy();
-	Wire.write(0xAD); // DEEP_SLEEP
-	Wire.endTransmission();
+	if ((millis() - EPD_1in9_Wait_Start) < EPD_1in9_BUSY_GUARD_MS)
+		return false;
+	if (!EPD_1in9_Busy_Released && (digitalRead(EPD_BUSY_PIN) != 1))
+		return false;
 
-	delay(50);
-	digitalWrite(EPD_RST_PIN, EPD_RST_POLARITY);
+	detachInterrupt(digitalPinToInterrupt(EPD_BUSY_PIN));
+	return true;
 }
 
-void EPD_1in9_Clear_Screen(void)
+/******************************************************************************
+function :	Start the first part of a step, up to what it has to wait for
+parameter:
+******************************************************************************/
+static void EPD_1in9_Begin_Step(EPD_1in9_Step *entry)
+{
+	switch (entry->step) {
+	case EPD_1in9_STEP_LUT_5S:
+		EPD_1in9_lut_5S();
+		break;
+	case EPD_1in9_STEP_LUT_GC:
+		EPD_1in9_lut_GC();
+		break;
+	case EPD_1in9_STEP_LUT_DU_WB:
+		EPD_1in9_lut_DU_WB();
+		break;
+	case EPD_1in9_STEP_WRITE:
+	case EPD_1in9_STEP_WRITE1:
+		Wire.beginTransmission(adds_com);
+		Wire.write(0xAC); // Close the sleep
+		Wire.write(0x2B); // turn on the power
+		Wire.write(0x40); // Write RAM address
+		Wire.write(0xA9); // Turn on the first SRAM
+		Wire.write(0xA8); // Shut down the first SRAM
+		Wire.endTransmission();
+
+		Wire.beginTransmission(adds_data);
+		for(char j = 0 ; j<15 ; j++ )
+			Wire.write(entry->image[j]);
+
+		Wire.write((EPD_1in9_STEP_WRITE1 == entry->step) ? 0x03 : 0x00);
+		Wire.endTransmission();
+
+		Wire.beginTransmission(adds_com);
+		Wire.write(0xAB); // Turn on the second SRAM
+		Wire.write(0xAA); // Shut down the second SRAM
+		Wire.write(0xAF); // display on
+		Wire.endTransmission();
+
+		EPD_1in9_Wait_Busy();
+		break;
+	case EPD_1in9_STEP_PAUSE:
+		EPD_1in9_Waiting = EPD_1in9_WAIT_PAUSE;
+		EPD_1in9_Wait_Start = millis();
+		break;
+	case EPD_1in9_STEP_SLEEP:
+		EPD_1in9_Wait_Busy();
+		break;
+	case EPD_1in9_STEP_RESET:
+		digitalWrite(EPD_RST_PIN, EPD_RST_POLARITY);
+		break;
+	}
+}
+
+/******************************************************************************
+function :	Finish a step once what it waited for is done
+parameter:
+******************************************************************************/
+static void EPD_1in9_End_Step(EPD_1in9_Step *entry)
+{
+	switch (entry->step) {
+	case EPD_1in9_STEP_WRITE:
+	case EPD_1in9_STEP_WRITE1:
+		Wire.beginTransmission(adds_com);
+		Wire.write(0xAE); // display off
+		Wire.write(0x28); // HV OFF
+		Wire.write(0xAD); // sleep in	
+		Wire.endTransmission();
+		break;
+	case EPD_1in9_STEP_SLEEP:
+		Wire.beginTransmission(adds_com);
+		Wire.write(0x28); // POWER_OFF
+		Wire.write(0xAD); // DEEP_SLEEP
+		Wire.endTransmission();
+		break;
+	}
+}
+
+/******************************************************************************
+function :	Advance the display sequence as far as possible without blocking
+            called from a recurrent scheduled function (i.e. from loop(),
+            delay() and yield()) while a sequence is running
+return   :	true while the sequence is not finished
+******************************************************************************/
+bool EPD_1in9_Poll(void)
+{
+	static bool polling = false;
+	EPD_1in9_Callback done;
+
+	// the I2C writes of a step may yield
+	if (polling)
+		return true;
+	polling = true;
+
+	while (EPD_1in9_Queue_Count > 0) {
+		EPD_1in9_Step *entry = &EPD_1in9_Queue[EPD_1in9_Queue_Head];
+
+		if (EPD_1in9_WAIT_NONE == EPD_1in9_Waiting) {
+			EPD_1in9_Begin_Step(entry);
+		} else if (EPD_1in9_WAIT_BUSY == EPD_1in9_Waiting) {
+			if (!EPD_1in9_Busy_Done())
+				break;
+			EPD_1in9_Waiting = EPD_1in9_WAIT_NONE;
+			EPD_1in9_End_Step(entry);
+		} else if ((millis() - EPD_1in9_Wait_Start) >= EPD_1in9_PAUSE_MS) {
+			EPD_1in9_Waiting = EPD_1in9_WAIT_NONE;
+		}
+
+		if (EPD_1in9_WAIT_NONE != EPD_1in9_Waiting)
+			break;
+		EPD_1in9_Queue_Head = (EPD_1in9_Queue_Head + 1) % EPD_1in9_QUEUE_DEPTH;
+		EPD_1in9_Queue_Count--;
+	}
+
+	polling = false;
+	if (EPD_1in9_Queue_Count > 0)
+		return true;
+
+	done = EPD_1in9_Done;
+	EPD_1in9_Done = NULL;
+	if (done)
+		done();
+	return false;
+}
+
+/******************************************************************************
+function :	Run the queued steps in the background
+parameter:
+    done : called (from loop context) when the sequence has finished, or NULL
+******************************************************************************/
+void EPD_1in9_Start(EPD_1in9_Callback done)
+{
+	EPD_1in9_Done = done;
+
+#if CORE_HAS_RECURRENT_SCHEDULE
+	if (EPD_1in9_Poll() && !EPD_1in9_Scheduled) {
+		EPD_1in9_Scheduled = schedule_recurrent_function_us([]() {
+			EPD_1in9_Scheduled = EPD_1in9_Poll();
+			return EPD_1in9_Scheduled;
+		}, 1000);
+	}
+#else
+	// nothing would advance the sequence in the background, so it runs to
+	// the end here like the blocking calls did
+	EPD_1in9_Wait();
+#endif
+}
+
+/******************************************************************************
+function :	Block until the display sequence has finished
+parameter:
+******************************************************************************/
+void EPD_1in9_Wait(void)
 {
-  EPD_1in9_lut_5S();
-	EPD_1in9_Write_Screen(DSPNUM_1in9_off);
-	delay(50);
-	
-	EPD_1in9_lut_GC();
-	
-	EPD_1in9_Write_Screen1(DSPNUM_1in9_on);
-	delay(50);
-	
-	EPD_1in9_Write_Screen(DSPNUM_1in9_off);
-	delay(50);
-	
-	EPD_1in9_lut_DU_WB();
+	while (EPD_1in9_Poll())
+		delay(1);
 }
 
 void EPD_1in9_Set_Temp(unsigned char temp)
@@ -342,7 +568,30 @@ void EPD_1in9_Set_Temp(unsigned char temp)
 void EPD_1in9_Easy_Write_Full_Screen(float temp, float humidity, bool fahrenheit, bool connect,
   bool connection_error, bool low_battery, bool critical_battery)
 {
-  unsigned char ram_buffer[15] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+  EPD_1in9_Easy_Queue_Full_Screen(temp, humidity, fahrenheit, connect, connection_error, low_battery, critical_battery);
+  EPD_1in9_Start(NULL);
+  EPD_1in9_Wait();
+}
+
+bool EPD_1in9_Easy_Queue_Full_Screen(float temp, float humidity, bool fahrenheit, bool connect,
+  bool connection_error, bool low_battery, bool critical_battery)
+{
+  unsigned char ram_buffer[15];
+
+  EPD_1in9_Easy_Render_Full_Screen(ram_buffer, temp, humidity, fahrenheit, connect, connection_error, low_battery, critical_battery);
+
+  // ship it
+  if (EPD_1in9_Queue_Count + 2 > EPD_1in9_QUEUE_DEPTH)
+    return false;
+  EPD_1in9_Queue_Write_Screen(ram_buffer);
+  EPD_1in9_Queue_Pause();
+  return true;
+}
+
+// build up the 15 bytes of segment data for the parameters in ram_buffer
+void EPD_1in9_Easy_Render_Full_Screen(unsigned char *ram_buffer, float temp, float humidity, bool fahrenheit, bool connect,
+  bool connection_error, bool low_battery, bool critical_battery)
+{
   unsigned char i;
   const unsigned char symbols[11][2] = {
     {0xbf, 0x1f}, //0
@@ -358,6 +607,8 @@ void EPD_1in9_Easy_Write_Full_Screen(float temp, float humidity, bool fahrenheit
     {0x44, 0x04}, //NaN
   };
 
+  memset(ram_buffer, 0, 15);
+
   // correct bogus inputs
   if (temp >= 200.0f)
     temp = 199.9f;
@@ -480,8 +731,4 @@ void EPD_1in9_Easy_Write_Full_Screen(float temp, float humidity, bool fahrenheit
         ram_buffer[13] |= 0x05;
     }
   }
-
-  // ship it
-  EPD_1in9_Write_Screen(ram_buffer);
-  delay(50);
 }
@@ -12,6 +12,9 @@
 #define adds_com  	0x3C
 #define adds_data	0x3D
 
+// completion callback of a queued display sequence
+typedef void (*EPD_1in9_Callback)(void);
+
 extern unsigned char DSPNUM_1in9_on[];
 extern unsigned char DSPNUM_1in9_off[];
 
@@ -35,4 +38,18 @@ void EPD_1in9_Set_Temp(unsigned char temp);
 void EPD_1in9_Easy_Write_Full_Screen(float temp, float humidity, bool fahrenheit=false, bool connect=false,
   bool connection_error=false, bool low_battery=false, bool critical_battery=false);
 
+// asynchronous display API: queue the steps of a sequence, then start it
+// it runs in the background and the busy pin interrupt signals each refresh
+bool EPD_1in9_Queue_Write_Screen(const unsigned char *image);
+bool EPD_1in9_Queue_Pause(void);
+bool EPD_1in9_Queue_Clear_Screen(void);
+bool EPD_1in9_Queue_Sleep(void);
+bool EPD_1in9_Easy_Queue_Full_Screen(float temp, float humidity, bool fahrenheit=false, bool connect=false,
+  bool connection_error=false, bool low_battery=false, bool critical_battery=false);
+void EPD_1in9_Easy_Render_Full_Screen(unsigned char *ram_buffer, float temp, float humidity, bool fahrenheit=false,
+  bool connect=false, bool connection_error=false, bool low_battery=false, bool critical_battery=false);
+void EPD_1in9_Start(EPD_1in9_Callback done);
+bool EPD_1in9_Poll(void);
+void EPD_1in9_Wait(void);
+
 #endif
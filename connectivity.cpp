@@ -5,6 +5,7 @@
 #include <ESP8266WiFi.h>
 #include <MD5Builder.h>
 #include <Updater.h>
+#include <lwip/tcp.h>
 #include <WiFiManager.h>
 #if EXTRA_DEBUG
 #include <user_interface.h>
@@ -13,6 +14,121 @@
 #include "connectivity.h"
 #include "persistent.h"
 #include "rtc_mem.h"
+#include "spill_log.h"
+
+
+/* Types and Enums */
+// messages are formatted in place and flushed to the client one TCP segment at a time
+#ifdef TCP_MSS
+#define REPORT_WRITER_SIZE      (TCP_MSS)
+#else
+#define REPORT_WRITER_SIZE      (536)
+#endif
+
+#define REPORT_V3_MAGIC         (0xA5)
+#define REPORT_V3_TYPE_READINGS (1)
+#define REPORT_V3_FLAG_LAST     (1 << 0)  //last batch of the upload, uptime is valid
+#define REPORT_V3_FLAG_TELEMETRY (1 << 1) //a report_v3_telemetry_t trailer follows the frames
+#define REPORT_V3_FLAG_SENSOR_STATS (1 << 2) //a report_v3_sensor_stats_t trailer precedes the telemetry
+#define FIRMWARE_PATCH_MAGIC    (0x50544F49) //"IOTP"
+#define FIRMWARE_PATCH_RUN      (128)        //longest run of diff bytes in a patch
+
+// firmware image encodings that update_firmware accepts besides a plain image
+#if FIRMWARE_UPDATE_GZIP && FIRMWARE_UPDATE_PATCH
+#define FIRMWARE_ENCODINGS      ",\"encoding\":\"gzip,patch\""
+#elif FIRMWARE_UPDATE_GZIP
+#define FIRMWARE_ENCODINGS      ",\"encoding\":\"gzip\""
+#elif FIRMWARE_UPDATE_PATCH
+#define FIRMWARE_ENCODINGS      ",\"encoding\":\"patch\""
+#else
+#define FIRMWARE_ENCODINGS      ""
+#endif
+
+// Header of a binary (version 3) readings message, all fields are little-endian
+// It is followed by num_frames frames as encoded by encode_frame, starting from an empty state.
+typedef struct report_v3_header_s {
+  uint8_t  magic;           // REPORT_V3_MAGIC, never '{' so the server can tell it from json
+  uint8_t  version;         // 3
+  uint16_t length;          // number of bytes following this field
+  uint32_t node_hash;       // FNV-1a hash of the node name
+  uint32_t firmware;        // preinit_magic
+  uint8_t  type;            // REPORT_V3_TYPE_READINGS
+  uint8_t  flags;           // REPORT_V3_FLAG_*
+  uint16_t num_frames;      // number of frames in the message
+  uint64_t uptime;          // uptime in ms (only valid with REPORT_V3_FLAG_LAST)
+  uint32_t time_offset;     // age in ms of the oldest frame
+  float    calibrations[4]; // temperature, humidity, pressure, battery offset calibrations
+  uint32_t sequence;        // numbers the binary messages of a connection, see receive_response
+} report_v3_header_t;
+
+// A batch of readings that was sent to the report server but not acknowledged yet
+typedef struct upload_batch_s {
+  uint32_t sequence;    // sequence number of the binary message
+  unsigned num_frames;  // number of frames that are released by the acknowledgement
+  bool     spilled;     // the frames were replayed from the spill log
+} upload_batch_t;
+
+// Trailer of the last binary readings message of an upload (see REPORT_V3_FLAG_TELEMETRY)
+typedef struct report_v3_telemetry_s {
+  uint8_t  dns_hits;        // uploads that used the cached report server address
+  uint8_t  dns_misses;      // uploads that resolved the report server host name
+  uint16_t reserved;
+} report_v3_telemetry_t;
+
+// Trailer of the last binary readings message of an upload, between the frames
+// and the report_v3_telemetry_t (see REPORT_V3_FLAG_SENSOR_STATS)
+typedef struct report_v3_sensor_stats_s {
+  uint8_t  sht30_low;         // SHT30 samples at each repeatability since the last report
+  uint8_t  sht30_med;
+  uint8_t  sht30_high;
+  uint8_t  sht30_crc_errors;  // SHT30 samples discarded for a bad checksum
+} report_v3_sensor_stats_t;
+
+// Header of a firmware update patch (see firmware_patch.py), all fields are little-endian
+// It is followed by bsdiff-style records (firmware_patch_record_t), each followed by
+// the zero-run encoded diff bytes and the extra bytes.
+typedef struct firmware_patch_header_s {
+  uint32_t magic;           // FIRMWARE_PATCH_MAGIC
+  uint32_t old_size;        // size of the image the patch applies to
+  uint32_t new_size;        // size of the patched image
+  uint8_t  old_md5[16];     // md5sum of the image the patch applies to
+  uint8_t  new_md5[16];     // md5sum of the patched image
+} firmware_patch_header_t;
+
+typedef struct firmware_patch_record_s {
+  uint32_t diff_len;        // bytes added to the running image
+  uint32_t extra_len;       // bytes copied from the patch
+  int32_t  seek;            // moves the running image position after the record
+} firmware_patch_record_t;
+
+// Header of a staged firmware download (PERSISTENT_FIRMWARE_STAGE), followed by the
+// bytes received so far, so a download that is cut off resumes on a later wake
+typedef struct firmware_stage_s {
+  char     md5[33];         // md5sum sent by the server, identifies the download
+  uint8_t  patch;           // the download is a patch (see apply_patch)
+  uint16_t reserved;
+  uint32_t size;            // size of the complete download
+} firmware_stage_t;
+
+typedef struct report_v3_msg_s {
+  report_v3_header_t header;
+  uint8_t            frames[RTC_DATA_SIZE + sizeof(report_v3_sensor_stats_t) + sizeof(report_v3_telemetry_t)];
+} report_v3_msg_t;
+
+// Streaming writer for json messages, so they don't have to be assembled in a String
+typedef struct report_writer_s {
+  WiFiClient *client;
+  size_t      len;                      // bytes pending in buf
+  bool        error;                    // a flush was not fully transmitted
+  char        buf[REPORT_WRITER_SIZE];
+} report_writer_t;
+
+// A config file listed in the manifest of the report server
+typedef struct config_entry_s {
+  size_t index;  // index into config_filenames
+  bool   fetch;  // the pending file differs from the stored one
+  bool   acked;  // the pending file can be deleted on the server
+} config_entry_t;
 
 
 /* Global Data Structures */
@@ -48,31 +164,68 @@ const char* config_label_battery_calib    = "><label for=\"" PERSISTENT_BATTERY_
 const char* config_label_sleep_time_ms    = "><label for=\"" PERSISTENT_SLEEP_TIME_MS "\">Custom Sleep Period Between Measurements (ms)</label";
 const char* config_label_high_water_slot  = "><label for=\"" PERSISTENT_HIGH_WATER_SLOT "\">Upload After #Measurements</label";
 
-String nodename;
+// config files that can be updated by the report server
+const char* config_filenames[] = {
+  PERSISTENT_NODE_NAME,
+  PERSISTENT_REPORT_HOST_NAME,
+  PERSISTENT_REPORT_HOST_PORT,
+  PERSISTENT_CLOCK_CALIB,
+  PERSISTENT_TEMP_CALIB,
+  PERSISTENT_HUMIDITY_CALIB,
+  PERSISTENT_PRESSURE_CALIB,
+  PERSISTENT_BATTERY_CALIB,
+  PERSISTENT_SLEEP_TIME_MS,
+  PERSISTENT_HIGH_WATER_SLOT,
+};
+#define NUM_CONFIG_FILES (sizeof(config_filenames)/sizeof(*config_filenames))
+
 unsigned long server_shutdown_timeout;
 
+// WiFi connection attempt that was started by start_wifi and is completed by connect_wifi
+static enum { WIFI_ATTEMPT_NONE, WIFI_ATTEMPT_FAST, WIFI_ATTEMPT_NORMAL } wifi_attempt = WIFI_ATTEMPT_NONE;
+static unsigned long wifi_attempt_start;
+
 /* Function Prototypes */
-static String format_u64(uint64_t val);
-static bool try_connect(float power_level);
-static String json_header(void);
-static int transmit_readings(WiFiClient& client, float calibrations[4]);
+static void begin_connect(float power_level);
+static bool wait_connect(void);
+static bool begin_fast_connect(float power_level);
+static bool wait_fast_connect(void);
+static void save_wifi_cache(void);
+static uint32_t report_host_address(report_host_t *report_host, bool *cached);
+static bool connect_report_host(WiFiClient& client, uint32_t ip, uint16_t port);
+static int transmit_readings(WiFiClient& client, float calibrations[4], reading_frame_t *frame, bool last_batch, uint32_t sequence, bool *sent);
+static bool receive_response(WiFiClient& client, bool *update_flag, bool *config_flag, uint32_t *ack);
 static bool update_config(WiFiClient& client);
+static bool update_config_files(WiFiClient& client);
+static bool receive_config_file(WiFiClient& client, size_t i, unsigned len, const char *md5sum);
+static bool config_file_matches(const char *filename, unsigned size, const char *md5sum);
+static void append_config_name(char *names, size_t size, const char *filename);
 #if !DISABLE_FW_UPDATE
 static bool update_firmware(WiFiClient& client);
+static unsigned request_firmware(WiFiClient& client, const firmware_stage_t *stage, unsigned offset, firmware_stage_t *offer, int *resume);
+static bool receive_firmware(WiFiClient& client, firmware_stage_t *stage, unsigned offset, unsigned len);
+static bool stream_firmware(WiFiClient& client, firmware_stage_t *stage, int resume);
+static bool skip_firmware(WiFiClient& client, unsigned len);
+static bool apply_firmware(Stream& in, const firmware_stage_t *stage);
+#if FIRMWARE_UPDATE_PATCH
+static bool apply_patch(Stream& in, unsigned len);
+static bool read_patch(Stream& in, uint8_t *buf, size_t len, unsigned *remaining);
+static bool read_sketch(uint32_t offset, uint8_t *buf, size_t len);
+#endif
 #endif
-static bool send_command(WiFiClient& client, String& command);
+static bool send_command(WiFiClient& client, const char *command, const char *arg);
+static bool send_message(WiFiClient& client, const uint8_t *buf, size_t len);
+static report_writer_t* writer_begin(WiFiClient& client);
+static void writer_write(report_writer_t *writer, const char *data, size_t len);
+static void writer_print(report_writer_t *writer, const char *str);
+static void writer_print_u64(report_writer_t *writer, uint64_t val);
+static void writer_print_float(report_writer_t *writer, double val, unsigned char decimals);
+static void writer_json_header(report_writer_t *writer);
+static bool writer_end(report_writer_t *writer);
+static void writer_flush(report_writer_t *writer);
 
 
 /* Functions */
-// helper to format a uint64_t as a String object
-static String format_u64(uint64_t val)
-{
-  char llu[21];
-  llu[20]='\0';
-  sprintf(llu, "%llu", val);
-  return String(llu);
-}
-
 #if !TETHERED_MODE
 // initializer called from the preinit() function
 void connectivity_preinit(void)
@@ -88,11 +241,8 @@ void connectivity_preinit(void)
 // initializer called from setup()
 void connectivity_init(void)
 {
-  nodename = persistent_read(PERSISTENT_NODE_NAME);
-  if (nodename == NULL) {
-    nodename = String(DEFAULT_NODE_BASE_NAME);
-    nodename += String(ESP.getChipId());
-  }
+  // nothing to do, the config (including the node name) is only read from
+  // SPIFFS when it is needed, uploads use the copies in rtc mem
 }
 
 // shutdown wifi
@@ -101,35 +251,35 @@ void connectivity_disable(void)
   WiFi.mode(WIFI_OFF);
 }
 
-// helper to attempt a WiFi connection with timeout
-static bool try_connect(float power_level)
+// helper to start a WiFi connection to the stored config
+static void begin_connect(float power_level)
 {
-  wl_status_t wifi_status = WL_DISCONNECTED;
-  unsigned long timeout;
-
-  if (WiFi.isConnected())
-  {
-    Serial.println("WiFi status is connected");
-    return true;
-  }
-
   WiFi.mode(WIFI_STA);
   WiFi.setOutputPower(power_level);
   WiFi.reconnect();
 
+  wifi_attempt = WIFI_ATTEMPT_NORMAL;
+  wifi_attempt_start = millis();
+}
+
+// helper to wait for the connection started by begin_connect with timeout
+static bool wait_connect(void)
+{
+  wl_status_t wifi_status = WL_DISCONNECTED;
+
   //make our own "waitForConnectResult" so we can have a timeout shorter than 250 seconds
-  timeout = millis();
-  while ((millis()-timeout) < WIFI_CONNECT_TIMEOUT) {
+  //the status is read once more after the timeout, since the readings and the
+  //display may have taken longer than that while the connection was being made
+  while (true) {
+    bool timeout = ((millis()-wifi_attempt_start) >= WIFI_CONNECT_TIMEOUT);
     wifi_status = WiFi.status();
-    if (wifi_status != WL_DISCONNECTED)
+    if ((wifi_status != WL_DISCONNECTED) || timeout)
       break;
     delay(100);
   }
 
 #if (EXTRA_DEBUG != 0)
-  Serial.print("WiFi status (power level ");
-  Serial.print(power_level);
-  Serial.print(") ");
+  Serial.print("WiFi status ");
   switch(wifi_status) {
     case WL_NO_SHIELD: Serial.println("WL_NO_SHIELD"); break;
     case WL_IDLE_STATUS: Serial.println("WL_IDLE_STATUS"); break;
@@ -146,17 +296,143 @@ static bool try_connect(float power_level)
   return (wifi_status == WL_CONNECTED);
 }
 
-// connect to the stored WiFi AP and return the status
-bool connect_wifi(void)
+// helper to start a WiFi connection to the BSSID and channel of the last
+// association, with the IP settings from its DHCP lease, to skip the scan and DHCP
+// returns false if there is no usable cache
+static bool begin_fast_connect(float power_level)
 {
-  bool retval = false;
+  wifi_cache_t *cache = (wifi_cache_t*) &rtc_mem[RTC_MEM_WIFI_CACHE];
 
-  if (WiFi.isConnected())
-  {
-    Serial.println("WiFi status is connected");
+  if ((0 == cache->channel) || (cache->num_uses >= WIFI_FAST_CONNECT_MAX_USES))
+    return false;
+  cache->num_uses++;
+
+  WiFi.mode(WIFI_STA);
+  WiFi.setOutputPower(power_level);
+  WiFi.config(IPAddress(cache->ip), IPAddress(cache->gateway), IPAddress(cache->subnet), IPAddress(cache->dns));
+
+  // don't write the BSSID and channel to the stored config in flash on every wake
+  WiFi.persistent(false);
+  WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str(), cache->channel, cache->bssid);
+  WiFi.persistent(true);
+
+  wifi_attempt = WIFI_ATTEMPT_FAST;
+  wifi_attempt_start = millis();
+  return true;
+}
+
+// helper to wait for the connection started by begin_fast_connect with timeout
+static bool wait_fast_connect(void)
+{
+  wifi_cache_t *cache = (wifi_cache_t*) &rtc_mem[RTC_MEM_WIFI_CACHE];
+  struct station_config conf;
+  wl_status_t wifi_status = WL_DISCONNECTED;
+
+  // the status is read once more after the timeout, see wait_connect
+  while (true) {
+    bool timeout = ((millis()-wifi_attempt_start) >= WIFI_FAST_CONNECT_TIMEOUT);
+    wifi_status = WiFi.status();
+    if (wifi_status == WL_CONNECTED)
+      return true;
+    if (timeout)
+      break;
+    delay(10);
+  }
+
+#if (EXTRA_DEBUG != 0)
+  Serial.print("WiFi fast connect failed, status ");
+  Serial.println(wifi_status);
+#endif
+
+  // forget the cache and go back to DHCP with the stored config (no BSSID lock)
+  memset(cache, 0, sizeof(*cache));
+  WiFi.config(0u, 0u, 0u);
+  if (wifi_station_get_config_default(&conf))
+    wifi_station_set_config_current(&conf);
+
+  return false;
+}
+
+// helper to cache the parameters of the current WiFi association for begin_fast_connect
+static void save_wifi_cache(void)
+{
+  wifi_cache_t *cache = (wifi_cache_t*) &rtc_mem[RTC_MEM_WIFI_CACHE];
+
+  memcpy(cache->bssid, WiFi.BSSID(), sizeof(cache->bssid));
+  cache->channel = WiFi.channel();
+  cache->num_uses = 0;
+  cache->ip = WiFi.localIP();
+  cache->gateway = WiFi.gatewayIP();
+  cache->subnet = WiFi.subnetMask();
+  cache->dns = WiFi.dnsIP();
+}
+
+// helper to look up the address of the report server
+// host names are resolved at most once per REPORT_HOST_DNS_TTL and the
+// address is cached in rtc mem, an IP address in the config is always used
+// cached - set if a previously resolved address was returned
+// returns 0 if the host name could not be resolved
+static uint32_t report_host_address(report_host_t *report_host, bool *cached)
+{
+  uint32_t now = uptime() / 1000;
+  const char *report_host_name;
+  IPAddress ip;
+
+  *cached = false;
+  if ((0 != report_host->ip) && (0 == report_host->expiry))
+    return report_host->ip;
+
+  if ((0 != report_host->ip) && (now < report_host->expiry)) {
+    *cached = true;
+    if (report_host->dns_hits < UINT8_MAX)
+      report_host->dns_hits++;
+    return report_host->ip;
+  }
+
+  if (report_host->dns_misses < UINT8_MAX)
+    report_host->dns_misses++;
+  report_host_name = persistent_config()->report_host_name;
+  Serial.print("Resolving report server ");
+  Serial.println(report_host_name);
+  if (WiFi.hostByName(report_host_name, ip)) {
+    report_host->ip = ip;
+    report_host->expiry = now + REPORT_HOST_DNS_TTL;
+  } else {
+    Serial.println("error: report server host name not resolved");
+    report_host->ip = 0;
+  }
+
+  return report_host->ip;
+}
+
+// helper to open the connection to the report server
+static bool connect_report_host(WiFiClient& client, uint32_t ip, uint16_t port)
+{
+  if (0 == ip)
+    return false;
+
+  Serial.print("Connecting to report server ");
+  Serial.print(IPAddress(ip).toString());
+  Serial.print(":");
+  Serial.println(port);
+  if (client.connect(IPAddress(ip), port)) {
+    // send each message right away, with Nagle the pipelined binary messages
+    // would wait for the acknowledgement of the previous segment
+    client.setNoDelay(true);
     return true;
   }
 
+  Serial.println("Connection Failed");
+  return false;
+}
+
+// start connecting to the stored WiFi AP without waiting for the result, so
+// that the readings can be taken and displayed while the radio associates
+void start_wifi(void)
+{
+  if ((WIFI_ATTEMPT_NONE != wifi_attempt) || WiFi.isConnected())
+    return;
+
   Serial.println("Connecting to AP");
 #if EXTRA_DEBUG
   struct station_config configdata;
@@ -166,8 +442,38 @@ bool connect_wifi(void)
 #endif
 
   //recommended output power 17.5 dBm to reduce noise compared to max power 20.5 dBm
-  retval = try_connect(17.5f);
+  if (!begin_fast_connect(17.5f))
+    begin_connect(17.5f);
+}
+
+// connect to the stored WiFi AP and return the status
+// completes the connection attempt of start_wifi, or makes one
+bool connect_wifi(void)
+{
+  bool retval = false;
+
+  if (WiFi.isConnected())
+  {
+    Serial.println("WiFi status is connected");
+    wifi_attempt = WIFI_ATTEMPT_NONE;
+    return true;
+  }
+
+  start_wifi();
 
+  if (WIFI_ATTEMPT_FAST == wifi_attempt) {
+    retval = wait_fast_connect();
+    if (!retval)
+      begin_connect(17.5f);
+  }
+
+  if (WIFI_ATTEMPT_NORMAL == wifi_attempt) {
+    retval = wait_connect();
+    if (retval)
+      save_wifi_cache();
+  }
+
+  wifi_attempt = WIFI_ATTEMPT_NONE;
   return retval;
 }
 
@@ -175,10 +481,8 @@ static void wifi_manager_save_config_callback(void)
 {
   const char* value;
   value = custom_node_name->getValue();
-  if (value && value[0]) {
+  if (value && value[0])
     persistent_write(PERSISTENT_NODE_NAME, value);
-    nodename = value;
-  }
   value = custom_report_host->getValue();
   if (value && value[0])
     persistent_write(PERSISTENT_REPORT_HOST_NAME, value);
@@ -288,15 +592,18 @@ static void wifi_manager_save_config_callback(void)
       persistent_write(PERSISTENT_HIGH_WATER_SLOT, ""); //erase existing high-water slot
       sleep_params->high_water_slot = DEFAULT_HIGH_WATER_SLOT;
     } else {
-      if (persistent_write(PERSISTENT_SLEEP_TIME_MS, value)) {
+      if (persistent_write(PERSISTENT_HIGH_WATER_SLOT, value)) {
         if (temp <= 0)
           temp = 1;
-        if (temp > NUM_STORAGE_SLOTS)
-          temp = NUM_STORAGE_SLOTS;
+        if (temp > RTC_MAX_FRAMES)
+          temp = RTC_MAX_FRAMES;
         sleep_params->high_water_slot = temp;
       }
     }
   }
+
+  // update the rtc mem copies of the remaining config values
+  load_rtc_config();
 }
 
 // run the WiFi configuration mode
@@ -308,7 +615,7 @@ void enter_config_mode(void)
   // the stored SSID/password when WiFi.mode is STA.
   WiFi.mode(WIFI_OFF); 
 
-  config_hint_node_name        = persistent_read(PERSISTENT_NODE_NAME,        nodename);
+  config_hint_node_name        = persistent_config()->node_name;
   config_hint_report_host_name = persistent_read(PERSISTENT_REPORT_HOST_NAME, "report server hostname/IP");
   config_hint_report_host_port = persistent_read(PERSISTENT_REPORT_HOST_PORT, "report server port number");
   config_hint_clock_calib      = persistent_read(PERSISTENT_CLOCK_CALIB,      "clock drift (ms)");
@@ -350,8 +657,8 @@ void enter_config_mode(void)
   wifi_station_get_config_default(&conf);
   Serial.printf("default config SSID: %.*s\n", sizeof(conf.ssid), conf.ssid);
   Serial.print("Connect to AP ");
-  Serial.println(nodename);
-  if (wifi_manager.startConfigPortal(nodename.c_str())) {
+  Serial.println(persistent_config()->node_name);
+  if (wifi_manager.startConfigPortal(persistent_config()->node_name)) {
     Serial.println("Config portal result Success");
   } else {
     Serial.println("Config portal result Failed");
@@ -359,81 +666,116 @@ void enter_config_mode(void)
 }
 
 // manage the uploading of the readings to the report server
-void upload_readings(void)
+// returns true if the report server acknowledged readings, or there were none to upload
+bool upload_readings(void)
 {
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
   WiFiClient client;
-  String report_host_name;
-  String response;
+  report_host_t *report_host = (report_host_t*) &rtc_mem[RTC_MEM_REPORT_HOST];
   float calibrations[4];
-  unsigned long timeout;
   int xmit_status;
-  uint16_t report_host_port;
+  uint32_t ip;
+  bool cached;
+  bool connected;
   bool update_flag = false;
   bool config_flag = false;
+  bool retval = false;
 
-  report_host_name =  persistent_read(PERSISTENT_REPORT_HOST_NAME, String(DEFAULT_REPORT_HOST_NAME));
-  report_host_port = persistent_read(PERSISTENT_REPORT_HOST_PORT, (int)DEFAULT_REPORT_HOST_PORT);
-  calibrations[0] = persistent_read(PERSISTENT_TEMP_CALIB, DEFAULT_TEMP_CALIB);
-  calibrations[1] = persistent_read(PERSISTENT_HUMIDITY_CALIB, DEFAULT_HUMIDITY_CALIB);
-  calibrations[2] = persistent_read(PERSISTENT_PRESSURE_CALIB, DEFAULT_PRESSURE_CALIB);
-  calibrations[3] = persistent_read(PERSISTENT_BATTERY_CALIB, DEFAULT_BATTERY_CALIB);
+  calibrations[0] = *((float*)&rtc_mem[RTC_MEM_TEMP_CAL]);
+  calibrations[1] = *((float*)&rtc_mem[RTC_MEM_HUMIDITY_CAL]);
+  calibrations[2] = *((float*)&rtc_mem[RTC_MEM_PRESSURE_CAL]);
+  calibrations[3] = *((float*)&rtc_mem[RTC_MEM_BATTERY_CAL]);
+
+  ip = report_host_address(report_host, &cached);
+  connected = connect_report_host(client, ip, report_host->port);
+  if (!connected && cached) {
+    // the cached address may be stale, resolve the host name again
+    report_host->ip = 0;
+    ip = report_host_address(report_host, &cached);
+    connected = connect_report_host(client, ip, report_host->port);
+  }
+  if (connected) {
+    upload_batch_t window[REPORT_WINDOW_SIZE]; // batches awaiting acknowledgement, oldest first
+    unsigned num_batches = 0;
+    unsigned spill_in_flight = 0;
+    uint32_t sequence = 0;
+    reading_frame_t frame;
+    bool spill_done = false;
+    bool upload_ok = true;
 
-  Serial.print("Connecting to report server ");
-  Serial.print(report_host_name);
-  Serial.print(":");
-  Serial.println(report_host_port);
-  if (!client.connect(report_host_name, report_host_port)) {
-    Serial.println("Connection Failed");
-  } else {
     // This will send a string to the server
     Serial.println("Sending data to report server");
-    while (rtc_mem[RTC_MEM_NUM_READINGS] > 0) {
-      xmit_status = transmit_readings(client, calibrations);
-      if (xmit_status <= 0) {
-        break;
-      } else {
-        // wait for response to be available
-        timeout = millis();
-        while (client.available() == 0) {
-          if (millis() - timeout > REPORT_RESPONSE_TIMEOUT) {
-            Serial.println("Timeout waiting for response!");
-            break;
-          }
-          yield();
+
+    // replay the readings that were spilled to flash first (oldest-first),
+    // then the ones in the rtc mem ring buffer
+    // binary messages are pipelined, json messages are sent one at a time
+    frame.index = 0;
+    frame.num_frames = 0;
+    while (upload_ok) {
+      unsigned window_size = (flags->flags & FLAG_BIT_REPORT_V3) ? REPORT_WINDOW_SIZE : 1;
+      uint32_t ack;
+      bool binary;
+      bool sent;
+
+      while (num_batches < window_size) {
+        if ((frame.index == frame.num_frames) && !spill_done && !spill_log_rewind(&frame, spill_in_flight)) {
+          spill_done = true;
+          rewind_frames(&frame);
         }
+        if (frame.index == frame.num_frames)
+          break; // every frame has been sent
 
-        if (client.available()) {
-          // Read response from the report server
-          response = client.readStringUntil(0);
+        binary = flags->flags & FLAG_BIT_REPORT_V3;
+        xmit_status = transmit_readings(client, calibrations, &frame, spill_done, sequence, &sent);
+        if (xmit_status <= 0) {
+          upload_ok = false;
+          break;
+        }
 
-          Serial.print("Response from report server: ");
-          Serial.println(response);
-          if (response.startsWith("OK")) {
-            clear_readings(xmit_status);
-            response.replace("OK,","");
+        // the rest of a spill log block without measurements is not sent, it
+        // is released along with the batch before it, or right away if there
+        // is none (the last batch, from the ring buffer, is always sent)
+        if (!sent) {
+          if (num_batches > 0) {
+            window[num_batches-1].num_frames += xmit_status;
+            spill_in_flight += xmit_status;
+          } else {
+            spill_log_ack(xmit_status);
           }
+          continue;
+        }
 
-          // no real error handling, just remove flag and check for update
-          if (response.startsWith("error")) {
-            response.replace("error,","");
-            client.stop();  // don't try to send any more readings
-          }
+        // only the binary messages are numbered, the server starts counting
+        // them from 0 after the json message that advertised the protocol
+        window[num_batches].sequence = binary ? sequence++ : sequence;
+        window[num_batches].num_frames = xmit_status;
+        window[num_batches].spilled = !spill_done;
+        if (!spill_done)
+          spill_in_flight += xmit_status;
+        num_batches++;
+      }
 
-          if (response.startsWith("update")) {
-            update_flag = true;
-            response.replace("update,","");
-          }
+      if (!upload_ok || (0 == num_batches))
+        break;
 
-          if (response.startsWith("config")) {
-            config_flag = true;
-            response.replace("config,","");
-          }
+      // a plain "OK" acknowledges the oldest batch, the server may also
+      // acknowledge every batch up to a sequence number at once
+      ack = window[0].sequence;
+      upload_ok = receive_response(client, &update_flag, &config_flag, &ack);
+      while (upload_ok && (num_batches > 0) && ((int32_t)(ack - window[0].sequence) >= 0)) {
+        if (window[0].spilled) {
+          spill_log_ack(window[0].num_frames);
+          spill_in_flight -= window[0].num_frames;
         } else {
-          // some error occurred and we got no response...
-          client.stop();
+          clear_readings(window[0].num_frames);
         }
+        retval = true;
+        num_batches--;
+        memmove(&window[0], &window[1], num_batches*sizeof(*window));
       }
     }
+    spill_log_commit();
+    retval = retval || upload_ok;
 
     if (config_flag) {
       Serial.println("accepted config update command");
@@ -447,216 +789,468 @@ void upload_readings(void)
       if (!update_firmware(client))
         Serial.println("error: firmware update failed");
 #endif
+    } else if (upload_ok && (flags->flags & FLAG_BIT_FIRMWARE_STAGE)) {
+      // the server doesn't offer the staged firmware update anymore
+      persistent_remove(PERSISTENT_FIRMWARE_STAGE);
+      flags->flags &= ~FLAG_BIT_FIRMWARE_STAGE;
     }
   }
 
   client.stop();
   delay(10);
+
+  return retval;
 }
 
-// transmit the readings formatted as a json string
+// wait for the report server to respond to a transmission and parse it
+// ack receives the sequence number of the newest binary message the server
+// acknowledged if it sends one, otherwise it is left unchanged
+// returns true if the readings were accepted
+static bool receive_response(WiFiClient& client, bool *update_flag, bool *config_flag, uint32_t *ack)
+{
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+  char response[128];
+  const char *str = response;
+  unsigned long timeout;
+  size_t len;
+  bool retval = false;
+
+  // wait for response to be available
+  timeout = millis();
+  while (client.available() == 0) {
+    if (millis() - timeout > REPORT_RESPONSE_TIMEOUT) {
+      Serial.println("Timeout waiting for response!");
+      break;
+    }
+    yield();
+  }
+
+  if (client.available()) {
+    // Read response from the report server
+    // anything beyond the buffer is discarded up to the terminator
+    len = client.readBytesUntil(0, response, sizeof(response)-1);
+    response[len] = '\0';
+    if (len == sizeof(response)-1)
+      while (client.read() > 0) {}
+
+    Serial.print("Response from report server: ");
+    Serial.println(response);
+    if (0 == strncmp(str, "OK", 2)) {
+      retval = true;
+      if (0 == strncmp(str, "OK,", 3))
+        str += 3;
+    }
+
+    // no real error handling, just remove flag and check for update
+    if (0 == strncmp(str, "error", 5)) {
+      if (0 == strncmp(str, "error,", 6))
+        str += 6;
+      client.stop();  // don't try to send any more readings
+    }
+
+    if (0 == strncmp(str, "update", 6)) {
+      *update_flag = true;
+      if (0 == strncmp(str, "update,", 7))
+        str += 7;
+    }
+
+    if (0 == strncmp(str, "config", 6)) {
+      *config_flag = true;
+      if (0 == strncmp(str, "config,", 7))
+        str += 7;
+    }
+
+    // the server advertises the binary protocol in response to json readings
+    if (0 == strncmp(str, "v3", 2)) {
+      flags->flags |= FLAG_BIT_REPORT_V3;
+      if (0 == strncmp(str, "v3,", 3))
+        str += 3;
+    }
+
+    // cumulative acknowledgement of the pipelined binary messages
+    if (retval && (0 == strncmp(str, "ack=", 4)))
+      *ack = strtoul(str + 4, NULL, 10);
+  } else {
+    // some error occurred and we got no response...
+    client.stop();
+  }
+
+  // fall back to json until the server advertises the binary protocol again
+  if (!retval)
+    flags->flags &= ~FLAG_BIT_REPORT_V3;
+
+  return retval;
+}
+
+// transmit a batch of readings as a binary v3 message if the server accepts
+// it (see report_v3_header_t), otherwise as a json (version 2) string
+// in a binary message, the frames are re-encoded (see encode_frame) starting
+// from an empty state and sent along with the time offset of the oldest frame,
+// the server applies the calibrations and unit scaling while decoding
+// a json message holds the calibrated measurements of a single frame
 // calibrations[0] - temperature offset calibration
 // calibrations[1] - humidity offset calibration
 // calibrations[2] - pressure offset calibration
 // calibrations[3] - battery offset calibration
-static int transmit_readings(WiFiClient& client, float calibrations[4])
+// frames are read from the frame iterator, starting at its current position,
+// the frames without measurements that follow the batch are read along with it
+// last_batch - the uptime, report server address cache counters, and sensor
+//              counters are sent after the last frame of the last batch, in
+//              a message of their own if none of its frames has measurements
+// sequence - identifies the message in the acknowledgements (binary messages only)
+// sent - receives false if no message was sent because none of the frames
+//        read has measurements
+// returns the number of frames read, or -1 on error
+static int transmit_readings(WiFiClient& client, float calibrations[4], reading_frame_t *frame, bool last_batch, uint32_t sequence, bool *sent)
 {
-  int num_slots_read = 0;
+  static report_v3_msg_t msg;
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+  report_host_t *report_host = (report_host_t*) &rtc_mem[RTC_MEM_REPORT_HOST];
+  sht30_stats_t *sht30_stats = (sht30_stats_t*) &rtc_mem[RTC_MEM_SHT30_STATS];
+  frame_state_t state;
+  uint64_t first_timestamp = 0;
+  unsigned len = 0;
+  int num_frames_read = 0;
+  int num_frames_sent = 0;
   int num_measurements = 0;
-  String json;
+  reading_frame_t next;
+  frame_state_t json_state;
+  uint8_t json_present = 0;
+  report_writer_t *writer;
+  const char typestrings[RTC_FRAME_NUM_VALUES][17] = {
+    "temperature",
+    "humidity",
+    "pressure",
+    "particles 1.0µm",
+    "particles 2.5µm",
+    "battery",
+  };
+  char num[12];
+  bool binary = flags->flags & FLAG_BIT_REPORT_V3;
+  bool last;
 
   if (!client.connected())
     return -1;
 
-  if (rtc_mem[RTC_MEM_NUM_READINGS] > 0) {
-    flags_time_t timestamp = {0,0,0,0};
-    const char typestrings[7][17] = {
-      "unknown",
-      "temperature",
-      "humidity",
-      "pressure",
-      "particles 1.0µm",
-      "particles 2.5µm",
-      "battery",
-    };
+  // encode frames that have measurements until the buffer is full,
+  // or up to the first one for a json message
+  memset(&state, 0, sizeof(state));
+  while ((binary || (0 == num_frames_sent)) && (len + RTC_FRAME_MAX_SIZE <= RTC_DATA_SIZE) && read_frame(frame)) {
+    num_frames_read++;
+    if (0 == frame->present)
+      continue;
 
-    json = json_header();
-    json += "\"measurements\":[";
-
-    // format measurements
-    for (unsigned i=0; i < rtc_mem[RTC_MEM_NUM_READINGS]; i++) {
-      sensor_reading_t *reading;
-      const char* type = typestrings[0];
-      int slot;
-      float calibrated_reading;
-
-      // find the slot indexed into the ring buffer
-      slot = rtc_mem[RTC_MEM_FIRST_READING] + i;
-      if (slot >= NUM_STORAGE_SLOTS)
-        slot -= NUM_STORAGE_SLOTS;
-
-      reading = (sensor_reading_t*) &rtc_mem[RTC_MEM_DATA+slot*NUM_WORDS(sensor_reading_t)];
-      calibrated_reading = reading->value/1000.0;
-      num_slots_read++;
-
-      // determine the sensor type
-      switch(reading->type) {
-        case SENSOR_TEMPERATURE:
-          type=typestrings[1];
-          calibrated_reading += calibrations[0];
-        break;
+    if (0 == num_frames_sent) {
+      first_timestamp = frame->state.timestamp;
+      state.timestamp = first_timestamp;
+    }
+    len += encode_frame(&msg.frames[len], &state, &frame->state, frame->present);
+    if (!binary) {
+      json_state = frame->state;
+      json_present = frame->present;
+    }
+    num_frames_sent++;
+  }
 
-        case SENSOR_HUMIDITY:
-          type=typestrings[2];
-          calibrated_reading += calibrations[1];
-        break;
+  // release the frames without measurements that follow along with this batch
+  next = *frame;
+  while (read_frame(&next) && (0 == next.present)) {
+    *frame = next;
+    num_frames_read++;
+  }
 
-        case SENSOR_PRESSURE:
-          type=typestrings[3];
-          calibrated_reading += calibrations[2];
-        break;
+  last = last_batch && (frame->index == frame->num_frames);
+  *sent = (num_frames_sent > 0) || last;
+  if (!*sent)
+    return num_frames_read; // no measurements available
+
+  // a message without frames only carries the uptime and counters, as of now
+  if (0 == num_frames_sent)
+    first_timestamp = uptime();
+
+  if (binary) {
+    if (last) {
+      report_v3_sensor_stats_t sensor_stats = {(uint8_t)sht30_stats->rpt_low, (uint8_t)sht30_stats->rpt_med,
+                                               (uint8_t)sht30_stats->rpt_high, (uint8_t)sht30_stats->crc_errors};
+      report_v3_telemetry_t telemetry = {report_host->dns_hits, report_host->dns_misses, 0};
+      memcpy(&msg.frames[len], &sensor_stats, sizeof(sensor_stats));
+      len += sizeof(sensor_stats);
+      memcpy(&msg.frames[len], &telemetry, sizeof(telemetry));
+      len += sizeof(telemetry);
+    }
 
-        case SENSOR_PARTICLE_1_0:
-          type=typestrings[4];
-          calibrated_reading = reading->value * 1000.0;
-        break;
+    msg.header.magic = REPORT_V3_MAGIC;
+    msg.header.version = 3;
+    msg.header.length = sizeof(report_v3_header_t) - offsetof(report_v3_header_t, node_hash) + len;
+    msg.header.node_hash = rtc_mem[RTC_MEM_NODE_HASH];
+    msg.header.firmware = preinit_magic;
+    msg.header.type = REPORT_V3_TYPE_READINGS;
+    msg.header.flags = last ? (REPORT_V3_FLAG_LAST | REPORT_V3_FLAG_TELEMETRY | REPORT_V3_FLAG_SENSOR_STATS) : 0;
+    msg.header.num_frames = num_frames_sent;
+    msg.header.uptime = last ? uptime() : 0;
+    msg.header.time_offset = uptime() - first_timestamp;
+    memcpy(msg.header.calibrations, calibrations, sizeof(msg.header.calibrations));
+    msg.header.sequence = sequence;
 
-        case SENSOR_PARTICLE_2_5:
-          type=typestrings[5];
-          calibrated_reading = reading->value * 1000.0;
-        break;
+#if (EXTRA_DEBUG != 0)
+    Serial.printf("Transmitting %d frames in %u bytes to report server (v3)\n", num_frames_sent, (unsigned)(sizeof(report_v3_header_t) + len));
+#endif
 
-        case SENSOR_BATTERY_VOLTAGE:
-          type=typestrings[6];
-          calibrated_reading += calibrations[3];
-        break;
+    if (!send_message(client, (const uint8_t*)&msg, sizeof(report_v3_header_t) + len))
+      return -1;
 
-        case SENSOR_TIMESTAMP_OFFS:
-          timestamp.millis = (rtc_mem[RTC_MEM_DATA_TIMEBASE] << RTC_DATA_TIMEBASE_SHIFT) + (uint64_t)reading->value;
-        break;
+    if (last) {
+      report_host->dns_hits = report_host->dns_misses = 0;
+      sht30_stats->rpt_low = sht30_stats->rpt_med = sht30_stats->rpt_high = sht30_stats->crc_errors = 0;
+    }
+    return num_frames_read;
+  }
 
-        case SENSOR_UNKNOWN:
-        default:
-          type=typestrings[0];
-        break;
-      }
+#if (EXTRA_DEBUG != 0)
+  Serial.println("Transmitting to report server:");
+#endif
 
-      if (reading->type == SENSOR_TIMESTAMP_OFFS) {
-        if (num_measurements > 0)
-          break;
-        else
-          continue;
-      }
+  writer = writer_begin(client);
+  writer_json_header(writer);
+  writer_print(writer, "\"measurements\":[");
 
-      json += "{\"type\":\"";
-      json += type;
-      json += "\",\"value\":";
-      json += String(calibrated_reading, 3);
-      json += "},";
-      num_measurements++;
-    }
+  // format measurements
+  for (unsigned i=0; i < RTC_FRAME_NUM_VALUES; i++) {
+    float calibrated_reading = json_state.values[i]/1000.0;
 
-    // add a bonus "uptime" reading
-    if ((unsigned)num_slots_read == rtc_mem[RTC_MEM_NUM_READINGS]) {
-      json += "{\"type\":\"uptime\",";
-      json += "\"value\":"+String(uptime()/1000.0, 3);
-      json += "}";
-    } else if (json.endsWith("},")) {
-      json.remove(json.length()-1); // remove the extraneous comma
-    }
+    if (0 == (json_present & (1 << i)))
+      continue;
 
-    // close off the array of readings
-    json += "],";
+    switch (SENSOR_TEMPERATURE + i) {
+      case SENSOR_TEMPERATURE:
+        calibrated_reading += calibrations[0];
+      break;
 
-    // send the current calibration values in the last packet
-    if ((unsigned)num_slots_read == rtc_mem[RTC_MEM_NUM_READINGS]) {
-      json += "\"calibrations\":[";
-      json +=  "{\"type\":\"" + String(typestrings[1]) + "\",\"value\":" + String(calibrations[0], 3) + "}";
-      json += ",{\"type\":\"" + String(typestrings[2]) + "\",\"value\":" + String(calibrations[1], 3) + "}";
-      json += ",{\"type\":\"" + String(typestrings[3]) + "\",\"value\":" + String(calibrations[2], 3) + "}";
-      json += ",{\"type\":\"" + String(typestrings[6]) + "\",\"value\":" + String(calibrations[3], 3) + "}";
-      json += "],";
-    }
+      case SENSOR_HUMIDITY:
+        calibrated_reading += calibrations[1];
+      break;
 
-    // append a timestamp
-    json += "\"time_offset\":-";
-    json += format_u64(uptime()-timestamp.millis);
+      case SENSOR_PRESSURE:
+        calibrated_reading += calibrations[2];
+      break;
 
-    // terminate the json object
-    json += "}";
-    // null-terminate
-    json += ";";
-    json.setCharAt(json.length()-1, '\0');
+      case SENSOR_PARTICLE_1_0:
+      case SENSOR_PARTICLE_2_5:
+        calibrated_reading = json_state.values[i] * 1000.0;
+      break;
+
+      case SENSOR_BATTERY_VOLTAGE:
+        calibrated_reading += calibrations[3];
+      break;
+    }
+
+    if (num_measurements++ > 0)
+      writer_print(writer, ",");
+    writer_print(writer, "{\"type\":\"");
+    writer_print(writer, typestrings[i]);
+    writer_print(writer, "\",\"value\":");
+    writer_print_float(writer, calibrated_reading, 3);
+    writer_print(writer, "}");
   }
 
-  if (num_measurements > 0) {
-#if (EXTRA_DEBUG != 0)
-    Serial.println("Transmitting to report server:");
-    Serial.println(json);
-#endif
+  // add a bonus "uptime" reading and the counters to the last packet
+  if (last) {
+    const struct {
+      const char *type;
+      unsigned    value;
+    } counters[] = {
+      {"dns_hits", report_host->dns_hits},
+      {"dns_misses", report_host->dns_misses},
+      {"sht30_low", sht30_stats->rpt_low},
+      {"sht30_med", sht30_stats->rpt_med},
+      {"sht30_high", sht30_stats->rpt_high},
+      {"sht30_crc_errors", sht30_stats->crc_errors},
+    };
 
-    // transmit the json command
-    if (send_command(client, json))
-      return num_slots_read;
-    else
-      return -1;
+    if (num_measurements > 0)
+      writer_print(writer, ",");
+    writer_print(writer, "{\"type\":\"uptime\",\"value\":");
+    writer_print_float(writer, uptime()/1000.0, 3);
+    writer_print(writer, "}");
+    for (unsigned i=0; i < sizeof(counters)/sizeof(counters[0]); i++) {
+      writer_print(writer, ",{\"type\":\"");
+      writer_print(writer, counters[i].type);
+      writer_print(writer, "\",\"value\":");
+      writer_print(writer, utoa(counters[i].value, num, 10));
+      writer_print(writer, "}");
+    }
   }
 
-  return num_slots_read; // no measurements available
-}
+  // close off the array of readings
+  writer_print(writer, "],");
+
+  // send the current calibration values in the last packet
+  if (last) {
+    writer_print(writer, "\"calibrations\":[");
+    writer_print(writer,  "{\"type\":\"temperature\",\"value\":");
+    writer_print_float(writer, calibrations[0], 3);
+    writer_print(writer, "},{\"type\":\"humidity\",\"value\":");
+    writer_print_float(writer, calibrations[1], 3);
+    writer_print(writer, "},{\"type\":\"pressure\",\"value\":");
+    writer_print_float(writer, calibrations[2], 3);
+    writer_print(writer, "},{\"type\":\"battery\",\"value\":");
+    writer_print_float(writer, calibrations[3], 3);
+    writer_print(writer, "}],");
+  }
 
-// helper to generate a json-formatted header that can have
-// commands or data appended to it
-static String json_header(void)
-{
-  String json;
+  // append a timestamp
+  writer_print(writer, "\"time_offset\":-");
+  writer_print_u64(writer, uptime()-first_timestamp);
 
-  //format header
-  json = "{\"version\":2,";
-  json += "\"node\":\""+nodename+"\",";
-  json += "\"firmware\":\""+String(preinit_magic, HEX)+"\",";
+  // terminate the json object
+  writer_print(writer, "}");
 
-  return json;
+  // transmit the null-terminated json command
+  if (!writer_end(writer))
+    return -1;
+
+  if (last) {
+    report_host->dns_hits = report_host->dns_misses = 0;
+    sht30_stats->rpt_low = sht30_stats->rpt_med = sht30_stats->rpt_high = sht30_stats->crc_errors = 0;
+  }
+  return num_frames_read;
 }
 
-// helper to fetch the config update files from the server store them in SPIFFS
+// helper to fetch the config update files from the server and store them in SPIFFS
+// the server lists all pending files with their md5sums in a single manifest,
+// only the files that differ from the stored ones are fetched (in one batch),
+// and all of them are acknowledged at once
 static bool update_config(WiFiClient& client)
 {
-  const char* filenames[] = {
-    PERSISTENT_NODE_NAME,
-    PERSISTENT_REPORT_HOST_NAME,
-    PERSISTENT_REPORT_HOST_PORT,
-    PERSISTENT_CLOCK_CALIB,
-    PERSISTENT_TEMP_CALIB,
-    PERSISTENT_HUMIDITY_CALIB,
-    PERSISTENT_PRESSURE_CALIB,
-    PERSISTENT_BATTERY_CALIB,
-    PERSISTENT_SLEEP_TIME_MS,
-    PERSISTENT_HIGH_WATER_SLOT,
-  };
+  config_entry_t manifest[NUM_CONFIG_FILES];
+  unsigned num_entries = 0;
+  unsigned num_lines;
+  unsigned num_fetch = 0;
+  char line[96];
+  char names[NUM_CONFIG_FILES*32];
+  size_t len;
   bool status = true;
 
   if (!client.connected())
     return false;
 
-  for (size_t i=0; i<(sizeof(filenames)/sizeof(*filenames)); i++) {
-    String json;
-    unsigned len;
+  Serial.println("Retrieving config manifest");
+  if (!send_command(client, "get_config_manifest", "")) {
+    Serial.println("warning: update command not fully transmitted");
+    return false;
+  }
 
-    Serial.print("Retrieving config file: ");
-    Serial.println(filenames[i]);
+  // servers that don't support the manifest don't respond to it
+  len = client.readBytesUntil('\n', line, sizeof(line)-1);
+  line[len] = '\0';
+  if ((0 == len) || (line[0] < '0') || (line[0] > '9')) {
+    Serial.println("Config manifest not supported, retrieving files one at a time");
+    return update_config_files(client);
+  }
+
+  // each line of the manifest is "<filename> <size> <md5sum>"
+  num_lines = strtoul(line, NULL, 10);
+  for (unsigned n=0; n < num_lines; n++) {
+    config_entry_t *entry = &manifest[num_entries];
+    char filename[32];
+    char md5sum[33];
+    unsigned size;
+    size_t i;
+
+    len = client.readBytesUntil('\n', line, sizeof(line)-1);
+    line[len] = '\0';
+    if ((3 != sscanf(line, "%31s %u %32s", filename, &size, md5sum)) || (size > 4096)) {
+      Serial.print("warning: invalid manifest entry: "); Serial.println(line);
+      status = false;
+      continue;
+    }
+
+    for (i=0; i < NUM_CONFIG_FILES; i++)
+      if (0 == strcmp(filename, config_filenames[i]))
+        break;
+    if ((i == NUM_CONFIG_FILES) || (num_entries == NUM_CONFIG_FILES)) {
+      Serial.print("warning: unknown config file: "); Serial.println(filename);
+      status = false;
+      continue;
+    }
+
+    entry->index = i;
+    entry->fetch = !config_file_matches(config_filenames[i], size, md5sum);
+    entry->acked = !entry->fetch;
+    if (entry->fetch)
+      num_fetch++;
+    num_entries++;
+  }
+
+  // fetch all of the changed files with a single command
+  if (num_fetch > 0) {
+    names[0] = '\0';
+    for (unsigned n=0; n < num_entries; n++)
+      if (manifest[n].fetch)
+        append_config_name(names, sizeof(names), config_filenames[manifest[n].index]);
+
+    Serial.print("Retrieving config files: ");
+    Serial.println(names);
+    if (!send_command(client, "get_configs", names)) {
+      Serial.println("warning: update command not fully transmitted");
+      return false;
+    }
+
+    // each file is sent in the format of a get_config response
+    for (unsigned n=0; n < num_entries; n++) {
+      unsigned size;
+
+      if (!manifest[n].fetch)
+        continue;
+
+      len = client.readBytesUntil('\n', line, sizeof(line)-1);
+      line[len] = '\0';
+      if (0 == len)
+        continue; //the file was deleted on the server after the manifest was sent
+
+      size = strtoul(line, NULL, 10);
+      if ((line[0] < '0') || (line[0] > '9') || (size > 4096)) {
+        Serial.println("warning: invalid response received from server");
+        status = false;
+        break; //the rest of the batch can't be located
+      }
+
+      len = client.readBytesUntil('\n', line, sizeof(line)-1);
+      line[len] = '\0';
+      manifest[n].acked = receive_config_file(client, manifest[n].index, size, line);
+      if (!manifest[n].acked) {
+        status = false;
+        break; //the rest of the batch can't be located after a short read
+      }
+    }
+  }
+
+  // inform the server that it can delete all of the applied update files
+  names[0] = '\0';
+  for (unsigned n=0; n < num_entries; n++)
+    if (manifest[n].acked)
+      append_config_name(names, sizeof(names), config_filenames[manifest[n].index]);
+  if (names[0] != '\0') {
+    send_command(client, "delete_configs", names);
+    client.readBytesUntil('\n', line, sizeof(line)-1);
+  }
+
+  return status;
+}
 
-    json = json_header();
-    json += "\"command\":\"get_config\",";
-    json += "\"arg\":\"";
-    json += filenames[i];
-    json += "\"}";
+// helper to fetch the config update files one at a time, for servers that
+// don't support the config manifest
+static bool update_config_files(WiFiClient& client)
+{
+  bool status = true;
 
-    // null-terminate
-    json += ";";
-    json.setCharAt(json.length()-1, '\0');
+  for (size_t i=0; i < NUM_CONFIG_FILES; i++) {
+    unsigned len;
 
-    if (!send_command(client, json)) {
+    Serial.print("Retrieving config file: ");
+    Serial.println(config_filenames[i]);
+
+    if (!send_command(client, "get_config", config_filenames[i])) {
       Serial.println("warning: update command not fully transmitted");
       status = false;
       continue;
@@ -683,167 +1277,232 @@ static bool update_config(WiFiClient& client)
 
     String md5sum = client.readStringUntil('\n');
 
-    uint8_t *buffer = new uint8_t[len];
+    if (receive_config_file(client, i, len, md5sum.c_str())) {
+      // inform the server that it can delete the update file
+      send_command(client, "delete_config", config_filenames[i]);
+    } else {
+      status = false;
+    }
+  }
 
-    Serial.println("Receiving config update...");
-    Serial.print("File Size = ");  Serial.println(filesize);
-    Serial.print("MD5 = ");  Serial.println(md5sum);
+  return status;
+}
 
-    if (len != client.readBytes(buffer, len)) {
-      Serial.print("warning: short read of file "); Serial.println(filenames[i]);
-      status = false;
-    } else {
-      MD5Builder *md5 = new MD5Builder();
-      md5->begin();
-      md5->add(buffer, len);
-      md5->calculate();
-      if (!md5->toString().equals(md5sum)) {
-        status=false;
-        Serial.println("warning: md5sum mismatch");
+// helper to receive the contents of config file i, verify them, and store them
+// in SPIFFS
+// returns false if the file could not be received or stored
+static bool receive_config_file(WiFiClient& client, size_t i, unsigned len, const char *md5sum)
+{
+  MD5Builder md5;
+  char md5chars[33];
+  bool status = false;
+  uint8_t *buffer = new uint8_t[len];
+
+  Serial.print("Receiving config update: "); Serial.println(config_filenames[i]);
+  Serial.print("File Size = ");  Serial.println(len);
+  Serial.print("MD5 = ");  Serial.println(md5sum);
+
+  if (len != client.readBytes(buffer, len)) {
+    Serial.print("warning: short read of file "); Serial.println(config_filenames[i]);
+  } else {
+    md5.begin();
+    md5.add(buffer, len);
+    md5.calculate();
+    md5.getChars(md5chars);
+    if (0 != strcmp(md5chars, md5sum)) {
+      Serial.println("warning: md5sum mismatch");
 #if EXTRA_DEBUG
-        Serial.print(md5sum); Serial.print(" != "); Serial.println(md5->toString());
+      Serial.print(md5sum); Serial.print(" != "); Serial.println(md5chars);
 #endif
-      } else {
+    } else {
 #if EXTRA_DEBUG
-        Serial.print(md5sum); Serial.print(" == "); Serial.println(md5->toString());
+      Serial.print(md5sum); Serial.print(" == "); Serial.println(md5chars);
 #endif
-        // everything is OK, store in SPIFFS
-        if (persistent_write(filenames[i], buffer, len)) {
-
-          // special handling to update the RTC mem value for temp calib
-          if (4==i) {
-            float tempf;
-            const char* nptr = (const char*)buffer;
-            char* endptr = (char*)nptr;
-
-            //check for valid float
-            tempf = strtof(nptr, &endptr);
-            if ((0==tempf) && (nptr==endptr)) {
-              persistent_write(filenames[i], ""); //erase existing file
-              tempf = DEFAULT_TEMP_CALIB;
-            }
-            rtc_mem[RTC_MEM_TEMP_CAL] = *((uint32_t*)&tempf);
-          }
+      // everything is OK, store in SPIFFS
+      if (persistent_write(config_filenames[i], buffer, len)) {
+        load_rtc_config(); //update the rtc mem copies of the config
+        status = true;
+      }
+    }
+  }
+  delete[] buffer;
 
-          // special handling to update the RTC mem value for humidity calib
-          if (5==i) {
-            float tempf;
-            const char* nptr = (const char*)buffer;
-            char* endptr = (char*)nptr;
-
-            //check for valid float
-            tempf = strtof(nptr, &endptr);
-            if ((0==tempf) && (nptr==endptr)) {
-              persistent_write(filenames[i], ""); //erase existing file
-              tempf = DEFAULT_HUMIDITY_CALIB;
-            }
-            rtc_mem[RTC_MEM_HUMIDITY_CAL] = *((uint32_t*)&tempf);
-          }
+  return status;
+}
 
-          // special handling to update the RTC mem value for battery calib
-          if (7==i) {
-            float tempf;
-            const char* nptr = (const char*)buffer;
-            char* endptr = (char*)nptr;
-
-            //check for valid float
-            tempf = strtof(nptr, &endptr);
-            if ((0==tempf) && (nptr==endptr)) {
-              persistent_write(filenames[i], ""); //erase existing file
-              tempf = DEFAULT_BATTERY_CALIB;
-            }
-            rtc_mem[RTC_MEM_BATTERY_CAL] = *((uint32_t*)&tempf);
-          }
+// helper to check whether the stored config file has the given size and md5sum
+// (a missing file is treated as an empty file)
+static bool config_file_matches(const char *filename, unsigned size, const char *md5sum)
+{
+  MD5Builder md5;
+  char md5chars[33];
+  uint8_t buf[64];
+  size_t offset = 0;
+  size_t len;
 
-          // special handling to update the RTC mem value for custom sleep time
-          if (8==i) {
-            sleep_params_t *sleep_params = (sleep_params_t*) &rtc_mem[RTC_MEM_SLEEP_PARAMS];
-            int temp;
-            const char* nptr = (const char*)buffer;
-            char* endptr = (char*)nptr;
-
-            //check for valid integer
-            temp = strtol(nptr, &endptr, 0);
-            if ((0==temp) && (nptr==endptr)) {
-              persistent_write(filenames[i], ""); //erase existing file
-              sleep_params->sleep_time_ms = (int)DEFAULT_SLEEP_TIME_MS;
-            } else {
-              if (temp < 200)
-                temp = 200;
-              if (temp > MAX_ESP_SLEEP_TIME_MS)
-                temp = MAX_ESP_SLEEP_TIME_MS;
-              sleep_params->sleep_time_ms = temp;
-            }
-          }
+  if (persistent_size(filename) != size)
+    return false;
+  if (0 == size)
+    return true;
 
-          // special handling to update the RTC mem value for custom high-water slot
-          if (9==i) {
-            sleep_params_t *sleep_params = (sleep_params_t*) &rtc_mem[RTC_MEM_SLEEP_PARAMS];
-            int temp;
-            const char* nptr = (const char*)buffer;
-            char* endptr = (char*)nptr;
-
-            //check for valid integer
-            temp = strtol(nptr, &endptr, 0);
-            if ((0==temp) && (nptr==endptr)) {
-              persistent_write(filenames[i], ""); //erase existing file
-              sleep_params->high_water_slot = DEFAULT_HIGH_WATER_SLOT;
-            } else {
-              if (temp <= 0)
-                temp = 1;
-              if (temp > NUM_STORAGE_SLOTS)
-                temp = NUM_STORAGE_SLOTS;
-              sleep_params->high_water_slot = temp;
-            }
-          }
+  md5.begin();
+  while ((len = persistent_read(filename, offset, buf, sizeof(buf))) > 0) {
+    md5.add(buf, len);
+    offset += len;
+  }
+  md5.calculate();
+  md5.getChars(md5chars);
 
-          // inform the server that it can delete the update file
-          json = json_header();
-          json += "\"command\":\"delete_config\",";
-          json += "\"arg\":\"";
-          json += filenames[i];
-          json += "\"}";
+  return (0 == strcmp(md5chars, md5sum));
+}
 
-          // null-terminate
-          json += ";";
-          json.setCharAt(json.length()-1, '\0');
+// helper to append a config file name to a comma-separated list
+static void append_config_name(char *names, size_t size, const char *filename)
+{
+  size_t len = strlen(names);
 
-          send_command(client, json);
-        } else {
-          status = false;
-        }
-      }
+  snprintf(&names[len], size - len, "%s%s", (len > 0) ? "," : "", filename);
+}
 
-      delete md5;
-    }
-    delete[] buffer;
+#if !DISABLE_FW_UPDATE
+// Stream over the image (or patch) in a staged firmware download, it is read
+// from persistent storage in blocks
+class FirmwareStage : public Stream {
+public:
+  FirmwareStage(size_t size) : _offset(sizeof(firmware_stage_t)), _end(sizeof(firmware_stage_t) + size), _pos(0), _len(0) {}
+
+  int available() override { return (_end - _offset) + (_len - _pos); }
+  int read() override { return fill() ? _buf[_pos++] : -1; }
+  int peek() override { return fill() ? _buf[_pos] : -1; }
+  size_t write(uint8_t) override { return 0; }
+
+private:
+  bool fill()
+  {
+    if (_pos < _len)
+      return true;
+    if (_offset >= _end)
+      return false;
+    _len = persistent_read(PERSISTENT_FIRMWARE_STAGE, _offset, _buf, (_end - _offset < sizeof(_buf)) ? (_end - _offset) : sizeof(_buf));
+    _offset += _len;
+    _pos = 0;
+    return (_len > 0);
   }
 
-  return status;
-}
+  size_t  _offset;  // file offset of the next block
+  size_t  _end;
+  size_t  _pos;     // read position in _buf
+  size_t  _len;     // bytes in _buf
+  uint8_t _buf[512];
+};
 
-#if !DISABLE_FW_UPDATE
 // helper to fetch a firmware update from the server and apply it
+// the update is downloaded to PERSISTENT_FIRMWARE_STAGE at most FIRMWARE_UPDATE_CHUNK
+// bytes at a time, a download that is incomplete resumes at the next upload
+// an update that doesn't fit in SPIFFS is streamed to the OTA staging area instead
 static bool update_firmware(WiFiClient& client)
 {
-  String json = json_header();
-  unsigned len;
-  bool status = false;
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+  firmware_stage_t stage;
+  firmware_stage_t offer;
+  unsigned offset = 0;
+  int resume;
 
   if (!client.connected())
     return false;
 
-  json += "\"command\":\"update\",";
-  json += "\"arg\":\"" FIRMWARE_NAME "\"}";
+  // a download that was started on an earlier wake
+  if ((persistent_size(PERSISTENT_FIRMWARE_STAGE) >= sizeof(stage)) &&
+      (sizeof(stage) == persistent_read(PERSISTENT_FIRMWARE_STAGE, 0, (uint8_t*)&stage, sizeof(stage)))) {
+    stage.md5[sizeof(stage.md5) - 1] = '\0';
+    offset = persistent_size(PERSISTENT_FIRMWARE_STAGE) - sizeof(stage);
+    flags->flags |= FLAG_BIT_FIRMWARE_STAGE;
+  } else {
+    memset(&stage, 0, sizeof(stage));
+  }
 
-  // null-terminate
-  json += ";";
-  json.setCharAt(json.length()-1, '\0');
+  if (0 == request_firmware(client, &stage, offset, &offer, &resume))
+    return false;
 
-  if (!send_command(client, json))
+  // anything else than the next part of the staged download starts over, the
+  // stage of an image that the server no longer offers is removed
+  if ((resume < 0) || ((unsigned)resume != offset) || (stage.size != offer.size) || (stage.patch != offer.patch) || strcmp(stage.md5, offer.md5)) {
+    if (persistent_size(PERSISTENT_FIRMWARE_STAGE) > 0)
+      persistent_remove(PERSISTENT_FIRMWARE_STAGE);
+    flags->flags &= ~FLAG_BIT_FIRMWARE_STAGE;
+    if (resume > 0) {
+      Serial.printf("error: server resumes at %d, expected 0\n", resume);
+      return false;
+    }
+    stage = offer;
+    offset = 0;
+  }
+
+  // the rest of the download has to fit next to the space that is kept free
+  // for the spill log
+  if (persistent_free() < sizeof(stage) + stage.size - persistent_size(PERSISTENT_FIRMWARE_STAGE) + FIRMWARE_STAGE_RESERVE)
+    return stream_firmware(client, &stage, resume);
+
+  if (0 == persistent_size(PERSISTENT_FIRMWARE_STAGE)) {
+    if (!persistent_write(PERSISTENT_FIRMWARE_STAGE, (uint8_t*)&stage, sizeof(stage)))
+      return false;
+    flags->flags |= FLAG_BIT_FIRMWARE_STAGE;
+  }
+
+  // a server that doesn't resume downloads sends all of it
+  if (!receive_firmware(client, &stage, offset, (resume >= 0) ? FIRMWARE_UPDATE_CHUNK : stage.size))
+    return false;
+  if (persistent_size(PERSISTENT_FIRMWARE_STAGE) - sizeof(stage) < stage.size)
+    return true;
+
+  client.stop();
+  FirmwareStage in(stage.size);
+  return apply_firmware(in, &stage);
+}
+
+// helper to send the update command and read the header of the response into offer
+// the command carries the offset and md5sum of the staged download if there is a
+// stage, otherwise the server sends the whole download
+// resume receives the offset of the part that the server sends, or -1 if it
+// doesn't resume downloads
+// returns the size of the download, or 0 if there is none
+static unsigned request_firmware(WiFiClient& client, const firmware_stage_t *stage, unsigned offset, firmware_stage_t *offer, int *resume)
+{
+  report_writer_t *writer;
+  char num[12];
+  unsigned len;
+
+  // the server sends a compressed image or a patch (if it has one) when the
+  // node advertises that it can apply one, and the part of it that follows
+  // offset if the md5sum is still the one of the download
+  writer = writer_begin(client);
+  writer_json_header(writer);
+  writer_print(writer, "\"command\":\"update\",\"arg\":\"" FIRMWARE_NAME "\"" FIRMWARE_ENCODINGS);
+  if (stage) {
+    writer_print(writer, ",\"offset\":");
+    writer_print(writer, utoa(offset, num, 10));
+    writer_print(writer, ",\"length\":");
+    writer_print(writer, utoa(FIRMWARE_UPDATE_CHUNK, num, 10));
+    writer_print(writer, ",\"md5\":\"");
+    writer_print(writer, stage->md5);
+    writer_print(writer, "\"");
+  }
+  writer_print(writer, "}");
+  if (!writer_end(writer))
     Serial.println("warning: update command not fully transmitted");
 
+  // a patch and the offset of a partial download are announced by lines of their
+  // own ahead of the size, the md5sum is the one of the (patched) image
+  memset(offer, 0, sizeof(*offer));
+  *resume = -1;
   String filesize = client.readStringUntil('\n');
+  while ((filesize.length() > 0) && !isdigit(filesize[0])) {
+    if (filesize == "patch")
+      offer->patch = true;
+    else if (filesize.startsWith("offset="))
+      *resume = filesize.substring(7).toInt();
+    filesize = client.readStringUntil('\n');
+  }
   String md5sum = client.readStringUntil('\n');
   len = filesize.toInt();
   if (len == 0)
@@ -852,54 +1511,352 @@ static bool update_firmware(WiFiClient& client)
   if (len > 0x300000) {
     Serial.print("error: filesize too large: ");
     Serial.println(len);
-    status = false;
     len = 0;
   }
+  if (len == 0)
+    return 0;
 
-  if (len > 0) {
-    Serial.println("Receiving firmware update...");
-    Serial.print("File Size = ");  Serial.println(filesize);
-    Serial.print("MD5 = ");  Serial.println(md5sum);
-    if (!Update.setMD5(md5sum.c_str())) {
-      Serial.println("error: unable to set md5sum");
-    } else {
-      // At this point we are committed - at the end of this block
-      // we will reset the processor.
-      invalidate_rtc();
-
-      Update.onProgress(
-        [](size_t count, size_t total)
-        {
-          Serial.printf("progress: %06zd / %06zd\n", count, total);
-        }
-      );
-      status = ESP.updateSketch(client, len, false, false);
-      Serial.print("Update result: "); Serial.println(status?"OK":"failed");
+  Serial.print("File Size = ");  Serial.println(filesize);
+  Serial.print("MD5 = ");  Serial.println(md5sum);
+  strncpy(offer->md5, md5sum.c_str(), sizeof(offer->md5) - 1);
+  offer->size = len;
 
-      // I think we need to reset regardless of the status because
-      // the update process may store a bootloader command in the
-      // first 128 bytes of RTC user memory. However, it isn't clear
-      // that it actually does this...
-      client.stop();
-      delay(10);
-      ESP.reset();
+  return len;
+}
+
+// helper to append the next part of a firmware download (up to len bytes) to the stage
+static bool receive_firmware(WiFiClient& client, firmware_stage_t *stage, unsigned offset, unsigned len)
+{
+  uint8_t buf[512];
+  unsigned long start = millis();
+  unsigned n, run;
+
+  if (len > stage->size - offset)
+    len = stage->size - offset;
+  Serial.printf("Receiving firmware update %u-%u of %u bytes\n", offset, offset + len, stage->size);
+
+  for (n = 0; n < len; n += run) {
+    run = (len - n < sizeof(buf)) ? (len - n) : sizeof(buf);
+    if ((run != client.readBytes(buf, run)) || !persistent_append(PERSISTENT_FIRMWARE_STAGE, buf, run))
+      break;
+  }
+  Serial.printf("Received %u bytes in %lu ms\n", n, millis() - start);
+
+  return (n == len);
+}
+
+// helper to write a download that doesn't fit in SPIFFS from the server to the OTA
+// staging area, all of it has to be received in one go then
+// a server that resumes downloads sent at most a chunk of it from resume on, which
+// is skipped to request the whole download
+static bool stream_firmware(WiFiClient& client, firmware_stage_t *stage, int resume)
+{
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+  firmware_stage_t offer;
+
+  // a partial stage of the download can't be completed
+  Serial.printf("Not enough space to stage %u bytes, streaming the firmware update\n", stage->size);
+  if (flags->flags & FLAG_BIT_FIRMWARE_STAGE)
+    persistent_remove(PERSISTENT_FIRMWARE_STAGE);
+  flags->flags &= ~FLAG_BIT_FIRMWARE_STAGE;
+  if ((resume > 0) || ((resume == 0) && (stage->size > FIRMWARE_UPDATE_CHUNK))) {
+    if (!skip_firmware(client, (stage->size - resume < FIRMWARE_UPDATE_CHUNK) ? (stage->size - resume) : FIRMWARE_UPDATE_CHUNK))
+      return false;
+    if ((0 == request_firmware(client, NULL, 0, &offer, &resume)) || (resume >= 0) ||
+        (stage->size != offer.size) || (stage->patch != offer.patch) || strcmp(stage->md5, offer.md5)) {
+      Serial.println("error: firmware update changed while it was requested");
+      return false;
     }
   }
 
+  return apply_firmware(client, stage);
+}
+
+// helper to discard len bytes of a firmware download
+static bool skip_firmware(WiFiClient& client, unsigned len)
+{
+  uint8_t buf[512];
+  unsigned n, run;
+
+  for (n = 0; n < len; n += run) {
+    run = (len - n < sizeof(buf)) ? (len - n) : sizeof(buf);
+    if (run != client.readBytes(buf, run))
+      break;
+  }
+
+  return (n == len);
+}
+
+// helper to write a complete firmware download to the OTA staging area and reset
+// the download is read from in, which is the stage or the client connection
+// Update verifies the md5sum of the whole image before it is committed, the
+// download is discarded if it doesn't match
+static bool apply_firmware(Stream& in, const firmware_stage_t *stage)
+{
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+
+  bool status = false;
+
+  if (!Update.setMD5(stage->md5)) {
+    Serial.println("error: unable to set md5sum");
+    if (flags->flags & FLAG_BIT_FIRMWARE_STAGE)
+      persistent_remove(PERSISTENT_FIRMWARE_STAGE);
+    flags->flags &= ~FLAG_BIT_FIRMWARE_STAGE;
+    return false;
+  }
+
+  // At this point we are committed - at the end of this function
+  // we will reset the processor. The readings are kept in the spill
+  // log, the new firmware doesn't accept the rtc memory of this one.
+  spill_readings();
+  save_rtc();
+
+  Update.onProgress(
+    [](size_t count, size_t total)
+    {
+      Serial.printf("progress: %06zd / %06zd\n", count, total);
+    }
+  );
+#if FIRMWARE_UPDATE_PATCH
+  if (stage->patch)
+    status = apply_patch(in, stage->size);
+  else
+#endif
+    status = ESP.updateSketch(in, stage->size, false, false);
+  Serial.print("Update result: "); Serial.println(status?"OK":"failed");
+  if (flags->flags & FLAG_BIT_FIRMWARE_STAGE)
+    persistent_remove(PERSISTENT_FIRMWARE_STAGE);
+
+  // I think we need to reset regardless of the status because
+  // the update process may store a bootloader command in the
+  // first 128 bytes of RTC user memory. However, it isn't clear
+  // that it actually does this...
+  delay(10);
+  ESP.reset();
+
   //this function only returns false
   return status;
 }
+
+#if FIRMWARE_UPDATE_PATCH
+// helper to rebuild the new image from the running one and a patch of len bytes
+// (see firmware_patch_header_t) and write it to the OTA staging area
+// the patch is read from in as it arrives, only one run of diff bytes is buffered
+// returns true if the patched image was written and its md5sum matches
+static bool apply_patch(Stream& in, unsigned len)
+{
+  firmware_patch_header_t header;
+  firmware_patch_record_t record;
+  uint8_t diff[FIRMWARE_PATCH_RUN];
+  uint8_t buf[FIRMWARE_PATCH_RUN];
+  char old_md5[33];
+  uint32_t old_pos = 0;
+  uint32_t new_pos = 0;
+  int64_t next_pos;
+  bool ok = true;
+
+  if (!read_patch(in, (uint8_t*)&header, sizeof(header), &len))
+    return false;
+
+  for (unsigned i = 0; i < sizeof(header.old_md5); i++)
+    sprintf(&old_md5[2*i], "%02x", header.old_md5[i]);
+  if ((FIRMWARE_PATCH_MAGIC != header.magic) || (header.old_size != ESP.getSketchSize()) || !ESP.getSketchMD5().equals(old_md5)) {
+    Serial.println("error: patch does not apply to the running firmware");
+    return false;
+  }
+
+  if (!Update.begin(header.new_size)) {
+    Update.printError(Serial);
+    return false;
+  }
+
+  while (ok && (new_pos < header.new_size)) {
+    ok = read_patch(in, (uint8_t*)&record, sizeof(record), &len) &&
+         (record.diff_len <= header.old_size - old_pos) &&
+         (record.diff_len <= header.new_size - new_pos) &&
+         (record.extra_len <= header.new_size - new_pos - record.diff_len);
+
+    // diff bytes are added to the running image, runs of zeros are not transmitted
+    for (uint32_t n = 0, run; ok && (n < record.diff_len); n += run) {
+      uint8_t token;
+
+      ok = read_patch(in, &token, 1, &len);
+      run = (token < 0x80) ? (token + 1) : (token - 0x7f);
+      ok = ok && (run <= record.diff_len - n) && read_sketch(old_pos + n, buf, run);
+      if (ok && (token < 0x80)) {
+        ok = read_patch(in, diff, run, &len);
+        for (uint32_t i = 0; i < run; i++)
+          buf[i] += diff[i];
+      }
+      ok = ok && (run == Update.write(buf, run));
+    }
+
+    // extra bytes are copied from the patch
+    for (uint32_t n = 0, run; ok && (n < record.extra_len); n += run) {
+      run = (record.extra_len - n < sizeof(buf)) ? (record.extra_len - n) : sizeof(buf);
+      ok = read_patch(in, buf, run, &len) && (run == Update.write(buf, run));
+    }
+
+    next_pos = (int64_t)old_pos + record.diff_len + record.seek;
+    ok = ok && (next_pos >= 0) && (next_pos <= header.old_size);
+    if (ok) {
+      new_pos += record.diff_len + record.extra_len;
+      old_pos = next_pos;
+    }
+  }
+
+  // aborts the update if the image is incomplete, otherwise verifies its md5sum
+  if (!Update.end()) {
+    Serial.printf("error: patch failed at %u of %u bytes\n", new_pos, header.new_size);
+    Update.printError(Serial);
+    return false;
+  }
+  return true;
+}
+
+// helper to read len bytes of a patch, remaining is the number of bytes left in the patch
+static bool read_patch(Stream& in, uint8_t *buf, size_t len, unsigned *remaining)
+{
+  if ((len > *remaining) || (len != in.readBytes(buf, len)))
+    return false;
+  *remaining -= len;
+  return true;
+}
+
+// helper to read len bytes (up to FIRMWARE_PATCH_RUN) of the running image at any offset
+// flash can only be read in aligned words
+static bool read_sketch(uint32_t offset, uint8_t *buf, size_t len)
+{
+  uint32_t words[FIRMWARE_PATCH_RUN/sizeof(uint32_t) + 2];
+  uint32_t start = offset & ~3;
+  size_t size = ((offset + len + 3) & ~3) - start;
+
+  if (!ESP.flashRead(start, words, size))
+    return false;
+  memcpy(buf, (uint8_t*)words + (offset - start), len);
+  return true;
+}
+#endif /* FIRMWARE_UPDATE_PATCH */
 #endif /* !DISABLE_FW_UPDATE */
 
-static bool send_command(WiFiClient& client, String& command)
+// helper to transmit a null-terminated json command with a single argument
+static bool send_command(WiFiClient& client, const char *command, const char *arg)
 {
-  unsigned len;
+  report_writer_t *writer = writer_begin(client);
+
+  writer_json_header(writer);
+  writer_print(writer, "\"command\":\"");
+  writer_print(writer, command);
+  writer_print(writer, "\",\"arg\":\"");
+  writer_print(writer, arg);
+  writer_print(writer, "\"}");
+
+  return writer_end(writer);
+}
+
+// helper to transmit a binary message and verify the number of bytes written
+// pending data in the client buffers is kept, it may be the acknowledgement
+// of a message that is still in flight
+static bool send_message(WiFiClient& client, const uint8_t *buf, size_t len)
+{
+  client.flush();
+
+  return (len == client.write(buf, len));
+}
+
+// start a json message in the (single, static) streaming writer
+// json messages are never pipelined, so any pending data in the client buffers is discarded
+static report_writer_t* writer_begin(WiFiClient& client)
+{
+  static report_writer_t writer;
 
-  // flush any pending data in the client buffers
   client.flush();
   while (client.read() >= 0) {}
 
-  // transmit the command and verify the number of bytes written
-  len = client.print(command);
-  return (len == command.length());
+  writer.client = &client;
+  writer.len = 0;
+  writer.error = false;
+
+  return &writer;
+}
+
+// helper to append bytes to the message, flushing each full segment
+static void writer_write(report_writer_t *writer, const char *data, size_t len)
+{
+  while (len > 0) {
+    size_t n = sizeof(writer->buf) - writer->len;
+
+    if (n > len)
+      n = len;
+    memcpy(&writer->buf[writer->len], data, n);
+    writer->len += n;
+    data += n;
+    len -= n;
+
+    if (writer->len == sizeof(writer->buf))
+      writer_flush(writer);
+  }
+}
+
+static void writer_print(report_writer_t *writer, const char *str)
+{
+  writer_write(writer, str, strlen(str));
+}
+
+static void writer_print_u64(report_writer_t *writer, uint64_t val)
+{
+  char llu[21];
+
+  sprintf(llu, "%llu", val);
+  writer_print(writer, llu);
+}
+
+// formats the value the same way as String(val, decimals)
+static void writer_print_float(report_writer_t *writer, double val, unsigned char decimals)
+{
+  char buf[33];
+
+  writer_print(writer, dtostrf(val, (decimals + 2), decimals, buf));
+}
+
+// helper to write the json header that commands or data are appended to
+// the node name is taken from RTC memory, unless it was too long to be copied there
+static void writer_json_header(report_writer_t *writer)
+{
+  const char *node_name = (const char*)&rtc_mem[RTC_MEM_NODE_NAME];
+  char firmware[9];
+
+  writer_print(writer, "{\"version\":2,\"node\":\"");
+  writer_print(writer, node_name[0] ? node_name : persistent_config()->node_name);
+  writer_print(writer, "\",\"firmware\":\"");
+  writer_print(writer, utoa(preinit_magic, firmware, 16));
+  writer_print(writer, "\",");
+}
+
+// null-terminate the message and transmit the remainder
+// returns true if every byte of the message was written
+static bool writer_end(report_writer_t *writer)
+{
+  writer_write(writer, "", 1);
+  writer_flush(writer);
+
+#if (EXTRA_DEBUG != 0)
+  Serial.println();
+#endif
+
+  return !writer->error;
+}
+
+static void writer_flush(report_writer_t *writer)
+{
+  if (0 == writer->len)
+    return;
+
+#if (EXTRA_DEBUG != 0)
+  Serial.write((const uint8_t*)writer->buf, writer->len);
+#endif
+
+  if (writer->len != writer->client->write((const uint8_t*)writer->buf, writer->len))
+    writer->error = true;
+  writer->len = 0;
 }
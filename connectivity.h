@@ -9,9 +9,10 @@ void connectivity_preinit(void);
 void connectivity_init(void);
 void connectivity_disable(void);
 
+void start_wifi(void);
 bool connect_wifi(void);
 void enter_config_mode(void);
 
-void upload_readings(void);
+bool upload_readings(void);
 
 #endif /* _CONNECTIVITY_H_ */
@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+"""Create and apply delta firmware updates for the sensor nodes.
+
+A patch turns the firmware image that a sensor node is running into a new
+image, so that an update only has to transfer the parts that changed. It is
+placed in the Node-RED firmware directory next to the new image, named after
+the new image and the firmware ID (preinit_magic) of the image it applies to:
+
+  20230317-aa55426a-iotsp-battery.bin.from-aa554f09.patch
+
+Usage:
+  firmware_patch.py create OLD.bin NEW.bin [PATCH]
+  firmware_patch.py apply OLD.bin PATCH NEW.bin
+
+The firmware ID of the old image is taken from its filename
+(e.g. 20230208-aa554f09-iotsp-battery.bin) unless --from is given.
+
+Patch format (all fields are little-endian), see apply_patch in connectivity.cpp:
+
+  header: "IOTP", uint32 old_size, uint32 new_size, old md5[16], new md5[16]
+  records until new_size bytes have been produced (as in bsdiff):
+    uint32 diff_len, uint32 extra_len, int32 seek
+    diff_len bytes added to the old image, zero-run encoded:
+      token t < 0x80: t+1 diff bytes follow
+      token t >= 0x80: t-0x7f zero diff bytes
+    extra_len bytes copied to the new image
+    the old image position then advances by diff_len + seek
+"""
+
+import argparse
+import hashlib
+import os
+import re
+import struct
+import sys
+
+MAGIC = b"IOTP"
+HEADER = struct.Struct("<4sII16s16s")
+RECORD = struct.Struct("<IIi")
+ANCHOR = 8          # bytes hashed to find candidate matches
+MAX_CANDIDATES = 32 # old positions tried per anchor
+
+
+def match_len(a, ai, b, bi):
+    """Length of the common run of a[ai:] and b[bi:]."""
+    n = min(len(a) - ai, len(b) - bi)
+    step = 256
+    i = 0
+    while i + step <= n and a[ai + i:ai + i + step] == b[bi + i:bi + i + step]:
+        i += step
+    while i < n and a[ai + i] == b[bi + i]:
+        i += 1
+    return i
+
+
+class Matcher:
+    """Finds long matches of the new image in the old one through an index
+    of ANCHOR byte substrings (a stand-in for the suffix array of bsdiff)."""
+
+    def __init__(self, old):
+        self.old = old
+        self.index = {}
+        for i in range(len(old) - ANCHOR + 1):
+            positions = self.index.setdefault(old[i:i + ANCHOR], [])
+            if len(positions) < MAX_CANDIDATES:
+                positions.append(i)
+
+    def search(self, new, scan):
+        best_len, best_pos = 0, 0
+        for pos in self.index.get(new[scan:scan + ANCHOR], ()):
+            n = match_len(self.old, pos, new, scan)
+            if n > best_len:
+                best_len, best_pos = n, pos
+        return best_len, best_pos
+
+
+def encode_diff(diff):
+    out = bytearray()
+    i = 0
+    while i < len(diff):
+        j = i
+        while j < len(diff) and j - i < 128 and diff[j] == 0:
+            j += 1
+        if j - i >= 2 or j == len(diff):
+            out.append(0x7f + (j - i))
+            i = j
+            continue
+        # literal run, up to the next pair of zeros
+        j = i
+        while j < len(diff) and j - i < 128 and not (diff[j] == 0 and j + 1 < len(diff) and diff[j + 1] == 0):
+            j += 1
+        out.append(j - i - 1)
+        out += diff[i:j]
+        i = j
+    return bytes(out)
+
+
+def create(old, new):
+    """bsdiff control loop, see bsdiff.c by Colin Percival."""
+    matcher = Matcher(old)
+    records = []
+    oldsize, newsize = len(old), len(new)
+    scan = length = lastscan = lastpos = lastoffset = pos = 0
+
+    while scan < newsize:
+        oldscore = 0
+        scan += length
+        scsc = scan
+        while scan < newsize:
+            length, pos = matcher.search(new, scan)
+            while scsc < scan + length:
+                if scsc + lastoffset < oldsize and old[scsc + lastoffset] == new[scsc]:
+                    oldscore += 1
+                scsc += 1
+            if (length == oldscore and length != 0) or length > oldscore + 8:
+                break
+            if scan + lastoffset < oldsize and old[scan + lastoffset] == new[scan]:
+                oldscore -= 1
+            scan += 1
+
+        if length != oldscore or scan == newsize:
+            # extend the previous match forward and the new one backward
+            s = sf = lenf = i = 0
+            while lastscan + i < scan and lastpos + i < oldsize:
+                if old[lastpos + i] == new[lastscan + i]:
+                    s += 1
+                i += 1
+                if s * 2 - i > sf * 2 - lenf:
+                    sf, lenf = s, i
+
+            lenb = 0
+            if scan < newsize:
+                s = sb = 0
+                i = 1
+                while scan >= lastscan + i and pos >= i:
+                    if old[pos - i] == new[scan - i]:
+                        s += 1
+                    if s * 2 - i > sb * 2 - lenb:
+                        sb, lenb = s, i
+                    i += 1
+
+            if lastscan + lenf > scan - lenb:
+                overlap = (lastscan + lenf) - (scan - lenb)
+                s = ss = lens = 0
+                for i in range(overlap):
+                    if new[lastscan + lenf - overlap + i] == old[lastpos + lenf - overlap + i]:
+                        s += 1
+                    if new[scan - lenb + i] == old[pos - lenb + i]:
+                        s -= 1
+                    if s > ss:
+                        ss, lens = s, i + 1
+                lenf += lens - overlap
+                lenb -= lens
+
+            diff = bytes((new[lastscan + i] - old[lastpos + i]) & 0xff for i in range(lenf))
+            extra = new[lastscan + lenf:scan - lenb]
+            seek = (pos - lenb) - (lastpos + lenf)
+            records.append(RECORD.pack(lenf, len(extra), seek) + encode_diff(diff) + extra)
+
+            lastscan, lastpos, lastoffset = scan - lenb, pos - lenb, pos - scan
+
+    header = HEADER.pack(MAGIC, oldsize, newsize, hashlib.md5(old).digest(), hashlib.md5(new).digest())
+    return header + b"".join(records)
+
+
+def apply(old, patch):
+    magic, oldsize, newsize, old_md5, new_md5 = HEADER.unpack_from(patch, 0)
+    if magic != MAGIC:
+        raise ValueError("not a firmware patch")
+    if oldsize != len(old) or old_md5 != hashlib.md5(old).digest():
+        raise ValueError("patch does not apply to this image")
+
+    new = bytearray()
+    p = HEADER.size
+    oldpos = 0
+    while len(new) < newsize:
+        diff_len, extra_len, seek = RECORD.unpack_from(patch, p)
+        p += RECORD.size
+        if len(new) + diff_len + extra_len > newsize or oldpos + diff_len > oldsize:
+            raise ValueError("corrupt record")
+        n = 0
+        while n < diff_len:
+            token = patch[p]
+            p += 1
+            if token < 0x80:
+                run = token + 1
+                new += bytes((old[oldpos + n + i] + patch[p + i]) & 0xff for i in range(run))
+                p += run
+            else:
+                run = token - 0x7f
+                new += old[oldpos + n:oldpos + n + run]
+            n += run
+        if n != diff_len:
+            raise ValueError("corrupt diff")
+        new += patch[p:p + extra_len]
+        p += extra_len
+        oldpos += diff_len + seek
+        if oldpos < 0 or oldpos > oldsize:
+            raise ValueError("corrupt seek")
+
+    if hashlib.md5(new).digest() != new_md5:
+        raise ValueError("md5 mismatch")
+    return bytes(new)
+
+
+def firmware_id(filename):
+    match = re.search(r"-([0-9a-f]{8})-", os.path.basename(filename).lower())
+    return match.group(1) if match else None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Create and apply delta firmware updates")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    c = sub.add_parser("create", help="create a patch from OLD to NEW")
+    c.add_argument("old")
+    c.add_argument("new")
+    c.add_argument("patch", nargs="?")
+    c.add_argument("--from", dest="from_id", help="firmware ID of the old image")
+    a = sub.add_parser("apply", help="apply PATCH to OLD and write the result to NEW")
+    a.add_argument("old")
+    a.add_argument("patch")
+    a.add_argument("new")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+
+    if args.cmd == "create":
+        with open(args.new, "rb") as f:
+            new = f.read()
+        out = args.patch
+        if out is None:
+            from_id = args.from_id or firmware_id(args.old)
+            if from_id is None:
+                parser.error("no firmware ID in the old filename, use --from")
+            out = "%s.from-%s.patch" % (args.new, from_id)
+        patch = create(old, new)
+        if apply(old, patch) != new:
+            sys.exit("error: patch does not reproduce the new image")
+        with open(out, "wb") as f:
+            f.write(patch)
+        print("%s: %d bytes (%.1f%% of %d)" % (out, len(patch), 100.0 * len(patch) / len(new), len(new)))
+    else:
+        with open(args.patch, "rb") as f:
+            patch = f.read()
+        try:
+            new = apply(old, patch)
+        except ValueError as e:
+            sys.exit("error: %s" % e)
+        with open(args.new, "wb") as f:
+            f.write(new)
+
+
+if __name__ == "__main__":
+    main()
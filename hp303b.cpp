@@ -0,0 +1,332 @@
+#include <Arduino.h>
+#include <Wire.h>
+#include <stdint.h>
+#include "hp303b.h"
+
+#define HP303B_REG_PSR_B2     (0x00)
+#define HP303B_REG_TMP_B2     (0x03)
+#define HP303B_REG_PRS_CFG    (0x06)
+#define HP303B_REG_TMP_CFG    (0x07)
+#define HP303B_REG_MEAS_CFG   (0x08)
+#define HP303B_REG_CFG_REG    (0x09)
+#define HP303B_REG_FIFO_STS   (0x0B)
+#define HP303B_REG_RESET      (0x0C)
+#define HP303B_REG_PROD_ID    (0x0D)
+#define HP303B_REG_COEF       (0x10)
+#define HP303B_REG_COEF_SRCE  (0x28)
+
+#define HP303B_PROD_ID        (0x00) // low nibble of PROD_ID, the high nibble is the revision
+#define HP303B_COEF_RDY       (0x80) // MEAS_CFG status bits
+#define HP303B_SENSOR_RDY     (0x40)
+#define HP303B_TMP_RDY        (0x20)
+#define HP303B_PRS_RDY        (0x10)
+#define HP303B_TMP_EXT        (0x80) // temperature sensor the coefficients are for (COEF_SRCE and TMP_CFG)
+#define HP303B_T_SHIFT        (0x08) // CFG_REG result shifts, needed above 8x oversampling
+#define HP303B_P_SHIFT        (0x04)
+#define HP303B_FIFO_EN        (0x02)
+#define HP303B_FIFO_EMPTY     (0x01) // FIFO_STS
+#define HP303B_FIFO_FLUSH     (0x80) // RESET
+#define HP303B_MEAS_IDLE      (0x00) // MEAS_CFG measurement modes
+#define HP303B_MEAS_CONT_PRS  (0x05)
+#define HP303B_FIFO_EMPTY_VAL (-0x800000) // result read from an empty FIFO
+
+#define HP303B_LOOP_DELAY     (2)
+#define HP303B_INIT_RETRIES   (50)   // the coefficients are ready 40ms after power-on
+#define HP303B_POLL_RETRIES   (10)
+
+// measurement time for each oversampling rate in ms (rounded up)
+static const uint8_t meas_time_ms[] = {4, 6, 9, 15, 28, 54, 105, 207};
+// compensation scale factor for each oversampling rate
+static const float scale_factors[] = {524288, 1572864, 3670016, 7864320, 253952, 516096, 1040384, 2088960};
+
+static int read_regs(uint8_t addr, uint8_t reg, uint8_t *buf, uint8_t len)
+{
+  int retval;
+
+  Wire.beginTransmission(addr);
+  Wire.write(reg);
+  retval = Wire.endTransmission(false);
+
+  if (0 == retval) {
+    if (Wire.requestFrom(addr, len) != len) {
+      retval = HP303B_ERR_TIMEOUT;
+    } else {
+      for (int i=0; i<len; i++) {
+        buf[i] = Wire.read();
+      }
+    }
+  }
+
+  return retval;
+}
+
+static int write_reg(uint8_t addr, uint8_t reg, uint8_t val)
+{
+  Wire.beginTransmission(addr);
+  Wire.write(reg);
+  Wire.write(val);
+  return Wire.endTransmission();
+}
+
+static uint8_t hp303b_crc(const uint8_t *data, unsigned len)
+{
+  uint8_t crc = 0xff;
+
+  for (unsigned i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      if (crc & 0x80) {
+        crc = (crc << 1) ^ 0x31;
+      } else {
+        crc <<= 1;
+      }
+    }
+  }
+
+  return crc;
+}
+
+static int32_t twos_complement(uint32_t val, unsigned bits)
+{
+  if (val & (1UL << (bits - 1))) {
+    return (int32_t)val - (int32_t)(1UL << bits);
+  }
+  return val;
+}
+
+// read the calibration coefficients and configure the sensor for single measurements
+// cal_out is only modified on success
+int hp303b_init(uint8_t addr, hp303b_oversampling_t prs_osr, hp303b_oversampling_t tmp_osr, hp303b_cal_t *cal_out)
+{
+  hp303b_cal_t cal;
+  uint8_t val = 0;
+  uint8_t coef_srce = 0;
+  int retval;
+  int i = 0;
+
+  retval = read_regs(addr, HP303B_REG_PROD_ID, &val, 1);
+  if ((0 == retval) && ((val & 0x0F) != HP303B_PROD_ID)) {
+    retval = HP303B_ERR_ID;
+  }
+
+  while (0 == retval) {
+    retval = read_regs(addr, HP303B_REG_MEAS_CFG, &val, 1);
+    if ((0 == retval) && ((val & (HP303B_COEF_RDY | HP303B_SENSOR_RDY)) == (HP303B_COEF_RDY | HP303B_SENSOR_RDY))) {
+      break;
+    }
+    if (++i > HP303B_INIT_RETRIES) {
+      retval = HP303B_ERR_TIMEOUT;
+    } else {
+      delay(HP303B_LOOP_DELAY);
+    }
+  }
+
+  if (0 == retval) {
+    retval = read_regs(addr, HP303B_REG_COEF_SRCE, &coef_srce, 1);
+  }
+  if (0 == retval) {
+    retval = read_regs(addr, HP303B_REG_COEF, cal.coef, sizeof(cal.coef));
+  }
+
+  // temperature correction sequence of the vendor library (correctTemp)
+  if (0 == retval) retval = write_reg(addr, 0x0E, 0xA5);
+  if (0 == retval) retval = write_reg(addr, 0x0F, 0x96);
+  if (0 == retval) retval = write_reg(addr, 0x62, 0x02);
+  if (0 == retval) retval = write_reg(addr, 0x0E, 0x00);
+  if (0 == retval) retval = write_reg(addr, 0x0F, 0x00);
+
+  if (0 == retval) {
+    cal.prs_cfg = prs_osr;
+    cal.tmp_cfg = (coef_srce & HP303B_TMP_EXT) | tmp_osr;
+    cal.cfg_reg = 0;
+    if (prs_osr > HP303B_OSR_8)
+      cal.cfg_reg |= HP303B_P_SHIFT;
+    if (tmp_osr > HP303B_OSR_8)
+      cal.cfg_reg |= HP303B_T_SHIFT;
+    memset(cal.reserved, 0, sizeof(cal.reserved));
+    cal.check = hp303b_crc((uint8_t*)&cal, offsetof(hp303b_cal_t, check));
+
+    retval = write_reg(addr, HP303B_REG_PRS_CFG, cal.prs_cfg);
+    if (0 == retval) retval = write_reg(addr, HP303B_REG_TMP_CFG, cal.tmp_cfg);
+    if (0 == retval) retval = write_reg(addr, HP303B_REG_CFG_REG, cal.cfg_reg);
+  }
+
+  if (0 == retval) {
+    *cal_out = cal;
+  }
+
+  return retval;
+}
+
+// check that the calibration (kept in RTC memory) is intact
+bool hp303b_check_cal(const hp303b_cal_t *cal)
+{
+  return (cal->check == hp303b_crc((const uint8_t*)cal, offsetof(hp303b_cal_t, check)));
+}
+
+// perform a single measurement, only the field of data for the type is modified
+// the configuration registers are read back with the result, so a sensor that
+// lost its configuration is detected (HP303B_ERR_CONFIG) without extra transfers
+int hp303b_get(uint8_t addr, const hp303b_cal_t *cal, hp303b_measurement_t type, hp303b_data_t *data)
+{
+  uint8_t osr = ((HP303B_MEAS_TEMP == type) ? cal->tmp_cfg : cal->prs_cfg) & 0x07;
+  uint8_t ready = (HP303B_MEAS_TEMP == type) ? HP303B_TMP_RDY : HP303B_PRS_RDY;
+  uint8_t regs[HP303B_REG_CFG_REG + 1];
+  int retval;
+
+  retval = write_reg(addr, HP303B_REG_MEAS_CFG, type);
+
+  if (0 == retval) {
+    int i = 0;
+
+    delay(meas_time_ms[osr]);
+    while (0 == (retval = read_regs(addr, HP303B_REG_MEAS_CFG, &regs[HP303B_REG_MEAS_CFG], 1))) {
+      if (regs[HP303B_REG_MEAS_CFG] & ready) {
+        break;
+      }
+      if (++i > HP303B_POLL_RETRIES) {
+        retval = HP303B_ERR_TIMEOUT;
+      } else {
+        delay(1);
+      }
+    }
+  }
+
+  if (0 == retval) {
+    retval = read_regs(addr, HP303B_REG_PSR_B2, regs, sizeof(regs));
+  }
+
+  if (0 == retval) {
+    if ((regs[HP303B_REG_PRS_CFG] != cal->prs_cfg) ||
+        (regs[HP303B_REG_TMP_CFG] != cal->tmp_cfg) ||
+        (regs[HP303B_REG_CFG_REG] != cal->cfg_reg)) {
+      retval = HP303B_ERR_CONFIG;
+    } else {
+      uint8_t reg = (HP303B_MEAS_TEMP == type) ? HP303B_REG_TMP_B2 : HP303B_REG_PSR_B2;
+      int32_t val = twos_complement(((uint32_t)regs[reg] << 16) | (regs[reg+1] << 8) | regs[reg+2], 24);
+
+      if (HP303B_MEAS_TEMP == type) {
+        data->temp = val;
+      } else {
+        data->pressure = val;
+      }
+    }
+  }
+
+  return retval;
+}
+
+// (re)write the configuration registers that differ from the calibration and
+// update its checksum
+static int write_config(uint8_t addr, hp303b_cal_t *cal, uint8_t prs_cfg, uint8_t cfg_reg)
+{
+  int retval = 0;
+
+  if (prs_cfg != cal->prs_cfg)
+    retval = write_reg(addr, HP303B_REG_PRS_CFG, prs_cfg);
+  if ((0 == retval) && (cfg_reg != cal->cfg_reg))
+    retval = write_reg(addr, HP303B_REG_CFG_REG, cfg_reg);
+
+  if (0 == retval) {
+    cal->prs_cfg = prs_cfg;
+    cal->cfg_reg = cfg_reg;
+    cal->check = hp303b_crc((uint8_t*)cal, offsetof(hp303b_cal_t, check));
+  } else {
+    // the registers are in an unknown state, the sensor has to be initialized again
+    cal->check = ~hp303b_crc((uint8_t*)cal, offsetof(hp303b_cal_t, check));
+  }
+
+  return retval;
+}
+
+// start measuring pressure in the background at 2^rate measurements per
+// second into the FIFO, which holds up to HP303B_FIFO_SIZE results
+int hp303b_start_background(uint8_t addr, hp303b_cal_t *cal, uint8_t rate)
+{
+  int retval;
+
+  retval = write_config(addr, cal, ((rate & 0x07) << 4) | (cal->prs_cfg & 0x0F), cal->cfg_reg | HP303B_FIFO_EN);
+  if (0 == retval)
+    retval = write_reg(addr, HP303B_REG_RESET, HP303B_FIFO_FLUSH);
+  if (0 == retval)
+    retval = write_reg(addr, HP303B_REG_MEAS_CFG, HP303B_MEAS_CONT_PRS);
+
+  return retval;
+}
+
+// stop the background measurements and read the raw pressure results from
+// the FIFO into pressure (HP303B_FIFO_SIZE entries), the number read is
+// returned in num - this is 0 without bus traffic if the background mode wasn't started
+// afterwards the sensor is ready for single measurements again
+int hp303b_stop_background(uint8_t addr, hp303b_cal_t *cal, int32_t *pressure, unsigned *num)
+{
+  uint8_t regs[HP303B_REG_FIFO_STS - HP303B_REG_PRS_CFG + 1];
+  int retval;
+
+  *num = 0;
+  if (!(cal->cfg_reg & HP303B_FIFO_EN))
+    return 0;
+
+  // one read to check that the sensor is still configured and measuring
+  retval = read_regs(addr, HP303B_REG_PRS_CFG, regs, sizeof(regs));
+  if ((0 == retval) &&
+      ((regs[HP303B_REG_PRS_CFG - HP303B_REG_PRS_CFG] != cal->prs_cfg) ||
+       (regs[HP303B_REG_TMP_CFG - HP303B_REG_PRS_CFG] != cal->tmp_cfg) ||
+       (regs[HP303B_REG_CFG_REG - HP303B_REG_PRS_CFG] != cal->cfg_reg) ||
+       ((regs[HP303B_REG_MEAS_CFG - HP303B_REG_PRS_CFG] & 0x07) != HP303B_MEAS_CONT_PRS))) {
+    retval = HP303B_ERR_CONFIG;
+  }
+
+  if (0 == retval)
+    retval = write_reg(addr, HP303B_REG_MEAS_CFG, HP303B_MEAS_IDLE);
+
+  // each FIFO entry is read through the result registers, pressure results
+  // have the lsb set, temperature results (not used here) have it cleared
+  if ((0 == retval) && !(regs[HP303B_REG_FIFO_STS - HP303B_REG_PRS_CFG] & HP303B_FIFO_EMPTY)) {
+    for (int i=0; i<HP303B_FIFO_SIZE; i++) {
+      uint8_t buf[3];
+      int32_t val;
+
+      retval = read_regs(addr, HP303B_REG_PSR_B2, buf, sizeof(buf));
+      if (0 != retval)
+        break;
+      val = twos_complement(((uint32_t)buf[0] << 16) | (buf[1] << 8) | buf[2], 24);
+      if (HP303B_FIFO_EMPTY_VAL == val)
+        break;
+      if (val & 1)
+        pressure[(*num)++] = val;
+    }
+  }
+
+  if (0 == retval)
+    retval = write_config(addr, cal, cal->prs_cfg, cal->cfg_reg & ~HP303B_FIFO_EN);
+
+  return retval;
+}
+
+float hp303b_parse_temp_c(const hp303b_cal_t *cal, hp303b_data_t data)
+{
+  const uint8_t *c = cal->coef;
+  int32_t c0 = twos_complement(((uint32_t)c[0] << 4) | (c[1] >> 4), 12);
+  int32_t c1 = twos_complement(((uint32_t)(c[1] & 0x0F) << 8) | c[2], 12);
+  float t_sc = data.temp / scale_factors[cal->tmp_cfg & 0x07];
+
+  return c0*0.5f + c1*t_sc;
+}
+
+// compensated pressure in Pa, the temperature must be from a recent measurement
+float hp303b_parse_pressure(const hp303b_cal_t *cal, hp303b_data_t data)
+{
+  const uint8_t *c = cal->coef;
+  int32_t c00 = twos_complement(((uint32_t)c[3] << 12) | ((uint32_t)c[4] << 4) | (c[5] >> 4), 20);
+  int32_t c10 = twos_complement(((uint32_t)(c[5] & 0x0F) << 16) | ((uint32_t)c[6] << 8) | c[7], 20);
+  int32_t c01 = twos_complement(((uint32_t)c[8] << 8) | c[9], 16);
+  int32_t c11 = twos_complement(((uint32_t)c[10] << 8) | c[11], 16);
+  int32_t c20 = twos_complement(((uint32_t)c[12] << 8) | c[13], 16);
+  int32_t c21 = twos_complement(((uint32_t)c[14] << 8) | c[15], 16);
+  int32_t c30 = twos_complement(((uint32_t)c[16] << 8) | c[17], 16);
+  float t_sc = data.temp / scale_factors[cal->tmp_cfg & 0x07];
+  float p_sc = data.pressure / scale_factors[cal->prs_cfg & 0x07];
+
+  return c00 + p_sc*(c10 + p_sc*(c20 + p_sc*c30)) + t_sc*c01 + t_sc*p_sc*(c11 + p_sc*c21);
+}
@@ -0,0 +1,57 @@
+#ifndef _HP303B_H_
+#define _HP303B_H_
+#include <stdint.h>
+
+// return codes other than the TwoWire endTransmission errors
+#define HP303B_ERR_TIMEOUT  (-1)  // no response or the measurement didn't complete
+#define HP303B_ERR_ID       (-2)  // the device at the address isn't an HP303B
+#define HP303B_ERR_CONFIG   (-3)  // the sensor lost its configuration (power loss), run hp303b_init again
+
+#define HP303B_FIFO_SIZE    (32)  // results kept by the sensor in background mode
+
+// number of internal measurements (2^n) combined into one result
+typedef enum hp303b_oversampling_e {
+  HP303B_OSR_1,
+  HP303B_OSR_2,
+  HP303B_OSR_4,
+  HP303B_OSR_8,
+  HP303B_OSR_16,
+  HP303B_OSR_32,
+  HP303B_OSR_64,
+  HP303B_OSR_128
+} hp303b_oversampling_t;
+
+typedef enum hp303b_measurement_e {
+  HP303B_MEAS_PRESSURE = 1,
+  HP303B_MEAS_TEMP     = 2
+} hp303b_measurement_t;
+
+// Calibration coefficients and configuration of a sensor, as set up by
+// hp303b_init and changed by the background mode functions. Both are kept by
+// the sensor until it loses power, so this can be kept (in RTC memory) to
+// measure without setting the sensor up again.
+typedef struct hp303b_cal_s {
+  uint8_t coef[18];   // coefficient registers 0x10-0x21
+  uint8_t prs_cfg;    // PRS_CFG register (pressure rate and oversampling)
+  uint8_t tmp_cfg;    // TMP_CFG register (temperature sensor and oversampling)
+  uint8_t cfg_reg;    // CFG_REG register (result shifts, FIFO enable in background mode)
+  uint8_t reserved[2];
+  uint8_t check;      // CRC-8 of the fields above
+} hp303b_cal_t;
+
+// raw (uncompensated) measurement results
+typedef struct hp303b_data_s {
+  int32_t pressure;
+  int32_t temp;
+} hp303b_data_t;
+
+int hp303b_init(uint8_t addr, hp303b_oversampling_t prs_osr, hp303b_oversampling_t tmp_osr, hp303b_cal_t *cal_out);
+bool hp303b_check_cal(const hp303b_cal_t *cal);
+int hp303b_get(uint8_t addr, const hp303b_cal_t *cal, hp303b_measurement_t type, hp303b_data_t *data);
+int hp303b_start_background(uint8_t addr, hp303b_cal_t *cal, uint8_t rate);
+int hp303b_stop_background(uint8_t addr, hp303b_cal_t *cal, int32_t *pressure, unsigned *num);
+
+float hp303b_parse_temp_c(const hp303b_cal_t *cal, hp303b_data_t data);
+float hp303b_parse_pressure(const hp303b_cal_t *cal, hp303b_data_t data);
+
+#endif /* _HP303B_H_ */
@@ -9,10 +9,12 @@
 #include "EPD_1in9.h"
 #include "rtc_mem.h"
 #include "sensors.h"
+#include "spill_log.h"
 
 
 /* Global Data Structures */
 const uint32_t preinit_magic = PREINIT_MAGIC;
+static uint32_t epd_frame_pending; // hash of the frame that is being written to the display
 
 /* Functions */
 #if !TETHERED_MODE
@@ -53,10 +55,9 @@ void take_readings(void)
     read_vcc(false);
 
 #if TETHERED_MODE
-  // check the detection pin before reading the partical sensor since it shares
-  // DIO pins with the 1.9" EPD
-  if (!digitalRead(PPD42_PIN_DET))
-    read_ppd42();
+  // the particle sensor checks its detection pin itself, since it shares DIO
+  // pins with the 1.9" EPD they are released when it is removed
+  read_ppd42();
 #endif
 
   //read temp/humidity from SHT30
@@ -75,12 +76,21 @@ void take_readings(void)
 }
 #endif /* VCC_CAL_MODE */
 
+// completion callback of the display sequence, the frame is on the panel now
+static void disp_committed(void)
+{
+  rtc_mem[RTC_MEM_EPD_FRAME] = epd_frame_pending;
+}
+
 void disp_readings(bool connectivity=false, bool connection_error=false)
 {
   float temp;
   float batt;
   float *rtc_float_ptr;
   float humidity;
+  unsigned char frame[15];
+  uint32_t frame_hash = 2166136261UL;
+  bool full_refresh;
   flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
   boot_count_t *boot_count = (boot_count_t*) &rtc_mem[RTC_MEM_BOOT_COUNT];
   sleep_params_t *sleep_params = (sleep_params_t*) &rtc_mem[RTC_MEM_SLEEP_PARAMS];
@@ -95,6 +105,13 @@ void disp_readings(bool connectivity=false, bool connection_error=false)
     return;
 #endif
 
+  // the display didn't answer, skip the reset and init sequence until it is probed again
+  if (!i2c_device_present(I2C_DEV_EPD))
+    return;
+
+  // the display is reset below, so a refresh that is still running must finish first
+  EPD_1in9_Wait();
+
   // use the current temperature to initialize some display timings
   temp=get_temp();
   rtc_float_ptr = (float*)&rtc_mem[RTC_MEM_TEMP_CAL];
@@ -121,13 +138,37 @@ void disp_readings(bool connectivity=false, bool connection_error=false)
     flags->flags &= ~FLAG_BIT_LOW_BATTERY;
   }
 
+  // render the frame first, an unchanged one is already on the panel
+  humidity=get_humidity();
+  rtc_float_ptr = (float*)&rtc_mem[RTC_MEM_HUMIDITY_CAL];
+  humidity += *rtc_float_ptr;
+#if EPD_FAHRENHEIT
+  EPD_1in9_Easy_Render_Full_Screen(frame, (temp * 9/5)+32.0, humidity, EPD_FAHRENHEIT, connectivity, connection_error, low_battery, crit_battery);
+#else
+  EPD_1in9_Easy_Render_Full_Screen(frame, temp, humidity, EPD_FAHRENHEIT, connectivity, connection_error, low_battery, crit_battery);
+#endif
+  for (unsigned i = 0; i < sizeof(frame); i++) {
+    frame_hash ^= frame[i];
+    frame_hash *= 16777619UL;
+  }
+
+  //a full refresh is due if the time since the last one is > 3 minutes
+  //use 0 as the trigger for a full refresh so that we do this on initial power up
+  //as well as if the refresh counter rolls over from 255 -> 0
+  full_refresh = (boot_count->epd_partial_refresh_count == 0) ||
+    ((uint64_t)boot_count->epd_partial_refresh_count * sleep_params->sleep_time_ms >= EPD_FULL_REFRESH_TIME_MS);
+
   // if temperature is below 0 celsius, or if the battery voltage is
   // already critical, don't initialize the display
+  // skip the whole init/write/sleep cycle if the panel shows this frame already
   if ((0 != res) || (temp < 0)) {
     res = 1;
+  } else if (!full_refresh && (frame_hash == rtc_mem[RTC_MEM_EPD_FRAME])) {
+    return;
   } else {
     EPD_1in9_GPIOInit();
     res = EPD_1in9_init();
+    i2c_device_result(I2C_DEV_EPD, 0 == res);
   }
 
   if (0 != res) {
@@ -136,30 +177,25 @@ void disp_readings(bool connectivity=false, bool connection_error=false)
   }
   else
   {
-    uint64_t templ = boot_count->epd_partial_refresh_count * sleep_params->sleep_time_ms;
-
-    //set to 0 if the time since last full refresh is > 3 minutes
-    if (templ >= EPD_FULL_REFRESH_TIME_MS)
+    if (full_refresh) {
       boot_count->epd_partial_refresh_count = 0;
-
-    //use 0 as the trigger for a full refresh so that we do this on initial power up
-    //as well as if the refresh counter rolls over from 255 -> 0
-    if (boot_count->epd_partial_refresh_count == 0)
-      EPD_1in9_Clear_Screen();
+      EPD_1in9_Queue_Clear_Screen();
+    }
 
     //increment the refresh count after making decision
     //so that we can do a full refresh on initial power up
     boot_count->epd_partial_refresh_count++;
   }
 
-#if EPD_FAHRENHEIT
-  temp = (temp * 9/5)+32.0;
-#endif
-  humidity=get_humidity();
-  rtc_float_ptr = (float*)&rtc_mem[RTC_MEM_HUMIDITY_CAL];
-  humidity += *rtc_float_ptr;
-  EPD_1in9_Easy_Write_Full_Screen(temp, humidity, EPD_FAHRENHEIT, connectivity, connection_error, low_battery, crit_battery);
-  EPD_1in9_sleep();
+  EPD_1in9_Queue_Write_Screen(frame);
+  EPD_1in9_Queue_Pause();
+  EPD_1in9_Queue_Sleep();
+
+  // the refresh runs in the background while the readings are uploaded, the
+  // frame is only known to be on the panel once it has finished
+  rtc_mem[RTC_MEM_EPD_FRAME] = 0;
+  epd_frame_pending = frame_hash;
+  EPD_1in9_Start(disp_committed);
 }
 
 bool check_upload_conditions(void)
@@ -171,15 +207,17 @@ bool check_upload_conditions(void)
 
   /*
    * Normal upload condition:
-   * If our number of collected readings is above the high water mark, then it
-   * is time to start uploading (allowing for a couple of failed connections).
+   * If our number of collected frames is above the high water mark, or the
+   * ring buffer is nearly full, then it is time to start uploading (allowing
+   * for a couple of failed connections).
    * Extra conditions:
    * If our boot count is a power of 2 during the first few boots, then we will
    * do a special upload to get some early readings sent to the server.
    * (This way you won't have to wait for 30-45 minutes before the initial
    * readings come in.)
    */
-  if (rtc_mem[RTC_MEM_NUM_READINGS] >= sleep_params->high_water_slot) {
+  if ((rtc_mem[RTC_MEM_NUM_FRAMES] >= sleep_params->high_water_slot) ||
+    (readings_free_space() < RTC_FRAME_MAX_SIZE)) {
     flags->flags |= FLAG_BIT_NORMAL_UPLOAD_COND;
     return true;
   }
@@ -194,12 +232,18 @@ bool check_upload_conditions(void)
 void tethered_sleep(int64_t millis_offset, bool please_reboot)
 {
   sleep_params_t *sleep_params = (sleep_params_t*) &rtc_mem[RTC_MEM_SLEEP_PARAMS];
-  int64_t sleep_delta_ms = (int64_t)sleep_params->sleep_time_ms - ((int64_t)millis()-millis_offset);
+  int64_t sleep_delta_ms;
+  // the PPD42 is sampled by interrupts between the readings, which a deep
+  // sleep would stop (and the next reading would have to wait for a new window)
+  bool ppd42_sampling = !digitalRead(PPD42_PIN_DET);
+
+  EPD_1in9_Wait();
+  sleep_delta_ms = (int64_t)sleep_params->sleep_time_ms - ((int64_t)millis()-millis_offset);
 
 #if EXTRA_DEBUG
   Serial.printf("[%llu] sleep_delta_ms=%lld\n", uptime(), sleep_delta_ms);
 #endif
-  if (sleep_delta_ms > 200LL)
+  if ((sleep_delta_ms > 200LL) && (please_reboot || !ppd42_sampling))
     deep_sleep(sleep_delta_ms*1000);
   else if (please_reboot)
     deep_sleep(100);
@@ -219,6 +263,7 @@ void battery_sleep(bool connect_failed=false)
   uint64_t sleep_delta_ms = sleep_params->sleep_time_ms;
 
   connectivity_disable();
+  EPD_1in9_Wait();
 
   if (connect_failed) {
     sleep_delta_ms <<= flags->fail_count;
@@ -234,6 +279,9 @@ void battery_sleep(bool connect_failed=false)
   if (flags->flags & FLAG_BIT_LOW_BATTERY)
     sleep_delta_ms = MAX_ESP_SLEEP_TIME_MS; // battery voltage is critical, sleep forever
 
+#if EXTRA_DEBUG
+  Serial.printf("Awake for %lu ms\n", millis());
+#endif
   deep_sleep(sleep_delta_ms*1000);
 }
 #endif /* !TETHERED_MODE */
@@ -248,8 +296,8 @@ void setup(void)
   delay(2);
   Serial.println();
 
-  sensors_init();
   rtc_config_valid = load_rtc_memory();
+  sensors_init();
 
   // We can detect a "double press" of the reset button as a regular Ext Reset
   // This is because we spend most of our time asleep and a single press will
@@ -285,13 +333,24 @@ void loop(void)
   bool connect_failed = false;
   bool want_to_connect = false;
 
+#if !TETHERED_MODE
+  // the upload was decided on the previous wake, so the radio can start
+  // associating right away while the readings are taken and displayed
+  if (0 != (flags->flags & FLAG_BIT_CONNECT_NEXT_WAKE)) {
+    want_to_connect = true;
+
+    //this is normally done in setup() but deferred in battery mode
+    connectivity_init();
+#if !SIMULATE_GOOD_CONNECTION
+    start_wifi();
+#endif
+  }
+#endif
+
   take_readings();
   dump_readings();
 
-#if !TETHERED_MODE
-  if (0 != (flags->flags & FLAG_BIT_CONNECT_NEXT_WAKE))
-    want_to_connect = true;
-#else
+#if TETHERED_MODE
   if (check_upload_conditions())
     want_to_connect = true;
 #endif
@@ -304,26 +363,22 @@ void loop(void)
 
   // is it time to connect and upload our readings?
   if (want_to_connect) {
-    uint32_t num_readings = rtc_mem[RTC_MEM_NUM_READINGS];
-
-#if !TETHERED_MODE
-    //this is normally done in setup() but deferred in battery mode
-    connectivity_init();
-#endif
+    bool uploaded = false;
 
 #if SIMULATE_GOOD_CONNECTION
     Serial.println("Simulating WiFi connection");
     Serial.println("Simulating upload");
     clear_readings();
     Serial.println("Upload OK");
+    uploaded = true;
 #else
     if (connect_wifi())
-      upload_readings();
+      uploaded = upload_readings();
 #endif
 
-    //we failed to make progress uploading readings
+    //we failed to make progress uploading readings (including the spilled ones)
     //factor this into sleep time decisions
-    if (rtc_mem[RTC_MEM_NUM_READINGS] == num_readings)
+    if (!uploaded)
       connect_failed = true;
 
     // if we have failed the defined number of times, display a connection error message
@@ -335,6 +390,11 @@ void loop(void)
     // on the EPD_1in9 display, then clear it and show the actual readings
     if (!connect_failed && (flags->fail_count > DISP_CONNECT_FAIL_COUNT))
       disp_readings(false, false);
+
+    // if the upload failed and the ring buffer is about to overflow, move the
+    // readings to flash instead of letting the oldest ones be evicted
+    if (connect_failed && (readings_free_space() < 2*RTC_FRAME_MAX_SIZE))
+      spill_readings();
   }
 
 #if !TETHERED_MODE
@@ -1,13 +1,66 @@
 #include "project_config.h"
 
 #include <Arduino.h>
+#include <Esp.h>
 #include <FS.h>
+#include <coredecls.h>
 
 #include "persistent.h"
 
 
+/* Local Constants */
+#define CONFIG_RECORD_MAGIC   (0xC0F1)
+#define CONFIG_RECORD_VERSION (1)
+#define CONFIG_VALUE_SIZE     (64)  //maximum length of a config value, including the terminator
+
+// config keys that are stored in the config record instead of separate files
+// (the order must match config_parse)
+static const char* const config_keys[] = {
+  PERSISTENT_NODE_NAME,
+  PERSISTENT_REPORT_HOST_NAME,
+  PERSISTENT_REPORT_HOST_PORT,
+  PERSISTENT_CLOCK_CALIB,
+  PERSISTENT_TEMP_CALIB,
+  PERSISTENT_HUMIDITY_CALIB,
+  PERSISTENT_PRESSURE_CALIB,
+  PERSISTENT_BATTERY_CALIB,
+  PERSISTENT_SLEEP_TIME_MS,
+  PERSISTENT_HIGH_WATER_SLOT,
+};
+#define NUM_CONFIG_KEYS (sizeof(config_keys)/sizeof(*config_keys))
+
+
+/* Local Types */
+// All config values packed in a single record, which is written alternately
+// to two files so a power loss during a write always leaves a valid copy
+typedef struct config_record_s {
+  uint16_t magic;                                     // CONFIG_RECORD_MAGIC
+  uint16_t version;                                   // CONFIG_RECORD_VERSION
+  uint32_t generation;                                // incremented on every write, the newest copy is used
+  uint8_t  lengths[NUM_CONFIG_KEYS];                  // length of each value
+  char     values[NUM_CONFIG_KEYS][CONFIG_VALUE_SIZE]; // null-terminated value of each config key
+  uint32_t crc;                                       // crc32 of all of the above
+} config_record_t;
+
+
+/* Global Data Structures */
+static config_record_t config_record;
+static persistent_config_t config;
+static char default_node_name[sizeof(DEFAULT_NODE_BASE_NAME) + 10];
+static unsigned config_slot;  //file holding the current record
+
+
 /* Function Prototypes */
 static bool spiffs_init(void);
+static bool config_init(void);
+static int config_key(const char* filename);
+static bool config_set(size_t key, const uint8_t *buf, size_t size);
+static bool config_load(unsigned slot, config_record_t *record);
+static bool config_store(config_record_t *record);
+static void config_parse(void);
+static bool is_default(const char* value);
+static int parse_int(const char* value, int default_value);
+static float parse_float(const char* value, float default_value);
 
 /* Functions */
 // initializes spiffs as a singleton and returns the result
@@ -40,8 +93,12 @@ void persistent_init(void)
 String persistent_read(const char* filename)
 {
   String retval = "";
+  int key = config_key(filename);
 
-  if (spiffs_init()) {
+  if (key >= 0) {
+    if (config_init())
+      retval = config_record.values[key];
+  } else if (spiffs_init()) {
     String path = "/"; path += filename;
     File persfile = SPIFFS.open(path, "r");
 
@@ -64,7 +121,7 @@ String persistent_read(const char* filename)
 String persistent_read(const char* filename, String default_value)
 {
   String persist_value = persistent_read(filename);
-  if (persist_value == "" || persist_value == " " || persist_value == "default")
+  if (is_default(persist_value.c_str()))
     return default_value;
   else
     return persist_value;
@@ -74,48 +131,32 @@ String persistent_read(const char* filename, String default_value)
 // return default_value if persistent file contains "", " ", or if there is no parseable integer
 int persistent_read(const char* filename, int default_value)
 {
-  String persist_value = persistent_read(filename);
-  const char* nptr = persist_value.c_str();
-  char* endptr = (char*)nptr;
-  int retval;
-
-  if (persist_value == "" || persist_value == " ")
-    return default_value;
-  else
-    retval = strtol(nptr, &endptr, 0);
-
-  if ((0==retval) && (nptr==endptr))
-    return default_value;
-  else
-    return retval;
+  return parse_int(persistent_read(filename).c_str(), default_value);
 }
 
 // read a float from a persistent file or return default_value
 // return default_value if persistent file contains "", " ", or if there is no parseable float
 float persistent_read(const char* filename, float default_value)
 {
-  String persist_value = persistent_read(filename);
-  const char* nptr = persist_value.c_str();
-  char* endptr = (char*)nptr;
-  float retval;
-
-  if (persist_value == "" || persist_value == " ")
-    return default_value;
-  else
-    retval = strtof(nptr, &endptr);
+  return parse_float(persistent_read(filename).c_str(), default_value);
+}
 
-  if ((0==retval) && (nptr==endptr))
-    return default_value;
-  else
-    return retval;
+// return the typed config values, loading the config record on first use
+const persistent_config_t* persistent_config(void)
+{
+  config_init();
+  return &config;
 }
 
 // write a data string to a persistent file
 bool persistent_write(const char* filename, String data)
 {
   bool retval = false;
+  int key = config_key(filename);
 
-  if (spiffs_init()) {
+  if (key >= 0) {
+    retval = config_set(key, (const uint8_t*)data.c_str(), data.length());
+  } else if (spiffs_init()) {
     String path = "/"; path += filename;
     File persfile = SPIFFS.open(path, "w");
 
@@ -141,8 +182,11 @@ bool persistent_write(const char* filename, String data)
 bool persistent_write(const char* filename, const uint8_t *buf, size_t size)
 {
   bool retval = false;
+  int key = config_key(filename);
 
-  if (spiffs_init()) {
+  if (key >= 0) {
+    retval = config_set(key, buf, size);
+  } else if (spiffs_init()) {
     String path = "/"; path += filename;
     File persfile = SPIFFS.open(path, "w");
 
@@ -163,3 +207,321 @@ bool persistent_write(const char* filename, const uint8_t *buf, size_t size)
 
   return retval;
 }
+
+// append a data buffer to a persistent file (creating it if needed)
+bool persistent_append(const char* filename, const uint8_t *buf, size_t size)
+{
+  bool retval = false;
+
+  if (spiffs_init()) {
+    String path = "/"; path += filename;
+    File persfile = SPIFFS.open(path, "a");
+
+    if (persfile) {
+#if (EXTRA_DEBUG != 0)
+      Serial.printf("%s += %d bytes\n", path.c_str(), size);
+#endif
+      size_t result = persfile.write(buf, size);
+      persfile.close();
+      if (result != size)
+        Serial.printf("Short write %s (%d)\n", path.c_str(), result);
+      else
+        retval = true;
+    } else {
+      Serial.print("Could not open "); Serial.println(path);
+    }
+  }
+
+  return retval;
+}
+
+// read up to size bytes starting at offset from a persistent file into buf
+// returns the number of bytes read
+size_t persistent_read(const char* filename, size_t offset, uint8_t *buf, size_t size)
+{
+  size_t retval = 0;
+  int key = config_key(filename);
+
+  if (key >= 0) {
+    if (config_init() && (offset < config_record.lengths[key])) {
+      retval = config_record.lengths[key] - offset;
+      if (retval > size)
+        retval = size;
+      memcpy(buf, &config_record.values[key][offset], retval);
+    }
+  } else if (spiffs_init()) {
+    String path = "/"; path += filename;
+    File persfile = SPIFFS.open(path, "r");
+
+    if (persfile) {
+      if (persfile.seek(offset, SeekSet))
+        retval = persfile.read(buf, size);
+      persfile.close();
+    } else {
+      Serial.println("Could not open " + path);
+    }
+  }
+
+  return retval;
+}
+
+// return the size of a persistent file, or 0 if it doesn't exist
+size_t persistent_size(const char* filename)
+{
+  size_t retval = 0;
+  int key = config_key(filename);
+
+  if (key >= 0) {
+    if (config_init())
+      retval = config_record.lengths[key];
+  } else if (spiffs_init()) {
+    String path = "/"; path += filename;
+
+    if (SPIFFS.exists(path)) {
+      File persfile = SPIFFS.open(path, "r");
+
+      if (persfile) {
+        retval = persfile.size();
+        persfile.close();
+      }
+    }
+  }
+
+  return retval;
+}
+
+// return the free space in the file system in bytes
+size_t persistent_free(void)
+{
+  size_t retval = 0;
+  FSInfo info;
+
+  if (spiffs_init() && SPIFFS.info(info) && (info.totalBytes > info.usedBytes))
+    retval = info.totalBytes - info.usedBytes;
+
+  return retval;
+}
+
+// delete a persistent file
+bool persistent_remove(const char* filename)
+{
+  bool retval = false;
+  int key = config_key(filename);
+
+  if (key >= 0) {
+    retval = config_set(key, NULL, 0);
+  } else if (spiffs_init()) {
+    String path = "/"; path += filename;
+
+    retval = SPIFFS.remove(path);
+#if (EXTRA_DEBUG != 0)
+    Serial.println("Removed " + path);
+#endif
+  }
+
+  return retval;
+}
+
+// loads the config record as a singleton, migrating the legacy config files
+// if there is no valid record yet
+static bool config_init(void)
+{
+  static bool initialized = false;
+  static bool success = false;
+  static config_record_t record;  //static to keep it off the stack
+
+  if (!initialized) {
+    initialized = true;
+    memset(&config_record, 0, sizeof(config_record));
+
+    if (spiffs_init()) {
+      // use the newest valid copy
+      for (unsigned slot=0; slot < 2; slot++) {
+        if (config_load(slot, &record) &&
+            (!success || ((int32_t)(record.generation - config_record.generation) > 0))) {
+          memcpy(&config_record, &record, sizeof(config_record));
+          config_slot = slot;
+          success = true;
+        }
+      }
+
+      if (!success) {
+        Serial.println("Migrating config files to the config record");
+        config_record.magic = CONFIG_RECORD_MAGIC;
+        config_record.version = CONFIG_RECORD_VERSION;
+        config_slot = 1; //the first write goes to slot 0
+        for (size_t key=0; key < NUM_CONFIG_KEYS; key++) {
+          String path = "/"; path += config_keys[key];
+          File persfile = SPIFFS.open(path, "r");
+
+          if (persfile) {
+            config_record.lengths[key] = persfile.read((uint8_t*)config_record.values[key], CONFIG_VALUE_SIZE-1);
+            persfile.close();
+          }
+        }
+        success = config_store(&config_record);
+        if (success)
+          for (size_t key=0; key < NUM_CONFIG_KEYS; key++)
+            SPIFFS.remove(String("/") + config_keys[key]);
+      }
+    }
+
+    // the defaults apply to any values that could not be loaded
+    config_parse();
+  }
+
+  return success;
+}
+
+// returns the index of a config key in the config record or -1 for other files
+static int config_key(const char* filename)
+{
+  for (size_t key=0; key < NUM_CONFIG_KEYS; key++)
+    if (0 == strcmp(filename, config_keys[key]))
+      return key;
+
+  return -1;
+}
+
+// update a value in the config record and store the record
+// the change is made in a copy, which only replaces the record in RAM once it
+// has been stored, so that RAM and flash agree after a failed write
+static bool config_set(size_t key, const uint8_t *buf, size_t size)
+{
+  static config_record_t record;  //static to keep it off the stack
+
+  if (!config_init())
+    return false;
+
+  if (size >= CONFIG_VALUE_SIZE) {
+    Serial.printf("Config value too long for %s (%d)\n", config_keys[key], size);
+    return false;
+  }
+
+  // skip the flash write if nothing changes
+  if ((size == config_record.lengths[key]) && (0 == memcmp(config_record.values[key], buf, size)))
+    return true;
+
+#if (EXTRA_DEBUG != 0)
+  Serial.printf("%s <- %.*s\n", config_keys[key], size, (const char*)buf);
+#endif
+  memcpy(&record, &config_record, sizeof(record));
+  memset(record.values[key], 0, CONFIG_VALUE_SIZE);
+  if (size > 0)
+    memcpy(record.values[key], buf, size);
+  record.lengths[key] = size;
+
+  if (!config_store(&record))
+    return false;
+
+  memcpy(&config_record, &record, sizeof(config_record));
+  config_parse();
+
+  return true;
+}
+
+// read a copy of the config record and return true if it is valid
+static bool config_load(unsigned slot, config_record_t *record)
+{
+  bool retval = false;
+  File persfile = SPIFFS.open(slot ? "/" PERSISTENT_CONFIG_RECORD_1 : "/" PERSISTENT_CONFIG_RECORD_0, "r");
+
+  if (persfile) {
+    retval = (sizeof(*record) == persfile.read((uint8_t*)record, sizeof(*record))) &&
+             (CONFIG_RECORD_MAGIC == record->magic) &&
+             (CONFIG_RECORD_VERSION == record->version) &&
+             (record->crc == crc32(record, offsetof(config_record_t, crc)));
+    persfile.close();
+  }
+
+  return retval;
+}
+
+// write a config record to the older of the two copies
+// the newer copy stays the current one if the write fails
+static bool config_store(config_record_t *record)
+{
+  bool retval = false;
+  unsigned slot = config_slot ^ 1;
+  const char* path;
+
+  record->generation = config_record.generation + 1;
+  record->crc = crc32(record, offsetof(config_record_t, crc));
+  path = slot ? "/" PERSISTENT_CONFIG_RECORD_1 : "/" PERSISTENT_CONFIG_RECORD_0;
+
+  File persfile = SPIFFS.open(path, "w");
+  if (persfile) {
+    size_t result = persfile.write((const uint8_t*)record, sizeof(*record));
+    persfile.close();
+    if (result != sizeof(*record)) {
+      Serial.printf("Short write %s (%d)\n", path, result);
+    } else {
+      config_slot = slot;
+      retval = true;
+    }
+  } else {
+    Serial.print("Could not open "); Serial.println(path);
+  }
+
+  return retval;
+}
+
+// update the typed config values from the config record
+static void config_parse(void)
+{
+  if (0 == config_record.lengths[0]) {
+    snprintf(default_node_name, sizeof(default_node_name), "%s%u", DEFAULT_NODE_BASE_NAME, ESP.getChipId());
+    config.node_name = default_node_name;
+  } else {
+    config.node_name = config_record.values[0];
+  }
+  config.report_host_name = is_default(config_record.values[1]) ? DEFAULT_REPORT_HOST_NAME : config_record.values[1];
+  config.report_host_port = parse_int(config_record.values[2], (int)DEFAULT_REPORT_HOST_PORT);
+  config.clock_calib      = parse_int(config_record.values[3], DEFAULT_SLEEP_CLOCK_ADJ);
+  config.temp_calib       = parse_float(config_record.values[4], DEFAULT_TEMP_CALIB);
+  config.humidity_calib   = parse_float(config_record.values[5], DEFAULT_HUMIDITY_CALIB);
+  config.pressure_calib   = parse_float(config_record.values[6], DEFAULT_PRESSURE_CALIB);
+  config.battery_calib    = parse_float(config_record.values[7], DEFAULT_BATTERY_CALIB);
+  config.sleep_time_ms    = parse_int(config_record.values[8], (int)DEFAULT_SLEEP_TIME_MS);
+  config.high_water_slot  = parse_int(config_record.values[9], DEFAULT_HIGH_WATER_SLOT);
+}
+
+// return true if a value selects the default value ("", " ", or "default")
+static bool is_default(const char* value)
+{
+  return !strcmp(value, "") || !strcmp(value, " ") || !strcmp(value, "default");
+}
+
+// parse an integer or return default_value if there is no parseable integer
+static int parse_int(const char* value, int default_value)
+{
+  char* endptr = (char*)value;
+  int retval;
+
+  if (is_default(value))
+    return default_value;
+  else
+    retval = strtol(value, &endptr, 0);
+
+  if ((0==retval) && (value==endptr))
+    return default_value;
+  else
+    return retval;
+}
+
+// parse a float or return default_value if there is no parseable float
+static float parse_float(const char* value, float default_value)
+{
+  char* endptr = (char*)value;
+  float retval;
+
+  if (is_default(value))
+    return default_value;
+  else
+    retval = strtof(value, &endptr);
+
+  if ((0==retval) && (value==endptr))
+    return default_value;
+  else
+    return retval;
+}
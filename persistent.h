@@ -4,6 +4,22 @@
 #include "project_config.h"
 
 
+/* Types */
+// Config values with the defaults applied, see persistent_config()
+typedef struct persistent_config_s {
+  const char *node_name;
+  const char *report_host_name;
+  int         report_host_port;
+  int         clock_calib;
+  float       temp_calib;
+  float       humidity_calib;
+  float       pressure_calib;
+  float       battery_calib;
+  int         sleep_time_ms;     // not clamped
+  int         high_water_slot;   // not clamped
+} persistent_config_t;
+
+
 /* Function Prototypes */
 void persistent_init(void); //optional - initialize early
 
@@ -11,8 +27,15 @@ String persistent_read(const char* filename);
 String persistent_read(const char* filename, String default_value);
 int persistent_read(const char* filename, int default_value);
 float persistent_read(const char* filename, float default_value);
+const persistent_config_t* persistent_config(void);
 
 bool persistent_write(const char* filename, String data);
 bool persistent_write(const char* filename, const uint8_t *buf, size_t size);
 
+bool persistent_append(const char* filename, const uint8_t *buf, size_t size);
+size_t persistent_read(const char* filename, size_t offset, uint8_t *buf, size_t size);
+size_t persistent_size(const char* filename);
+size_t persistent_free(void);
+bool persistent_remove(const char* filename);
+
 #endif /* _PERSISTENT_H_ */
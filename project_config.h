@@ -15,9 +15,62 @@
 #define CONFIG_SERVER_MAX_TIME  (120 /* seconds without client */)
 #define BUILD_UNIQUE_ID         (__TIME__[3]*1000+__TIME__[4]*100+__TIME__[6]*10+__TIME__[7])
 #define PREINIT_MAGIC           (0xAA559876 ^ BUILD_UNIQUE_ID)
+
+/* features that the supported ESP8266 Arduino core releases differ in (see
+   README.md), git builds of the core are assumed to be recent */
+#include <core_version.h>
+#if defined(ARDUINO_ESP8266_RELEASE_2_4_0) || defined(ARDUINO_ESP8266_RELEASE_2_4_1) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_4_2) || defined(ARDUINO_ESP8266_RELEASE_2_5_0) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_5_1) || defined(ARDUINO_ESP8266_RELEASE_2_5_2)
+  #define CORE_HAS_RECURRENT_SCHEDULE (0) /* schedule_recurrent_function_us, new in 2.6.0 */
+#else
+  #define CORE_HAS_RECURRENT_SCHEDULE (1)
+#endif
+#if !CORE_HAS_RECURRENT_SCHEDULE || defined(ARDUINO_ESP8266_RELEASE_2_6_0) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_6_1) || defined(ARDUINO_ESP8266_RELEASE_2_6_2) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_6_3)
+  #define CORE_HAS_GZIP_UPDATE (0) /* Update and eboot accept gzip images from 2.7.0 */
+#else
+  #define CORE_HAS_GZIP_UPDATE (1)
+#endif
+
 #define SHT30_ADDR              (0x45)
+/* the SHT30 repeatability steps down (high, medium, low) on each wake that the
+   readings changed less than this since the last one and goes back to high on
+   a larger change, it is always low while the battery is low */
+#define SHT30_STABLE_TEMP       (0.3f /* °C */)
+#define SHT30_STABLE_HUMIDITY   (1.0f /* %RH */)
+/* samples with a bad checksum are measured again at low repeatability */
+#define SHT30_CRC_RETRIES       (2)
+#define HP303B_ADDR             (0x77)
+/* HP303B oversampling, 16x pressure has a noise of 2 counts and takes 28ms,
+   the temperature is only needed for the compensation unless the SHT30 fails */
+#define HP303B_PRS_OSR          (HP303B_OSR_16)
+#define HP303B_TMP_OSR          (HP303B_OSR_8)
+/* keep the HP303B measuring pressure into its FIFO at 2^HP303B_BACKGROUND_RATE
+   measurements per second while the ESP sleeps, the stored pressure is then
+   the mean of the FIFO instead of a single measurement */
+#define HP303B_BACKGROUND_MODE  (1)
+#define HP303B_BACKGROUND_RATE  (0)
+/* the I2C bus runs at I2C_FAST_CLOCK if all devices that may be present support
+   it, the SHT30 and HP303B do, the EPD controller isn't specified above 100kHz */
+#define I2C_FAST_CLOCK          (400000)
+#define EPD_I2C_FAST_MODE       (0)
+/* devices that didn't answer are probed again after this many wakes */
+#define I2C_CENSUS_REPROBE_WAKES (1440)
 #define REPORT_RESPONSE_TIMEOUT (2000)
+/* number of binary readings messages that may be awaiting acknowledgement
+   from the report server at once, json messages are sent one at a time */
+#define REPORT_WINDOW_SIZE      (4)
+/* time (in s) that the resolved address of the report server is used before
+   the host name is resolved again, the resolver doesn't report the record TTL */
+#define REPORT_HOST_DNS_TTL     (3600)
 #define WIFI_CONNECT_TIMEOUT    (30000)
+/* association with the cached BSSID, channel, and IP settings normally takes a
+   few hundred ms, fall back to a full scan and DHCP if it takes longer than this */
+#define WIFI_FAST_CONNECT_TIMEOUT (1500)
+/* renew the DHCP lease through the slow path after this many fast connects */
+#define WIFI_FAST_CONNECT_MAX_USES (48)
 #define LOW_BATTERY_VOLTAGE     (3.14f)
 #define CRIT_BATTERY_VOLTAGE    (2.70f)
 /* num of connection failures after which the next failure will result in
@@ -30,6 +83,34 @@
    that will work over a typical temperature range and clamp any sleep
    period to this value */
 #define MAX_ESP_SLEEP_TIME_MS   (9180000ULL)
+/* maximum size of the flash log that the RTC ring buffer is spilled to
+   while uploads are failing (~10 days of readings at the default sleep time) */
+#define SPILL_LOG_MAX_SIZE      (131072)
+/* store the spill log in a raw region of the SPI NOR flash instead of SPIFFS
+   the region must not overlap the sketch, the OTA staging area, or the file
+   system, e.g. with the "4MB (FS:1MB OTA:~1019KB)" flash layout the 1MB-2MB
+   range is unused as long as sketches stay below 1MB */
+#define SPILL_LOG_NOR_FLASH     (0)
+#define NOR_LOG_START_ADDR      (0x100000)
+#define NOR_LOG_SIZE            (0x40000)
+/* request gzip compressed firmware updates, the image is stored compressed in
+   the OTA staging area and eboot inflates it while copying it over the sketch
+   only possible with ESP8266 Arduino core 2.7.0 or later */
+#define FIRMWARE_UPDATE_GZIP    (CORE_HAS_GZIP_UPDATE)
+/* accept firmware updates as a patch (see firmware_patch.py) against the
+   running image, which is rebuilt from flash while it is written to Update */
+#define FIRMWARE_UPDATE_PATCH   (1)
+/* firmware updates are downloaded to a file in SPIFFS in chunks of at most this
+   many bytes per upload, so a download that is cut off resumes on a later wake */
+#define FIRMWARE_UPDATE_CHUNK   (65536)
+/* space in SPIFFS that staging a firmware update keeps free for the spill log
+   and the config files, an update that doesn't fit next to it is written to the
+   OTA staging area as it is received, which needs all of it in one upload */
+#if SPILL_LOG_NOR_FLASH
+  #define FIRMWARE_STAGE_RESERVE (8192)
+#else
+  #define FIRMWARE_STAGE_RESERVE (SPILL_LOG_MAX_SIZE + 8192)
+#endif
 
 #if TETHERED_MODE
   #define PPD42_PIN_DET         (D5)
@@ -51,22 +132,22 @@
   #define DISABLE_FW_UPDATE     (1)
   #define SIMULATE_GOOD_CONNECTION (1)
   #define SLEEP_TIME_US         (10000000ULL)
-  #define NUM_STORAGE_SLOTS     (27)
+  #define NUM_STORAGE_WORDS     (23)
   #if TETHERED_MODE
     #define HIGH_WATER_SLOT     (1)
   #else
-    #define HIGH_WATER_SLOT     (17)
+    #define HIGH_WATER_SLOT     (6)
   #endif
 #else
   #define EXTRA_DEBUG           (0)
   #define DISABLE_FW_UPDATE     (0)
   #define SIMULATE_GOOD_CONNECTION (0)
   #define SLEEP_TIME_US         (60000000ULL)
-  #define NUM_STORAGE_SLOTS     (117)
+  #define NUM_STORAGE_WORDS     (73)
   #if TETHERED_MODE
     #define HIGH_WATER_SLOT     (1)
   #else
-    #define HIGH_WATER_SLOT     (NUM_STORAGE_SLOTS-15)
+    #define HIGH_WATER_SLOT     (40)
   #endif
 #endif
 
@@ -81,6 +162,11 @@
 #define PERSISTENT_BATTERY_CALIB    "battery_calibration"
 #define PERSISTENT_SLEEP_TIME_MS    "sleep_time_ms"
 #define PERSISTENT_HIGH_WATER_SLOT  "high_water_slot"
+#define PERSISTENT_SPILL_LOG        "spill_log"
+#define PERSISTENT_SPILL_CURSOR     "spill_log_cursor"
+#define PERSISTENT_FIRMWARE_STAGE   "firmware.part"
+#define PERSISTENT_CONFIG_RECORD_0  "config.0"  //the config values above are packed into these
+#define PERSISTENT_CONFIG_RECORD_1  "config.1"  //two alternating copies of the config record
 
 //persistent storage default values
 #define DEFAULT_NODE_BASE_NAME      "iotsp-"
@@ -19,7 +19,7 @@ Pulse2::~Pulse2(void)
       this->unregister_pin(this->pin[i]);
 }
 
-bool Pulse2::register_pin(uint8_t pin, uint8_t direction)
+bool Pulse2::register_pin(uint8_t pin, uint8_t direction, bool accumulate)
 {
   bool retval = true;
   int slot = 0;
@@ -43,7 +43,9 @@ bool Pulse2::register_pin(uint8_t pin, uint8_t direction)
     return false;
 
   this->direction[slot] = direction;
+  this->accumulate[slot] = accumulate;
   this->pin_start_micros[slot] = 0;
+  this->pin_occupancy[slot] = 0;
   this->pin_result_count[slot] = 0;
   this->pin_result_slot[slot] = 0;
   memset((void*)(this->pin_result[slot]), 0, sizeof(this->pin_result[slot]));
@@ -67,7 +69,7 @@ void Pulse2::unregister_pin(uint8_t pin)
 
   detachInterrupt(digitalPinToInterrupt(pin));
 
-  for(int slot=0; slot<PULSE2_MAX_PINS; slot++)
+  for(slot=0; slot<PULSE2_MAX_PINS; slot++)
     if (this->pin[slot] == pin)
       break;
 
@@ -119,6 +121,7 @@ void Pulse2::reset(void)
   memset((void*)(this->pin_result_count), 0, sizeof(this->pin_result_count));
   memset((void*)(this->pin_result_slot), 0, sizeof(this->pin_result_slot));
   memset((void*)(this->pin_result), 0, sizeof(this->pin_result));
+  memset((void*)(this->pin_occupancy), 0, sizeof(this->pin_occupancy));
   this->overflow_count = 0;
   this->missed_count = 0;
 
@@ -149,6 +152,9 @@ void ICACHE_RAM_ATTR Pulse2::handle_interrupt(int slot, uint8_t pin, int mode)
 
   if (0 == this->pin_start_micros[slot]) {
     this->pin_start_micros[slot] = result;
+  } else if (this->accumulate[slot]) {
+    this->pin_occupancy[slot] += result;
+    this->pin_start_micros[slot] = 0;
   } else {
     this->pin_result[slot][this->pin_result_slot[slot]] = result;
     this->pin_result_count[slot]++;
@@ -173,6 +179,29 @@ void ICACHE_RAM_ATTR Pulse2::handle_interrupt(int slot, uint8_t pin, int mode)
     this->handle_interrupt(slot, pin, newmode);
 }
 
+unsigned long Pulse2::take_occupancy(uint8_t pin)
+{
+  unsigned long result = 0;
+
+  ETS_GPIO_INTR_DISABLE();
+  for (int slot=0; slot<PULSE2_MAX_PINS; slot++) {
+    if (this->pin[slot] == pin) {
+      result = this->pin_occupancy[slot];
+      this->pin_occupancy[slot] = 0;
+      // count the pulse in progress up to now, the rest goes to the next call
+      if (0 != this->pin_start_micros[slot]) {
+        unsigned long now = micros();
+        result += now - this->pin_start_micros[slot];
+        this->pin_start_micros[slot] = now;
+      }
+      break;
+    }
+  }
+  ETS_GPIO_INTR_ENABLE();
+
+  return result;
+}
+
 uint8_t Pulse2::check_result(unsigned long *result)
 {
   ETS_GPIO_INTR_DISABLE();
@@ -22,8 +22,10 @@ public:
   ~Pulse2(void);
 
   //add or overwrite a watch for pin to pulse in direction
+  //with accumulate set, the pulse lengths are summed up for take_occupancy
+  //instead of being queued for watch
   //returns false if PULSE2_MAX_PINS have already been registered
-  bool register_pin(uint8_t pin, uint8_t direction);
+  bool register_pin(uint8_t pin, uint8_t direction, bool accumulate=false);
   void unregister_pin(uint8_t pin);
 
   //block (with timeout) until one of the pins is triggered
@@ -31,6 +33,11 @@ public:
   //returns PULSE2_NO_PIN on timeout
   uint8_t watch(unsigned long *result, unsigned long timeout=1000000L);
 
+  //returns the total length (in us) of the pulses on an accumulating pin
+  //since it was registered or since the last call, and restarts the sum
+  //a pulse in progress is split between this and the next call
+  unsigned long take_occupancy(uint8_t pin);
+
   //reset the state machines and throw out any existing results
   //does not unregister any pins
   void reset(void);
@@ -41,11 +48,13 @@ private:
   volatile int pin_result_count[PULSE2_MAX_PINS];
   volatile int pin_result_slot[PULSE2_MAX_PINS];
   volatile unsigned long pin_result[PULSE2_MAX_PINS][PULSE2_WATCH_DEPTH];
+  volatile unsigned long pin_occupancy[PULSE2_MAX_PINS];
   volatile unsigned long overflow_count;
   volatile unsigned long missed_count;
 
   uint8_t pin[PULSE2_MAX_PINS];
   uint8_t direction[PULSE2_MAX_PINS];
+  bool accumulate[PULSE2_MAX_PINS];
 
   //helper called by interrupt closure -
   //arduino interrupts must be void (*)(void)
@@ -2,18 +2,35 @@
 
 #include <Arduino.h>
 #include <Esp.h>
+#include <IPAddress.h>
 
 #include "connectivity.h"
 #include "persistent.h"
 #include "rtc_mem.h"
+#include "spill_log.h"
 
 
 /* Global Data Structures */
 uint32_t rtc_mem[RTC_MEM_MAX];
+static frame_state_t pending_frame; // readings collected during this wake
+static uint8_t pending_present = 0; // bitmap of the readings in pending_frame
+static uint32_t rtc_shadow[RTC_MEM_MAX]; // contents of RTC User Memory as of the last load/save
+static uint32_t rtc_stale[(RTC_MEM_MAX+31)/32]; // bitmap of words that were not loaded from RTC User Memory
 
 
 /* Function Prototypes */
-static void refactor_timebase(void);
+static void load_rtc_words(unsigned first, unsigned last);
+static bool rtc_word_dirty(unsigned i);
+static bool ring_word_used(unsigned word);
+static inline uint8_t ring_read(unsigned *offset);
+static inline uint8_t data_read(const uint8_t *data, unsigned size, unsigned *offset);
+static inline void ring_write(unsigned *offset, uint8_t val);
+static inline uint64_t zigzag_encode(int64_t val);
+static inline int64_t zigzag_decode(uint64_t val);
+static void write_bits(uint8_t *buf, unsigned *bit, uint64_t val, unsigned num_bits);
+static uint64_t read_bits(const uint8_t *data, unsigned size, unsigned *offset, unsigned *bit, unsigned num_bits);
+static unsigned decode_frame(const uint8_t *data, unsigned size, unsigned offset, uint8_t *present, frame_state_t *state);
+static void drop_frame(void);
 
 
 /* Functions */
@@ -21,38 +38,30 @@ static void refactor_timebase(void);
 // increments the boot count and returns true if the RTC memory was OK
 bool load_rtc_memory(void)
 {
-  sleep_params_t *sleep_params = (sleep_params_t*) &rtc_mem[RTC_MEM_SLEEP_PARAMS];
   boot_count_t *boot_count = (boot_count_t*) &rtc_mem[RTC_MEM_BOOT_COUNT];
   bool retval = true;
 
-  ESP.rtcUserMemoryRead(0, rtc_mem, sizeof(rtc_mem));
+  // only the header is read here, the occupied part of the ring buffer follows
+  memset(rtc_stale, 0xff, sizeof(rtc_stale));
+  load_rtc_words(0, RTC_MEM_DATA-1);
   if (rtc_mem[RTC_MEM_CHECK] + rtc_mem[RTC_MEM_BOOT_COUNT] != preinit_magic) {
-    float tempf;
-    int temp;
     Serial.println(String("Preinit magic doesn't compute, reinitializing (0x") + String(preinit_magic, HEX) + ")");
     invalidate_rtc();
+    load_rtc_config();
     retval = false;
-
-    tempf = persistent_read(PERSISTENT_TEMP_CALIB, DEFAULT_TEMP_CALIB);
-    rtc_mem[RTC_MEM_TEMP_CAL] = *((uint32_t*)&tempf);
-    tempf = persistent_read(PERSISTENT_HUMIDITY_CALIB, DEFAULT_HUMIDITY_CALIB);
-    rtc_mem[RTC_MEM_HUMIDITY_CAL] = *((uint32_t*)&tempf);
-    tempf = persistent_read(PERSISTENT_BATTERY_CALIB, DEFAULT_BATTERY_CALIB);
-    rtc_mem[RTC_MEM_BATTERY_CAL] = *((uint32_t*)&tempf);
-
-    temp = persistent_read(PERSISTENT_HIGH_WATER_SLOT, DEFAULT_HIGH_WATER_SLOT);
-    if (temp <= 0)
-      temp = 1;
-    if (temp > NUM_STORAGE_SLOTS)
-      temp = NUM_STORAGE_SLOTS;
-    sleep_params->high_water_slot = temp;
-
-    temp = persistent_read(PERSISTENT_SLEEP_TIME_MS, (int)DEFAULT_SLEEP_TIME_MS);
-    if (temp < 200)
-      temp = 200;
-    if (temp > MAX_ESP_SLEEP_TIME_MS)
-      temp = MAX_ESP_SLEEP_TIME_MS;
-    sleep_params->sleep_time_ms = temp;
+  } else if (rtc_mem[RTC_MEM_NUM_BYTES] > RTC_DATA_SIZE - sizeof(uint32_t)) {
+    load_rtc_words(RTC_MEM_DATA, RTC_MEM_DATA_END);
+  } else if (rtc_mem[RTC_MEM_NUM_BYTES] > 0) {
+    unsigned first = rtc_mem[RTC_MEM_FIRST_BYTE] / sizeof(uint32_t);
+    unsigned last = (rtc_mem[RTC_MEM_FIRST_BYTE] + rtc_mem[RTC_MEM_NUM_BYTES] - 1) / sizeof(uint32_t);
+
+    // read the words holding frames, which may wrap around the end of the ring buffer
+    if (last < NUM_STORAGE_WORDS) {
+      load_rtc_words(RTC_MEM_DATA + first, RTC_MEM_DATA + last);
+    } else {
+      load_rtc_words(RTC_MEM_DATA + first, RTC_MEM_DATA_END);
+      load_rtc_words(RTC_MEM_DATA, RTC_MEM_DATA + last - NUM_STORAGE_WORDS);
+    }
   }
   boot_count->boot_count++;
 
@@ -74,11 +83,12 @@ bool load_rtc_memory(void)
   }
 #endif
 
-  Serial.print(", num readings=");
-  Serial.println(rtc_mem[RTC_MEM_NUM_READINGS]);
+  Serial.print(", num frames=");
+  Serial.println(rtc_mem[RTC_MEM_NUM_FRAMES]);
 
 #if EXTRA_DEBUG
   {
+    sleep_params_t *sleep_params = (sleep_params_t*) &rtc_mem[RTC_MEM_SLEEP_PARAMS];
     float* rtc_float_ptr;
     Serial.printf("[%llu] ", uptime());
     Serial.print("RTC_SIZE=");
@@ -89,6 +99,9 @@ bool load_rtc_memory(void)
     Serial.print(", humidity cal=");
     rtc_float_ptr = (float*)&rtc_mem[RTC_MEM_HUMIDITY_CAL];
     Serial.print(*rtc_float_ptr);
+    Serial.print(", pressure cal=");
+    rtc_float_ptr = (float*)&rtc_mem[RTC_MEM_PRESSURE_CAL];
+    Serial.print(*rtc_float_ptr);
     Serial.print(", battery cal=");
     rtc_float_ptr = (float*)&rtc_mem[RTC_MEM_BATTERY_CAL];
     Serial.print(*rtc_float_ptr);
@@ -107,20 +120,81 @@ bool load_rtc_memory(void)
   return retval;
 }
 
+// copy the config values that are used on every wake from persistent storage
+// into rtc memory, so that a normal wake doesn't have to initialize SPIFFS
+// this is done after a power loss and whenever the config is changed
+void load_rtc_config(void)
+{
+  const persistent_config_t *config = persistent_config();
+  sleep_params_t *sleep_params = (sleep_params_t*) &rtc_mem[RTC_MEM_SLEEP_PARAMS];
+  report_host_t *report_host = (report_host_t*) &rtc_mem[RTC_MEM_REPORT_HOST];
+  uint32_t hash = 2166136261UL;
+  IPAddress ip;
+  int temp;
+
+  rtc_mem[RTC_MEM_TEMP_CAL] = *((uint32_t*)&config->temp_calib);
+  rtc_mem[RTC_MEM_HUMIDITY_CAL] = *((uint32_t*)&config->humidity_calib);
+  rtc_mem[RTC_MEM_PRESSURE_CAL] = *((uint32_t*)&config->pressure_calib);
+  rtc_mem[RTC_MEM_BATTERY_CAL] = *((uint32_t*)&config->battery_calib);
+
+  temp = config->high_water_slot;
+  if (temp <= 0)
+    temp = 1;
+  if (temp > RTC_MAX_FRAMES)
+    temp = RTC_MAX_FRAMES;
+  sleep_params->high_water_slot = temp;
+
+  temp = config->sleep_time_ms;
+  if (temp < 200)
+    temp = 200;
+  if (temp > MAX_ESP_SLEEP_TIME_MS)
+    temp = MAX_ESP_SLEEP_TIME_MS;
+  sleep_params->sleep_time_ms = temp;
+
+  // host names are resolved (and cached) by the next upload
+  report_host->ip = ip.fromString(config->report_host_name) ? (uint32_t)ip : 0;
+  report_host->port = config->report_host_port;
+  report_host->expiry = 0;
+
+  for (const char *c = config->node_name; *c; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619UL;
+  }
+  rtc_mem[RTC_MEM_NODE_HASH] = hash;
+
+  memset(&rtc_mem[RTC_MEM_NODE_NAME], 0, RTC_NODE_NAME_SIZE);
+  if (strlen(config->node_name) < RTC_NODE_NAME_SIZE)
+    strcpy((char*)&rtc_mem[RTC_MEM_NODE_NAME], config->node_name);
+}
+
 // clear/reinitialize rtc memory
 void invalidate_rtc(void)
 {
   flags_time_t *timestruct = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+  uint64_t timestamp;
   uint16_t clock_cal;
 
   memset(rtc_mem, 0, sizeof(rtc_mem));
   ESP.rtcUserMemoryWrite(0, rtc_mem, sizeof(rtc_mem));
+  memset(rtc_shadow, 0, sizeof(rtc_shadow));
+  memset(rtc_stale, 0, sizeof(rtc_stale));
 
-  clock_cal = persistent_read(PERSISTENT_CLOCK_CALIB, DEFAULT_SLEEP_CLOCK_ADJ);
+  clock_cal = persistent_config()->clock_calib;
   if (clock_cal > 0)
     timestruct->clock_cal = clock_cal;
   else
     timestruct->clock_cal = DEFAULT_SLEEP_CLOCK_ADJ;
+
+  // the spill log survives losing RTC memory, so continue the uptime from its
+  // newest reading to keep the time offsets of the spilled readings positive
+  if (spill_log_last_timestamp(&timestamp)) {
+    timestruct->millis = timestamp;
+    timestruct->flags |= FLAG_BIT_SPILL_LOG;
+  }
+
+  // as does a staged firmware download, which is removed if it isn't offered anymore
+  if (persistent_size(PERSISTENT_FIRMWARE_STAGE) > 0)
+    timestruct->flags |= FLAG_BIT_FIRMWARE_STAGE;
 }
 
 // return the uptime in ms (added to the RTC stored time)
@@ -136,10 +210,14 @@ uint64_t uptime(void)
 }
 
 // helper for saving rtc memory
+// only the runs of words that changed since the last load/save are written
 void save_rtc(uint64_t sleep_time_us)
 {
   flags_time_t *timestruct = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
   uint64_t backup_millis = timestruct->millis; //store the current uptime value in case we aren't sleeping
+  unsigned run_end = 0;
+  unsigned num_written = 0;
+  bool in_run = false;
 
   // update the stored millis including some overhead for the write, suspend, and wake
   timestruct->millis += millis() + sleep_time_us/1000 + timestruct->clock_cal;
@@ -147,8 +225,32 @@ void save_rtc(uint64_t sleep_time_us)
   // update the header checksum
   rtc_mem[RTC_MEM_CHECK] = preinit_magic - rtc_mem[RTC_MEM_BOOT_COUNT];
 
-  // store the array to RTC memory
-  ESP.rtcUserMemoryWrite(0, rtc_mem, sizeof(rtc_mem));
+  // store the dirty words to RTC memory
+  // scan downwards so that the header check in word 0 is written last
+  for (int i=RTC_MEM_MAX-1; i >= -1; i--) {
+    bool dirty = (i >= 0) && rtc_word_dirty(i);
+
+    if (dirty && !in_run) {
+      run_end = i;
+      in_run = true;
+    } else if (!dirty && in_run) {
+      // merge runs separated by a single clean word to save a call
+      if ((i > 0) && rtc_word_dirty(i-1))
+        continue;
+
+      ESP.rtcUserMemoryWrite(i+1, &rtc_mem[i+1], (run_end - i)*sizeof(uint32_t));
+      for (unsigned j=i+1; j <= run_end; j++) {
+        rtc_shadow[j] = rtc_mem[j];
+        rtc_stale[j/32] &= ~(1UL << (j%32));
+      }
+      num_written += run_end - i;
+      in_run = false;
+    }
+  }
+
+#if EXTRA_DEBUG
+  Serial.printf("[%llu] saved %u/%u RTC words\n", uptime(), num_written, (unsigned)RTC_MEM_MAX);
+#endif
 
   // restore the old uptime in case we aren't sleeping (millis won't be reset in that case)
   timestruct->millis = backup_millis;
@@ -174,57 +276,200 @@ void deep_sleep(uint64_t time_us)
 #endif
 }
 
-// store sensor reading in the rtc mem ring buffer
+// store sensor reading in the pending wake frame
+// the frame is encoded into the rtc mem ring buffer by store_timestamp
 void store_reading(sensor_type_t type, int32_t val)
 {
-  sensor_reading_t *reading;
-  int slot;
-
-  // determine the next free slot in the RTC memory ring buffer
-  slot = rtc_mem[RTC_MEM_FIRST_READING] + rtc_mem[RTC_MEM_NUM_READINGS];
-  if (slot >= NUM_STORAGE_SLOTS)
-    slot -= NUM_STORAGE_SLOTS;
-
-  // update the ring buffer metadata
-  if (rtc_mem[RTC_MEM_NUM_READINGS] == NUM_STORAGE_SLOTS) {
-    rtc_mem[RTC_MEM_FIRST_READING]++;
-    if (rtc_mem[RTC_MEM_FIRST_READING] >= NUM_STORAGE_SLOTS)
-      rtc_mem[RTC_MEM_FIRST_READING]=0;
-    refactor_timebase();
+  if ((type >= SENSOR_TEMPERATURE) && (type < SENSOR_TIMESTAMP_OFFS)) {
+    pending_frame.values[type - SENSOR_TEMPERATURE] = val;
+    pending_present |= (1 << (type - SENSOR_TEMPERATURE));
+  }
+}
+
+// encode the pending wake frame with the given timestamp into the rtc mem
+// ring buffer, evicting the oldest frames if there is not enough room
+void store_timestamp(uint64_t timestamp)
+{
+  frame_state_t *last = (frame_state_t*) &rtc_mem[RTC_MEM_FRAME_LAST];
+  uint8_t buf[RTC_FRAME_MAX_SIZE];
+  unsigned len;
+  unsigned offset;
+
+  pending_frame.timestamp = timestamp;
+  len = encode_frame(buf, last, &pending_frame, pending_present);
+  pending_present = 0;
+
+  // make room for the new frame
+  while (rtc_mem[RTC_MEM_NUM_BYTES] + len > RTC_DATA_SIZE)
+    drop_frame();
+
+  // copy the frame into the ring buffer
+  offset = rtc_mem[RTC_MEM_FIRST_BYTE] + rtc_mem[RTC_MEM_NUM_BYTES];
+  if (offset >= RTC_DATA_SIZE)
+    offset -= RTC_DATA_SIZE;
+  for (unsigned i=0; i < len; i++)
+    ring_write(&offset, buf[i]);
+
+  rtc_mem[RTC_MEM_NUM_BYTES] += len;
+  rtc_mem[RTC_MEM_NUM_FRAMES]++;
+}
+
+// encode the timestamp and the present values of frame into buf
+// (RTC_FRAME_MAX_SIZE bytes) relative to state, which is updated to match
+// returns the number of bytes used
+unsigned encode_frame(uint8_t *buf, frame_state_t *state, const frame_state_t *frame, uint8_t present)
+{
+  unsigned bit = 0;
+  int64_t interval;
+  uint64_t dod;
+
+  memset(buf, 0, RTC_FRAME_MAX_SIZE);
+
+  // the bitmap of values rarely changes, so only store it when it does
+  if (present == state->present) {
+    write_bits(buf, &bit, 0, 1);
   } else {
-    rtc_mem[RTC_MEM_NUM_READINGS]++;
+    write_bits(buf, &bit, 1, 1);
+    write_bits(buf, &bit, present, RTC_FRAME_NUM_VALUES);
+    state->present = present;
+  }
+
+  // delta-of-delta timestamp with a variable-length prefix
+  // the wake period is nearly constant, so this is mostly a single '0' bit
+  interval = (int64_t)(frame->timestamp - state->timestamp);
+  dod = zigzag_encode(interval - state->interval);
+  if (0 == dod) {
+    write_bits(buf, &bit, 0x0, 1);
+  } else if (dod < (1 << 7)) {
+    write_bits(buf, &bit, 0x2, 2);
+    write_bits(buf, &bit, dod, 7);
+  } else if (dod < (1 << 9)) {
+    write_bits(buf, &bit, 0x6, 3);
+    write_bits(buf, &bit, dod, 9);
+  } else if (dod < (1 << 12)) {
+    write_bits(buf, &bit, 0xe, 4);
+    write_bits(buf, &bit, dod, 12);
+  } else {
+    write_bits(buf, &bit, 0xf, 4);
+    write_bits(buf, &bit, dod, 48);
+  }
+  state->timestamp = frame->timestamp;
+  state->interval = (int32_t)interval;
+
+  // each value delta is stored as '0' if unchanged, '10' and the bits of the
+  // current window if it fits, or '11', a new window size and its bits
+  for (unsigned i=0; i < RTC_FRAME_NUM_VALUES; i++) {
+    uint32_t delta;
+    unsigned window;
+    unsigned num_bits;
+
+    if (0 == (present & (1 << i)))
+      continue;
+
+    delta = (uint32_t)frame->values[i] - (uint32_t)state->values[i];
+    delta = (uint32_t)zigzag_encode((int32_t)delta);
+    window = 2*(((state->widths >> (4*i)) & 0xf) + 1);
+    num_bits = 2;
+    while ((num_bits < 32) && (delta >> num_bits))
+      num_bits += 2;
+
+    if (0 == delta) {
+      write_bits(buf, &bit, 0x0, 1);
+    } else if ((num_bits <= window) && (num_bits + 4 >= window)) {
+      // reuse the window unless a smaller one would pay for its own header
+      write_bits(buf, &bit, 0x2, 2);
+      write_bits(buf, &bit, delta, window);
+    } else {
+      write_bits(buf, &bit, 0x3, 2);
+      write_bits(buf, &bit, num_bits/2 - 1, 4);
+      write_bits(buf, &bit, delta, num_bits);
+      state->widths = (state->widths & ~(0xfUL << (4*i))) | ((uint32_t)(num_bits/2 - 1) << (4*i));
+    }
+    state->values[i] = frame->values[i];
   }
 
-  // store the sensor reading in RTC memory at the given slot
-  reading = (sensor_reading_t*) &rtc_mem[RTC_MEM_DATA+slot*NUM_WORDS(sensor_reading_t)];
-  reading->type = type;
-  reading->value = val;
+  return (bit + 7)/8;
 }
 
 // reset the rtc mem ring buffer
-void clear_readings(unsigned int num /*defaults to NUM_STORAGE_SLOTS*/)
+void clear_readings(unsigned int num /*defaults to RTC_MAX_FRAMES*/)
 {
-  if (num >= rtc_mem[RTC_MEM_NUM_READINGS]) {
+  if (num >= rtc_mem[RTC_MEM_NUM_FRAMES]) {
+    frame_state_t *base = (frame_state_t*) &rtc_mem[RTC_MEM_FRAME_BASE];
+    frame_state_t *last = (frame_state_t*) &rtc_mem[RTC_MEM_FRAME_LAST];
+
     // simple case - just reset the ring buffer
-    rtc_mem[RTC_MEM_FIRST_READING]=0;
-    rtc_mem[RTC_MEM_NUM_READINGS]=0;
+    rtc_mem[RTC_MEM_FIRST_BYTE]=0;
+    rtc_mem[RTC_MEM_NUM_BYTES]=0;
+    rtc_mem[RTC_MEM_NUM_FRAMES]=0;
+    *base = *last;
   } else {
-    // increment first reading to "erase" num readings
-    rtc_mem[RTC_MEM_FIRST_READING] += num;
-    if (rtc_mem[RTC_MEM_FIRST_READING] >= NUM_STORAGE_SLOTS)
-      rtc_mem[RTC_MEM_FIRST_READING] -= NUM_STORAGE_SLOTS;
-
-    rtc_mem[RTC_MEM_NUM_READINGS] -= num;
+    // drop the oldest frames one at a time so the base state follows along
+    while (num--)
+      drop_frame();
   }
+}
+
+// return the number of unused bytes in the rtc mem ring buffer
+unsigned readings_free_space(void)
+{
+  return RTC_DATA_SIZE - rtc_mem[RTC_MEM_NUM_BYTES];
+}
+
+// copy the encoded frames (oldest first) out of the rtc mem ring buffer
+// base receives the state that the oldest frame is delta-encoded against
+// buf must hold RTC_DATA_SIZE bytes, returns the number of bytes copied
+unsigned export_readings(frame_state_t *base, uint8_t *buf)
+{
+  unsigned offset = rtc_mem[RTC_MEM_FIRST_BYTE];
+
+  *base = *(frame_state_t*) &rtc_mem[RTC_MEM_FRAME_BASE];
+  for (unsigned i=0; i < rtc_mem[RTC_MEM_NUM_BYTES]; i++)
+    buf[i] = ring_read(&offset);
+
+  return rtc_mem[RTC_MEM_NUM_BYTES];
+}
+
+// prepare to iterate through the rtc mem ring buffer starting with the oldest frame
+void rewind_frames(reading_frame_t *frame)
+{
+  frame_state_t *base = (frame_state_t*) &rtc_mem[RTC_MEM_FRAME_BASE];
+
+  rewind_frames(frame, base, (const uint8_t*) &rtc_mem[RTC_MEM_DATA], RTC_DATA_SIZE, rtc_mem[RTC_MEM_NUM_FRAMES]);
+  frame->offset = rtc_mem[RTC_MEM_FIRST_BYTE];
+}
+
+// prepare to iterate through num_frames frames encoded in data
+// (as copied by export_readings) starting with the oldest frame
+void rewind_frames(reading_frame_t *frame, const frame_state_t *base, const uint8_t *data, unsigned size, unsigned num_frames)
+{
+  frame->index = 0;
+  frame->offset = 0;
+  frame->num_frames = num_frames;
+  frame->data = data;
+  frame->size = size;
+  frame->state = *base;
+  frame->present = 0;
+}
 
-  refactor_timebase();
+// decode the next frame from the iterator's data
+// returns false when there are no more frames
+bool read_frame(reading_frame_t *frame)
+{
+  if (frame->index >= frame->num_frames)
+    return false;
+
+  frame->offset = decode_frame(frame->data, frame->size, frame->offset, &frame->present, &frame->state);
+  frame->index++;
+
+  return true;
 }
 
-// print the stored pressure readings from the rtc mem ring buffer
+// print the stored readings from the rtc mem ring buffer
 void dump_readings(void)
 {
 #if (EXTRA_DEBUG != 0)
-  flags_time_t timestamp = {0,0,0,0};
+  reading_frame_t frame;
   const char typestrings[8][12] = {
     "UNKNOWN",
     "TEMP (C)",
@@ -238,114 +483,215 @@ void dump_readings(void)
   char formatted[47];
   formatted[46]=0;
 
-  Serial.println("slot | type        |      rawvalue");
+  Serial.printf("[%llu] %u frames in %u bytes\n", uptime(), rtc_mem[RTC_MEM_NUM_FRAMES], rtc_mem[RTC_MEM_NUM_BYTES]);
+  Serial.println("frm  | type        |      rawvalue");
   Serial.println("-----+-------------+--------------");
 
+  rewind_frames(&frame);
+  while (read_frame(&frame)) {
+    unsigned i = frame.index - 1;
 
-  for (unsigned i=0; i < rtc_mem[RTC_MEM_NUM_READINGS]; i++) {
-    sensor_reading_t *reading;
-    const char* type = typestrings[0];
-    int slot;
+    for (unsigned j=0; j < RTC_FRAME_NUM_VALUES; j++) {
+      sensor_type_t type = (sensor_type_t)(SENSOR_TEMPERATURE + j);
+      int32_t value = frame.state.values[j];
 
-    // find the slot indexed into the ring buffer
-    slot = rtc_mem[RTC_MEM_FIRST_READING] + i;
-    if (slot >= NUM_STORAGE_SLOTS)
-      slot -= NUM_STORAGE_SLOTS;
+      if (0 == (frame.present & (1 << j)))
+        continue;
 
-    reading = (sensor_reading_t*) &rtc_mem[RTC_MEM_DATA+slot*NUM_WORDS(sensor_reading_t)];
+      // format an output row with the frame, type, and data
+      if ((type == SENSOR_PARTICLE_1_0)
+       || (type == SENSOR_PARTICLE_2_5))
+        snprintf(formatted, 45, "%4u | %-11s | %13llu", i, typestrings[type], ((uint64_t)value)*1000ULL);
+      else
+        snprintf(formatted, 45, "%4u | %-11s | %+13.3f", i, typestrings[type], value/1000.0);
+      Serial.println(formatted);
+    }
 
-    // determine the sensor type
-    switch(reading->type) {
-      case SENSOR_TEMPERATURE:
-        type=typestrings[1];
-      break;
+    snprintf(formatted, 45, "%4u | %-11s | %13llu", i, typestrings[SENSOR_TIMESTAMP_OFFS], frame.state.timestamp);
+    Serial.println(formatted);
+  }
+  Serial.printf("[%llu] dump complete\n", uptime());
+#endif
+}
 
-      case SENSOR_HUMIDITY:
-        type=typestrings[2];
-      break;
+// helper to read words first..last (inclusive) from RTC User Memory
+static void load_rtc_words(unsigned first, unsigned last)
+{
+  ESP.rtcUserMemoryRead(first, &rtc_mem[first], (last - first + 1)*sizeof(uint32_t));
+  for (unsigned i=first; i <= last; i++) {
+    rtc_shadow[i] = rtc_mem[i];
+    rtc_stale[i/32] &= ~(1UL << (i%32));
+  }
+}
 
-      case SENSOR_PRESSURE:
-        type=typestrings[3];
-      break;
+// helper to check whether word i has to be written to RTC User Memory
+// words that were never loaded must be written if they now hold frame data
+static bool rtc_word_dirty(unsigned i)
+{
+  if (rtc_mem[i] != rtc_shadow[i])
+    return true;
+  return (rtc_stale[i/32] & (1UL << (i%32))) && (i >= RTC_MEM_DATA) && ring_word_used(i - RTC_MEM_DATA);
+}
 
-      case SENSOR_PARTICLE_1_0:
-        type=typestrings[4];
-      break;
+// helper to check whether any byte of a word in the rtc mem ring buffer
+// is occupied by a frame
+static bool ring_word_used(unsigned word)
+{
+  for (unsigned i=0; i < sizeof(uint32_t); i++) {
+    unsigned offset = word*sizeof(uint32_t) + i;
+
+    // distance from the oldest frame, accounting for wrap-around
+    if (offset < rtc_mem[RTC_MEM_FIRST_BYTE])
+      offset += RTC_DATA_SIZE;
+    if (offset - rtc_mem[RTC_MEM_FIRST_BYTE] < rtc_mem[RTC_MEM_NUM_BYTES])
+      return true;
+  }
 
-      case SENSOR_PARTICLE_2_5:
-        type=typestrings[5];
-      break;
+  return false;
+}
 
-      case SENSOR_BATTERY_VOLTAGE:
-        type=typestrings[6];
-      break;
+// helper to advance a byte offset in the rtc mem ring buffer
+static inline unsigned ring_next(unsigned offset)
+{
+  offset++;
+  if (offset >= RTC_DATA_SIZE)
+    offset = 0;
+  return offset;
+}
 
-      case SENSOR_TIMESTAMP_OFFS:
-        type=typestrings[7];
-        timestamp.millis = (rtc_mem[RTC_MEM_DATA_TIMEBASE] << RTC_DATA_TIMEBASE_SHIFT) + (uint64_t)reading->value;
-      break;
+// helper to read a byte from the rtc mem ring buffer and advance the offset
+static inline uint8_t ring_read(unsigned *offset)
+{
+  return data_read((const uint8_t*) &rtc_mem[RTC_MEM_DATA], RTC_DATA_SIZE, offset);
+}
 
-      case SENSOR_UNKNOWN:
-      default:
-        type=typestrings[0];
-      break;
-    }
+// helper to read a byte from encoded frame data and advance the offset
+// the offset wraps around at size
+static inline uint8_t data_read(const uint8_t *data, unsigned size, unsigned *offset)
+{
+  uint8_t val = data[*offset];
+  (*offset)++;
+  if (*offset >= size)
+    *offset = 0;
+  return val;
+}
 
-    // format an output row with the slot, type, and data
-    if (reading->type == SENSOR_TIMESTAMP_OFFS)
-      snprintf(formatted, 45, "%4u | %-11s | %13llu", i, type, timestamp.millis);
-    else if ((reading->type == SENSOR_PARTICLE_1_0)
-          || (reading->type == SENSOR_PARTICLE_2_5))
-      snprintf(formatted, 45, "%4u | %-11s | %13llu", i, type, ((uint64_t)reading->value)*1000ULL);
-    else
-      snprintf(formatted, 45, "%4u | %-11s | %+13.3f", i, type, reading->value/1000.0);
-    Serial.println(formatted);
+// helper to write a byte to the rtc mem ring buffer and advance the offset
+static inline void ring_write(unsigned *offset, uint8_t val)
+{
+  ((uint8_t*)&rtc_mem[RTC_MEM_DATA])[*offset] = val;
+  *offset = ring_next(*offset);
+}
+
+// zig-zag encoding maps small negative deltas to small unsigned values
+static inline uint64_t zigzag_encode(int64_t val)
+{
+  return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t val)
+{
+  return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+// helper to append num_bits of val (msb first) to the bit-packed buf
+// buf must be zeroed beforehand
+static void write_bits(uint8_t *buf, unsigned *bit, uint64_t val, unsigned num_bits)
+{
+  while (num_bits--) {
+    if ((val >> num_bits) & 1)
+      buf[*bit/8] |= 0x80 >> (*bit%8);
+    (*bit)++;
   }
-  Serial.printf("[%llu] dump complete\n", uptime());
-#endif
 }
 
-// helper for resetting the time offset for all of the
-// SENSOR_TIMESTAMP_OFFS in the rtc mem ring buffer
-static void refactor_timebase(void)
+// helper to read num_bits (msb first) from encoded frame data
+// offset is the byte offset (wrapping around at size) and bit the position within that byte
+static uint64_t read_bits(const uint8_t *data, unsigned size, unsigned *offset, unsigned *bit, unsigned num_bits)
 {
-  uint64_t oldbase = rtc_mem[RTC_MEM_DATA_TIMEBASE] << RTC_DATA_TIMEBASE_SHIFT;
-  uint64_t newbase = 0;
-
-  // iterate through each reading in the rtc mem ring buffer
-  for (unsigned i=0; i < rtc_mem[RTC_MEM_NUM_READINGS]; i++) {
-    sensor_reading_t *reading;
-    int slot;
-
-    // find the slot indexed into the ring buffer
-    slot = rtc_mem[RTC_MEM_FIRST_READING] + i;
-    if (slot >= NUM_STORAGE_SLOTS)
-      slot -= NUM_STORAGE_SLOTS;
-
-    reading = (sensor_reading_t*) &rtc_mem[RTC_MEM_DATA+slot*NUM_WORDS(sensor_reading_t)];
-
-    // we only care about timestamp offsets
-    if (reading->type == SENSOR_TIMESTAMP_OFFS) {
-      uint64_t timestamp;
-      timestamp = oldbase + (uint64_t)reading->value;
-
-      // special case for the first timestamp offset we find:
-      // use it as the new base timestamp that all of the others will
-      // be an offset from
-      if (0 == newbase)
-        newbase = timestamp & RTC_DATA_TIMEBASE_MASK;
-
-      // cast the timestamp from the old base offset to the new one
-      reading->value = (int32_t)(timestamp - newbase);
+  uint64_t val = 0;
+
+  while (num_bits--) {
+    val = (val << 1) | ((data[*offset] >> (7 - *bit)) & 1);
+    if (++(*bit) == 8) {
+      *bit = 0;
+      data_read(data, size, offset);
     }
   }
 
-  // special case when no timestamp sensor readings were found:
-  // keep a relatively current value for future readings to use
-  // as their base offset
-  if (0 == newbase)
-    newbase = uptime() & RTC_DATA_TIMEBASE_MASK;
+  return val;
+}
+
+// helper to decode the frame at offset in encoded frame data
+// the deltas are applied to state
+// returns the offset of the following frame
+static unsigned decode_frame(const uint8_t *data, unsigned size, unsigned offset, uint8_t *present, frame_state_t *state)
+{
+  unsigned bit = 0;
+  int64_t interval;
+  uint64_t dod;
+
+  if (read_bits(data, size, &offset, &bit, 1))
+    state->present = read_bits(data, size, &offset, &bit, RTC_FRAME_NUM_VALUES);
+  *present = state->present;
+
+  // timestamp prefixes '0', '10', '110', '1110', '1111'
+  if (0 == read_bits(data, size, &offset, &bit, 1))
+    dod = 0;
+  else if (0 == read_bits(data, size, &offset, &bit, 1))
+    dod = read_bits(data, size, &offset, &bit, 7);
+  else if (0 == read_bits(data, size, &offset, &bit, 1))
+    dod = read_bits(data, size, &offset, &bit, 9);
+  else if (0 == read_bits(data, size, &offset, &bit, 1))
+    dod = read_bits(data, size, &offset, &bit, 12);
+  else
+    dod = read_bits(data, size, &offset, &bit, 48);
+  interval = state->interval + zigzag_decode(dod);
+  state->timestamp += interval;
+  state->interval = (int32_t)interval;
+
+  for (unsigned i=0; i < RTC_FRAME_NUM_VALUES; i++) {
+    uint32_t delta = 0;
+
+    if (0 == (*present & (1 << i)))
+      continue;
+
+    if (read_bits(data, size, &offset, &bit, 1)) {
+      if (read_bits(data, size, &offset, &bit, 1)) {
+        uint32_t width = read_bits(data, size, &offset, &bit, 4);
+        state->widths = (state->widths & ~(0xfUL << (4*i))) | (width << (4*i));
+      }
+      delta = read_bits(data, size, &offset, &bit, 2*(((state->widths >> (4*i)) & 0xf) + 1));
+      delta = (uint32_t)zigzag_decode(delta);
+    }
+    state->values[i] = (int32_t)((uint32_t)state->values[i] + delta);
+  }
+
+  // frames start on a byte boundary
+  if (bit)
+    data_read(data, size, &offset);
+
+  return offset;
+}
+
+// helper to remove the oldest frame from the rtc mem ring buffer
+// its deltas are folded into the base state so the next frame can
+// still be decoded, which keeps eviction constant-time
+static void drop_frame(void)
+{
+  frame_state_t *base = (frame_state_t*) &rtc_mem[RTC_MEM_FRAME_BASE];
+  unsigned offset = rtc_mem[RTC_MEM_FIRST_BYTE];
+  unsigned next;
+  uint8_t present;
+
+  if (0 == rtc_mem[RTC_MEM_NUM_FRAMES])
+    return;
+
+  next = decode_frame((const uint8_t*) &rtc_mem[RTC_MEM_DATA], RTC_DATA_SIZE, offset, &present, base);
 
-  // store the new timebase
-  rtc_mem[RTC_MEM_DATA_TIMEBASE] = (uint32_t)(newbase >> RTC_DATA_TIMEBASE_SHIFT);
+  rtc_mem[RTC_MEM_FIRST_BYTE] = next;
+  if (next < offset)
+    next += RTC_DATA_SIZE;
+  rtc_mem[RTC_MEM_NUM_BYTES] -= next - offset;
+  rtc_mem[RTC_MEM_NUM_FRAMES]--;
 }
@@ -2,12 +2,22 @@
 #define _RTC_MEM_H_
 
 #include "project_config.h"
+#include "hp303b.h"
 #include "sensors.h"
 
 
 /* Global Configurations */
-#define RTC_DATA_TIMEBASE_SHIFT (8)
-#define RTC_DATA_TIMEBASE_MASK  (-1LL<<RTC_DATA_TIMEBASE_SHIFT)
+// number of sensor types that can be stored in a frame (excludes SENSOR_UNKNOWN and SENSOR_TIMESTAMP_OFFS)
+#define RTC_FRAME_NUM_VALUES    (SENSOR_TIMESTAMP_OFFS - SENSOR_TEMPERATURE)
+// encoded frame size in bytes: present bitmap (1 + 6 bits) + timestamp (4 + 48 bits)
+// + up to 2 + 4 + 32 bits per value, padded to a whole byte
+#define RTC_FRAME_MIN_SIZE      (1)
+#define RTC_FRAME_MAX_SIZE      (((1 + RTC_FRAME_NUM_VALUES) + (4 + 48) + RTC_FRAME_NUM_VALUES*(2 + 4 + 32) + 7)/8)
+#define RTC_DATA_SIZE           (NUM_STORAGE_WORDS*sizeof(uint32_t))
+#define RTC_MAX_FRAMES          (RTC_DATA_SIZE/RTC_FRAME_MIN_SIZE)
+// bytes of the node name copy, names that don't fit (with the terminator) are read
+// from the persistent config, the default names always fit
+#define RTC_NODE_NAME_SIZE      (16)
 
 
 /* Types and Enums */
@@ -17,22 +27,70 @@
 
 // Structure to combine uptime with device flags
 typedef struct flags_time_s {
-  uint64_t flags      :5;
+  uint64_t flags      :6;
   uint64_t fail_count :3;  //keep track of wifi connection failures
   uint64_t clock_cal  :16; //calibration for clock drift during suspend in ms
-  uint64_t millis     :40; //uptime in ms tracked over suspend cycles
+  uint64_t millis     :39; //uptime in ms tracked over suspend cycles (~17 years)
 } flags_time_t;
 
 // Flag bits
 #define FLAG_BIT_CONNECT_NEXT_WAKE  (1 << 0)
 #define FLAG_BIT_NORMAL_UPLOAD_COND (1 << 1)
 #define FLAG_BIT_LOW_BATTERY        (1 << 2)
-
-// Structure to combine sensor readings with type and timestamp
-typedef struct sensor_reading_s {
-  sensor_type_t type  :8;
-  int32_t       value :24;
-} sensor_reading_t;
+#define FLAG_BIT_REPORT_V3          (1 << 3)  //the report server accepts the binary v3 protocol
+#define FLAG_BIT_SPILL_LOG          (1 << 4)  //the spill log in SPIFFS may hold frames
+#define FLAG_BIT_FIRMWARE_STAGE     (1 << 5)  //a firmware download may be staged in SPIFFS
+
+// Structure caching the parameters of the last WiFi association so that the
+// next one can skip the scan and DHCP (channel 0 means the cache is empty)
+typedef struct wifi_cache_s {
+  uint8_t  bssid[6];
+  uint8_t  channel;
+  uint8_t  num_uses;  //fast connects since the DHCP lease was last renewed
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} wifi_cache_t;
+
+// Structure holding the timestamp and sensor values of a single wake frame
+// Each frame in RTC_MEM_DATA is a bit-packed (msb first) record, padded to a
+// whole byte, of the bitmap of values present (only when it changed), the
+// delta-of-delta of the timestamp, and for each present value the delta from
+// the previous value of its type inside a Gorilla-style bit-width window.
+// The encoder state (interval, present, widths) is part of the frame state so
+// that the oldest frame can be dropped by folding it into the base state.
+typedef struct frame_state_s {
+  uint64_t timestamp;                          // uptime in ms when the frame was stored
+  int32_t  values[RTC_FRAME_NUM_VALUES];       // indexed by (sensor_type_t - SENSOR_TEMPERATURE)
+  int32_t  interval;                           // ms since the frame before, for delta-of-delta timestamps
+  uint32_t present :RTC_FRAME_NUM_VALUES;      // bitmap of the values in the frame
+  uint32_t widths  :(4*RTC_FRAME_NUM_VALUES);  // delta window of each value, 4 bits each ((bits/2)-1)
+} frame_state_t;
+
+// Structure for decoding wake frames from the RTC mem ring buffer
+// (or from a copy of it, see export_readings)
+typedef struct reading_frame_s {
+  frame_state_t  state;      // absolute timestamp and sensor values
+  uint8_t        present;    // bitmap of valid values (1 << (sensor_type_t - SENSOR_TEMPERATURE))
+  unsigned       index;      // iterator state for read_frame()
+  unsigned       offset;     // iterator state for read_frame()
+  unsigned       num_frames; // number of frames in data
+  const uint8_t *data;       // encoded frames
+  unsigned       size;       // size of data, offsets wrap around at this size
+} reading_frame_t;
+
+// Structure caching the address of the report server, so that an upload
+// doesn't have to read the config from SPIFFS or resolve the host name
+// An IP address from the config never expires (expiry is 0), a resolved host
+// name is valid until the uptime reaches expiry.
+typedef struct report_host_s {
+  uint32_t ip;          //0 if the host name has to be resolved
+  uint16_t port;
+  uint8_t  dns_hits;    //uploads that used the cached address since the last report
+  uint8_t  dns_misses;  //uploads that resolved the host name since the last report
+  uint32_t expiry;      //uptime in s when the resolved address expires
+} report_host_t;
 
 // Structure to combine custom sleep time and high-water slot configurations
 typedef struct sleep_params_s {
@@ -46,23 +104,59 @@ typedef struct boot_count_s {
   uint32_t boot_count                :24;
 } boot_count_t;
 
+// Structure recording which devices answered on the I2C bus, so that absent
+// ones are not accessed on every wake (bitmaps of 1 << i2c_device_t)
+typedef struct i2c_census_s {
+  uint32_t known   :8;   //devices whose presence was determined
+  uint32_t present :8;   //devices that answered
+  uint32_t wakes   :16;  //wakes since the absent devices were last probed
+} i2c_census_t;
+
+// Structure holding the SHT30 repeatability of the next wake and the counters
+// of the samples taken since the last report (they saturate)
+typedef struct sht30_stats_s {
+  uint32_t rpt_low    :7;  //samples at each repeatability
+  uint32_t rpt_med    :7;
+  uint32_t rpt_high   :7;
+  uint32_t crc_errors :7;  //samples that were discarded for a bad checksum
+  uint32_t rpt_step   :2;  //repeatability of the next wake, steps below SHT30_RPT_HIGH
+  uint32_t reserved   :2;
+} sht30_stats_t;
+
 // Fields for each of the 32-bit fields in RTC Memory
 enum rtc_mem_fields_e {
   RTC_MEM_CHECK = 0,       // Magic/Header CRC
   RTC_MEM_BOOT_COUNT,      // Number of accumulated wakeups since last power loss (boot_count_t)
   RTC_MEM_FLAGS_TIME,      // Timestamp for start of boot, this is 64-bits so it needs 2 fields (flags_time_t)
   RTC_MEM_FLAGS_TIME_END = RTC_MEM_FLAGS_TIME + NUM_WORDS(flags_time_t) - 1,
-  RTC_MEM_DATA_TIMEBASE,   // Timestamp (upper 32 bits) from which sensor readings are stored as offsets
-  RTC_MEM_NUM_READINGS,    // Number of occupied slots
-  RTC_MEM_FIRST_READING,   // Slot that has the oldest reading
+  RTC_MEM_WIFI_CACHE,      // BSSID, channel, and DHCP lease of the last WiFi association (wifi_cache_t)
+  RTC_MEM_WIFI_CACHE_END = RTC_MEM_WIFI_CACHE + NUM_WORDS(wifi_cache_t) - 1,
+  RTC_MEM_FRAME_BASE,      // State that the oldest frame is delta-encoded against, 64-bit aligned (frame_state_t)
+  RTC_MEM_FRAME_BASE_END = RTC_MEM_FRAME_BASE + NUM_WORDS(frame_state_t) - 1,
+  RTC_MEM_FRAME_LAST,      // State of the newest frame, for delta-encoding the next one (frame_state_t)
+  RTC_MEM_FRAME_LAST_END = RTC_MEM_FRAME_LAST + NUM_WORDS(frame_state_t) - 1,
+  RTC_MEM_NUM_FRAMES,      // Number of wake frames stored in the ring buffer
+  RTC_MEM_FIRST_BYTE,      // Byte offset of the oldest frame
+  RTC_MEM_NUM_BYTES,       // Number of occupied bytes
   RTC_MEM_TEMP_CAL,        // Store the temperature calibration so we don't have to initialize SPIFFs every time (float)
   RTC_MEM_HUMIDITY_CAL,    // Store the humidity calibration so we don't have to initialize SPIFFs every time (float)
   RTC_MEM_BATTERY_CAL,     // Store the battery calibration so we don't have to initialize SPIFFs every time (float)
   RTC_MEM_SLEEP_PARAMS,    // Store the user's sleep params so we don't have to initialize SPIFFs every time (sleep_params_t)
-
-  //array of sensor readings
+  RTC_MEM_PRESSURE_CAL,    // Store the pressure calibration so we don't have to initialize SPIFFs every time (float)
+  RTC_MEM_REPORT_HOST,     // Store the report server address so we don't have to initialize SPIFFs every time (report_host_t)
+  RTC_MEM_REPORT_HOST_END = RTC_MEM_REPORT_HOST + NUM_WORDS(report_host_t) - 1,
+  RTC_MEM_NODE_HASH,       // FNV-1a hash of the node name, which identifies the node in binary messages
+  RTC_MEM_NODE_NAME,       // Node name for json messages, empty if it is too long for RTC_NODE_NAME_SIZE (char[])
+  RTC_MEM_NODE_NAME_END = RTC_MEM_NODE_NAME + RTC_NODE_NAME_SIZE/sizeof(uint32_t) - 1,
+  RTC_MEM_EPD_FRAME,       // FNV-1a hash of the frame on the EPD_1in9 display, 0 if unknown
+  RTC_MEM_HP303B_CAL,      // HP303B calibration coefficients and configuration, invalid after power loss (hp303b_cal_t)
+  RTC_MEM_HP303B_CAL_END = RTC_MEM_HP303B_CAL + NUM_WORDS(hp303b_cal_t) - 1,
+  RTC_MEM_I2C_CENSUS,      // Devices found on the I2C bus since the last power loss (i2c_census_t)
+  RTC_MEM_SHT30_STATS,     // SHT30 repeatability and sample counters (sht30_stats_t)
+
+  //byte ring buffer of encoded wake frames
   RTC_MEM_DATA,
-  RTC_MEM_DATA_END = RTC_MEM_DATA + NUM_STORAGE_SLOTS*NUM_WORDS(sensor_reading_t) - 1,
+  RTC_MEM_DATA_END = RTC_MEM_DATA + NUM_STORAGE_WORDS - 1,
 
   //keep last
   RTC_MEM_MAX
@@ -75,6 +169,7 @@ extern const uint32_t preinit_magic; //keep this in the .ino so it gets recompil
 
 /* Function Prototypes */
 bool load_rtc_memory(void);
+void load_rtc_config(void);
 void invalidate_rtc(void);
 
 uint64_t uptime(void);
@@ -82,7 +177,14 @@ void save_rtc(uint64_t sleep_time_us=0);
 void deep_sleep(uint64_t time_us);
 
 void store_reading(sensor_type_t type, int32_t val);
-void clear_readings(unsigned int num=NUM_STORAGE_SLOTS);
+void store_timestamp(uint64_t timestamp);
+void clear_readings(unsigned int num=RTC_MAX_FRAMES);
+unsigned readings_free_space(void);
+unsigned export_readings(frame_state_t *base, uint8_t *buf);
+unsigned encode_frame(uint8_t *buf, frame_state_t *state, const frame_state_t *frame, uint8_t present);
+void rewind_frames(reading_frame_t *frame);
+void rewind_frames(reading_frame_t *frame, const frame_state_t *base, const uint8_t *data, unsigned size, unsigned num_frames);
+bool read_frame(reading_frame_t *frame);
 void dump_readings(void);
 
 #endif /* _RTC_MEM_H_ */
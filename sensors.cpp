@@ -2,9 +2,9 @@
 
 #include <Arduino.h>
 #include <Esp.h>
-#include <LOLIN_HP303B.h>
 #include <Wire.h>
 
+#include "hp303b.h"
 #include "pulse2.h"
 #include "rtc_mem.h"
 #include "sensors.h"
@@ -12,7 +12,6 @@
 
 
 /* Global Data Structures */
-LOLIN_HP303B HP303BPressureSensor;
 #if TETHERED_MODE
 Pulse2 pulse;
 #endif
@@ -20,104 +19,231 @@ static float gTemperature=NAN;
 static float gHumidity=NAN;
 static float gBattery=NAN;
 
+// addresses probed by sensors_init, 0 for devices that are probed by their
+// driver (the EPD only answers after a reset sequence)
+static const uint8_t i2c_addrs[I2C_NUM_DEVICES] = {
+  SHT30_ADDR,
+  HP303B_ADDR,
+  0,
+};
+
+// devices that support I2C_FAST_CLOCK
+static const uint8_t i2c_fast_devices = (1 << I2C_DEV_SHT30) | (1 << I2C_DEV_HP303B)
+#if EPD_I2C_FAST_MODE
+  | (1 << I2C_DEV_EPD)
+#endif
+  ;
+
 /* Functions */
 // setup sensors
+// must be called after the RTC memory is loaded
 void sensors_init(void)
 {
+  i2c_census_t *census = (i2c_census_t*) &rtc_mem[RTC_MEM_I2C_CENSUS];
+  uint8_t maybe_present;
+
   Wire.begin();
 
+  // give the devices that didn't answer another chance once in a while
+  if (++census->wakes >= I2C_CENSUS_REPROBE_WAKES) {
+    census->known &= census->present;
+    census->wakes = 0;
+  }
+
+  // probe the devices that are unknown since the last power loss or failure
+  for (int i=0; i<I2C_NUM_DEVICES; i++) {
+    if ((0 == i2c_addrs[i]) || (census->known & (1 << i)))
+      continue;
+    Wire.beginTransmission(i2c_addrs[i]);
+    i2c_device_result((i2c_device_t)i, 0 == Wire.endTransmission());
+  }
+
+  maybe_present = census->present | ~census->known;
+  if (0 == (maybe_present & ~i2c_fast_devices & ((1 << I2C_NUM_DEVICES) - 1)))
+    Wire.setClock(I2C_FAST_CLOCK);
+
+#if EXTRA_DEBUG
+  Serial.printf("I2C devices known: 0x%02x present: 0x%02x\n", census->known, census->present);
+#endif
+
 #if TETHERED_MODE
   pinMode(PPD42_PIN_DET, INPUT_PULLUP);
 #endif
 }
 
+// return false if the device didn't answer the last time it was accessed,
+// so that it isn't accessed again until it is probed on a later wake
+bool i2c_device_present(i2c_device_t dev)
+{
+  i2c_census_t *census = (i2c_census_t*) &rtc_mem[RTC_MEM_I2C_CENSUS];
+
+  return (census->present & (1 << dev)) || !(census->known & (1 << dev));
+}
+
+// record the outcome of accessing a device
+// a failure of a device that was present makes it unknown, so it is probed again
+void i2c_device_result(i2c_device_t dev, bool ok)
+{
+  i2c_census_t *census = (i2c_census_t*) &rtc_mem[RTC_MEM_I2C_CENSUS];
+
+  if (ok) {
+    census->known |= (1 << dev);
+    census->present |= (1 << dev);
+  } else if (census->present & (1 << dev)) {
+    census->known &= ~(1 << dev);
+    census->present &= ~(1 << dev);
+  } else {
+    census->known |= (1 << dev);
+  }
+}
+
 #if TETHERED_MODE
 // read and store values from the PPD42 particle sensor
-// this measurement is recommended to take 30 seconds (parameter)
+// the low pulse occupancy of the LPO pins is summed up by the Pulse2
+// interrupts from the first call on, each call stores the readings of the time
+// since the previous one, which is recommended to be at least 30 seconds
+// (parameter), shorter windows are left to accumulate until the next call
 // also the sensor requires a 3 minute warm-up time
 // so only available in tethered mode
 void read_ppd42(unsigned long sampletime_us)
 {
-  if (!digitalRead(PPD42_PIN_DET)) {
-    unsigned long starttime_us = micros();
-    unsigned long lpo10 = 0;
-    unsigned long lpo25 = 0;
-    unsigned long total;
+  static bool sampling = false;
+  static unsigned long starttime_ms;
+
+  if (digitalRead(PPD42_PIN_DET)) {
+    // the sensor was removed, free the pins that it shares with the EPD
+    if (sampling) {
+      pulse.unregister_pin(PPD42_PIN_1_0);
+      pulse.unregister_pin(PPD42_PIN_2_5);
+      sampling = false;
+    }
+    return;
+  }
+
+  if (!sampling) {
     pinMode(PPD42_PIN_1_0, INPUT);
     pinMode(PPD42_PIN_2_5, INPUT);
-    pulse.register_pin(PPD42_PIN_1_0, LOW);
-    pulse.register_pin(PPD42_PIN_2_5, LOW);
-
-    while ((total = micros() - starttime_us) < sampletime_us) {
-      unsigned long duration;
-      uint8_t pin;
-      pin = pulse.watch(&duration, (sampletime_us-total));
-      if (PULSE2_NO_PIN != pin) {
-        if (PPD42_PIN_1_0 == pin)
-          lpo10 += duration;
-        if (PPD42_PIN_2_5 == pin)
-          lpo25 += duration;
-#if EXTRA_DEBUG
-        //Serial.printf("%lu: pulse: %lu: %s\n", millis(), duration, (pin==PPD42_PIN_1_0)?"PIN10":"PIN25");
-#endif
-      }
-    }
+    pulse.register_pin(PPD42_PIN_1_0, LOW, true);
+    pulse.register_pin(PPD42_PIN_2_5, LOW, true);
+    starttime_ms = millis();
+    sampling = true;
+
+    // there is nothing to read yet after a reset, wait for the first window
+    delay(sampletime_us/1000);
+  }
 
-    {
-      float ratio10;
-      float ratio25;
-      float concentration10;
-      float concentration25;
-      int32_t count10;
-      int32_t count25;
-
-      // percentage of sampletime_us where 1.0/2.5μm pin was pulsed low
-      ratio10 = lpo10*(100.0/total);
-      ratio25 = lpo25*(100.0/total);
-      concentration10 = 1.1*pow(ratio10,3)-3.8*pow(ratio10,2)+520*ratio10;
-      concentration25 = 1.1*pow(ratio25,3)-3.8*pow(ratio25,2)+520*ratio25;
-      if (concentration10 > 0)
-        count10=concentration10/10; // *100 /1000
-      else
-        count10 = 0;
-      if (concentration25 > 0)
-        count25=concentration25/10; // *100 /1000
-      else
-        count25 = 0;
-      store_reading(SENSOR_PARTICLE_1_0, count10);
-      store_reading(SENSOR_PARTICLE_2_5, count25);
+  {
+    unsigned long lpo10;
+    unsigned long lpo25;
+    unsigned long total = millis() - starttime_ms;
+    float ratio10;
+    float ratio25;
+    float concentration10;
+    float concentration25;
+    int32_t count10;
+    int32_t count25;
+
+    if (total < sampletime_us/1000)
+      return;
+
+    lpo10 = pulse.take_occupancy(PPD42_PIN_1_0);
+    lpo25 = pulse.take_occupancy(PPD42_PIN_2_5);
+    starttime_ms += total;
+
+    // percentage of the window where 1.0/2.5μm pin was pulsed low
+    ratio10 = lpo10*(0.1/total);
+    ratio25 = lpo25*(0.1/total);
+    concentration10 = 1.1*pow(ratio10,3)-3.8*pow(ratio10,2)+520*ratio10;
+    concentration25 = 1.1*pow(ratio25,3)-3.8*pow(ratio25,2)+520*ratio25;
+    if (concentration10 > 0)
+      count10=concentration10/10; // *100 /1000
+    else
+      count10 = 0;
+    if (concentration25 > 0)
+      count25=concentration25/10; // *100 /1000
+    else
+      count25 = 0;
+    store_reading(SENSOR_PARTICLE_1_0, count10);
+    store_reading(SENSOR_PARTICLE_2_5, count25);
 #if EXTRA_DEBUG
-      Serial.printf("Raw Particle Count >1.0μm: %d particles/cf\n", count10*1000);
-      Serial.printf("Raw Particle Count >2.5μm: %d particles/cf\n", count25*1000);
+    Serial.printf("PPD42 window: %lu ms\n", total);
+    Serial.printf("Raw Particle Count >1.0μm: %d particles/cf\n", count10*1000);
+    Serial.printf("Raw Particle Count >2.5μm: %d particles/cf\n", count25*1000);
 #endif
-    }
-
-    pulse.unregister_pin(PPD42_PIN_1_0);
-    pulse.unregister_pin(PPD42_PIN_2_5);
   }
 }
 #endif
 
+// choose the SHT30 repeatability for the next wake from the change of the
+// readings since the last wake and the battery voltage of the last wake
+static void sht30_choose_repeatability(sht30_stats_t *stats, float temperature, float humidity)
+{
+  const frame_state_t *last = (const frame_state_t*) &rtc_mem[RTC_MEM_FRAME_LAST];
+  int32_t last_batt = last->values[SENSOR_BATTERY_VOLTAGE - SENSOR_TEMPERATURE];
+  float batt_cal = *((float*)&rtc_mem[RTC_MEM_BATTERY_CAL]);
+  float temp_change = fabsf(temperature - last->values[SENSOR_TEMPERATURE - SENSOR_TEMPERATURE]/1000.0);
+  float humidity_change = fabsf(humidity - last->values[SENSOR_HUMIDITY - SENSOR_TEMPERATURE]/1000.0);
+
+  if ((last_batt > 0) && (last_batt/1000.0 + batt_cal < LOW_BATTERY_VOLTAGE))
+    stats->rpt_step = SHT30_RPT_HIGH - SHT30_RPT_LOW;
+  else if (!(last->present & (1 << (SENSOR_HUMIDITY - SENSOR_TEMPERATURE))) ||
+      (temp_change >= SHT30_STABLE_TEMP) || (humidity_change >= SHT30_STABLE_HUMIDITY))
+    stats->rpt_step = 0;
+  else if (stats->rpt_step < SHT30_RPT_HIGH - SHT30_RPT_LOW)
+    stats->rpt_step++;
+}
+
 // read and store values from the SHT30 temperature and humidity sensor
+// a sample with a bad checksum is measured again (at low repeatability)
+// instead of being averaged in
 bool read_sht30(bool perform_store)
 {
   static float temperature=0; // running total for averaging
   static float humidity=0;    // running total for averaging
   static unsigned int num_readings=0; // count for averaging
+  sht30_stats_t *stats = (sht30_stats_t*) &rtc_mem[RTC_MEM_SHT30_STATS];
+  sht30_repeatability_t type = (sht30_repeatability_t)(SHT30_RPT_HIGH - stats->rpt_step);
   sht30_data_t data;
+  bool crc_ok = false;
   int ret;
-  ret = sht30_get(SHT30_ADDR, SHT30_RPT_HIGH, &data);
+
+  if (!i2c_device_present(I2C_DEV_SHT30))
+    return false;
+
+  for (int i=0; i<=SHT30_CRC_RETRIES; i++) {
+    ret = sht30_get(SHT30_ADDR, type, &data);
+    if (ret != 0)
+      break;
+
+    if ((SHT30_RPT_LOW == type) && (stats->rpt_low < 127))
+      stats->rpt_low++;
+    if ((SHT30_RPT_MED == type) && (stats->rpt_med < 127))
+      stats->rpt_med++;
+    if ((SHT30_RPT_HIGH == type) && (stats->rpt_high < 127))
+      stats->rpt_high++;
+
+    crc_ok = sht30_check_temp(data) && sht30_check_humidity(data);
+    if (crc_ok)
+      break;
+    if (stats->crc_errors < 127)
+      stats->crc_errors++;
+    type = SHT30_RPT_LOW;
+  }
+  i2c_device_result(I2C_DEV_SHT30, 0 == ret);
+
   Serial.println();
   if (ret != 0) {
     Serial.print("Error Reading SHT30 ret=");
     Serial.println(ret);
-    return false;
+  } else if (!crc_ok) {
+    Serial.println("Error Reading SHT30 checksum");
   } else {
     temperature += sht30_parse_temp_c(data);
     humidity += sht30_parse_humidity(data);
     num_readings++;
 
 #if (EXTRA_DEBUG != 0)
+    Serial.printf("SHT30 repeatability: %d\n", type);
     Serial.print("Raw Temperature: ");
     Serial.print(sht30_parse_temp_c(data), 3);
     Serial.print("°C (");
@@ -128,7 +254,9 @@ bool read_sht30(bool perform_store)
 #endif
   }
 
+  // the samples collected so far are stored even if this one failed
   if (perform_store && num_readings) {
+    sht30_choose_repeatability(stats, temperature/num_readings, humidity/num_readings);
     store_reading(SENSOR_TEMPERATURE, temperature/num_readings*1000.0 + 0.5);
     store_reading(SENSOR_HUMIDITY, humidity/num_readings*1000.0 + 0.5);
     gTemperature = temperature/num_readings;
@@ -138,77 +266,99 @@ bool read_sht30(bool perform_store)
     num_readings = 0;
   }
 
-  return true;
+  return (0 == ret) && crc_ok;
 }
 
 // read and store values from the HP303B barametric pressure sensor
 bool read_hp303b(bool measure_temp)
 {
-  //OVERSAMPLING TABLE
-  // Val | Time (ms) | Noise (counts)
-  //   0 |      15.6 | 12
-  //   1 |      17.6 | 6
-  //   2 |      20.6 | 4
-  //   3 |      25.5 | 3
-  //   4 |      39.6 | 2
-  //   5 |      65.6 | 2
-  //   6 |     116.6 | 2
-  //   7 |     218.7 | 1
-  int16_t oversampling = 4;
-  int16_t ret;
-  int32_t pressure;
-
-  // Call begin to initialize HP303BPressureSensor
-  // The default address is 0x77 and does not need to be given.
-  HP303BPressureSensor.begin();
+  // the coefficients and configuration are kept in RTC memory and by the
+  // sensor over deep sleep, so it is only set up again after a power loss
+  hp303b_cal_t *cal = (hp303b_cal_t*) &rtc_mem[RTC_MEM_HP303B_CAL];
+  hp303b_data_t data;
+  int32_t samples[HP303B_FIFO_SIZE];
+  unsigned num_samples = 0;
+  int ret = 0;
+
+  if (!i2c_device_present(I2C_DEV_HP303B))
+    return false;
 
-  if (measure_temp) {
-    int32_t temperature;
-    //lets the HP303B perform a Single temperature measurement with the last (or standard) configuration
-    //The result will be written to the paramerter temperature
-    //ret = HP303BPressureSensor.measureTempOnce(temperature);
-    //the commented line below does exactly the same as the one above, but you can also config the precision
-    //oversampling can be a value from 0 to 7
-    //the HP303B will perform 2^oversampling internal temperature measurements and combine them to one result with higher precision
-    //measurements with higher precision take more time, consult datasheet for more information
-    ret = HP303BPressureSensor.measureTempOnce(temperature, oversampling);
-
-    if (ret != 0) {
-      //Something went wrong.
-      //Look at the library code for more information about return codes
-      Serial.print("Error Reading HP303B (temperature) ret=");
-      Serial.println(ret);
-      return false;
-    } else {
-      store_reading(SENSOR_TEMPERATURE, temperature*1000);
-      gTemperature = temperature;
-#if (EXTRA_DEBUG != 0)
-      Serial.print("Raw Temperature: ");
-      Serial.print(temperature);
-      Serial.print(" °C (");
-      Serial.print(((float)temperature * 9/5)+32.0);
-      Serial.println(" °F)");
+  if (!hp303b_check_cal(cal))
+    ret = hp303b_init(HP303B_ADDR, HP303B_PRS_OSR, HP303B_TMP_OSR, cal);
+
+#if HP303B_BACKGROUND_MODE
+  // collect the pressure measured since the last wake, this also returns the
+  // sensor to single measurements for the temperature
+  if (0 == ret)
+    ret = hp303b_stop_background(HP303B_ADDR, cal, samples, &num_samples);
 #endif
-    }
+
+  // the pressure compensation needs a current temperature, so it is always measured
+  if (0 == ret)
+    ret = hp303b_get(HP303B_ADDR, cal, HP303B_MEAS_TEMP, &data);
+  if (HP303B_ERR_CONFIG == ret) {
+    num_samples = 0;
+    ret = hp303b_init(HP303B_ADDR, HP303B_PRS_OSR, HP303B_TMP_OSR, cal);
+    if (0 == ret)
+      ret = hp303b_get(HP303B_ADDR, cal, HP303B_MEAS_TEMP, &data);
   }
+  if ((0 == ret) && (0 == num_samples)) {
+    ret = hp303b_get(HP303B_ADDR, cal, HP303B_MEAS_PRESSURE, &data);
+    samples[num_samples++] = data.pressure;
+  }
+
+#if HP303B_BACKGROUND_MODE
+  if (0 == ret)
+    ret = hp303b_start_background(HP303B_ADDR, cal, HP303B_BACKGROUND_RATE);
+#endif
 
-  //Pressure measurement behaves like temperature measurement
-  //ret = HP303BPressureSensor.measurePressureOnce(pressure);
-  ret = HP303BPressureSensor.measurePressureOnce(pressure, oversampling);
+  i2c_device_result(I2C_DEV_HP303B, 0 == ret);
   if (ret != 0) {
-    //Something went wrong.
-    //Look at the library code for more information about return codes
-    Serial.print("Error Reading HP303B (pressure) ret=");
+    Serial.print("Error Reading HP303B ret=");
     Serial.println(ret);
     return false;
-  } else {
-    store_reading(SENSOR_PRESSURE, pressure);
+  }
+
+  if (measure_temp) {
+    float temperature = hp303b_parse_temp_c(cal, data);
+
+    store_reading(SENSOR_TEMPERATURE, temperature*1000.0 + 0.5);
+    gTemperature = temperature;
+#if (EXTRA_DEBUG != 0)
+    Serial.print("Raw Temperature: ");
+    Serial.print(temperature, 3);
+    Serial.print(" °C (");
+    Serial.print((temperature * 9/5)+32.0, 3);
+    Serial.println(" °F)");
+#endif
+  }
+
+  {
+    float pressure = 0;
+    float min_pressure = INFINITY;
+    float max_pressure = -INFINITY;
+
+    // compensate the background samples with the current temperature, it
+    // doesn't change enough between wakes to matter
+    for (unsigned i=0; i<num_samples; i++) {
+      float val;
+
+      data.pressure = samples[i];
+      val = hp303b_parse_pressure(cal, data);
+      pressure += val;
+      min_pressure = fminf(min_pressure, val);
+      max_pressure = fmaxf(max_pressure, val);
+    }
+    pressure /= num_samples;
+
+    store_reading(SENSOR_PRESSURE, pressure + 0.5);
 #if (EXTRA_DEBUG != 0)
     Serial.print("Raw Pressure: ");
     Serial.print(pressure/1000.0, 3);
     Serial.print(" kPa (");
-    Serial.print((float)pressure/3386.39);
+    Serial.print(pressure/3386.39);
     Serial.println(" in Hg)");
+    Serial.printf("Pressure samples: %u min: %.0f max: %.0f Pa\n", num_samples, min_pressure, max_pressure);
 #endif
   }
 
@@ -248,21 +398,17 @@ void read_vcc(bool perform_store)
   }
 }
 
-// store the current uptime as an offset from RTC_MEM_DATA_TIMEBASE
+// store the current uptime as the timestamp of the readings from this wake
 void store_uptime(void)
 {
   uint64_t timestamp;
-  uint64_t time_h;
-  uint32_t time_l;
 
   timestamp = uptime();
-  time_h = rtc_mem[RTC_MEM_DATA_TIMEBASE] << RTC_DATA_TIMEBASE_SHIFT;
-  time_l = timestamp - time_h;
 
 #if EXTRA_DEBUG
-  Serial.printf("[%llu] Storing Timestamp Offset %u (@%llu)\n", timestamp, time_l, time_h);
+  Serial.printf("[%llu] Storing Timestamp\n", timestamp);
 #endif
-  store_reading(SENSOR_TIMESTAMP_OFFS, (int32_t)time_l);
+  store_timestamp(timestamp);
 }
 
 float get_temp(void)
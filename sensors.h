@@ -17,9 +17,19 @@ typedef enum sensor_type_e {
   SENSOR_TIMESTAMP_OFFS,
 } sensor_type_t;
 
+// Devices on the I2C bus, see i2c_census_t
+typedef enum i2c_device_e {
+  I2C_DEV_SHT30,
+  I2C_DEV_HP303B,
+  I2C_DEV_EPD,
+  I2C_NUM_DEVICES
+} i2c_device_t;
+
 
 /* Function Prototypes */
 void sensors_init(void);
+bool i2c_device_present(i2c_device_t dev);
+void i2c_device_result(i2c_device_t dev, bool ok);
 
 #if TETHERED_MODE
 void read_ppd42(unsigned long sampletime_us=30000000);
@@ -0,0 +1,253 @@
+#include "project_config.h"
+
+#include <Arduino.h>
+
+#include "persistent.h"
+#include "rtc_mem.h"
+#include "spill_log.h"
+
+#if !SPILL_LOG_NOR_FLASH
+
+/* Global Data Structures */
+static spill_block_t spill_block;   // the block being written or replayed
+static uint32_t spill_offset = 0;   // byte offset of the oldest block with unacknowledged frames
+static uint32_t spill_acked = 0;    // number of acknowledged frames in that block
+static bool cursor_loaded = false;
+static bool cursor_dirty = false;
+
+
+/* Function Prototypes */
+static void load_cursor(void);
+static bool read_block(uint32_t offset, size_t log_size);
+static uint32_t resync(uint32_t offset, size_t log_size);
+
+
+/* Functions */
+// move all of the frames in the rtc mem ring buffer to the end of the spill log
+// the whole buffer is written as a single block, so the flash is only written
+// once every time the ring buffer fills up
+// returns false (leaving the ring buffer untouched) if the log is full or the write failed
+bool spill_readings(void)
+{
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+  frame_state_t *last = (frame_state_t*) &rtc_mem[RTC_MEM_FRAME_LAST];
+  size_t log_size;
+  unsigned len;
+
+  if (0 == rtc_mem[RTC_MEM_NUM_FRAMES])
+    return true;
+
+  log_size = persistent_size(PERSISTENT_SPILL_LOG);
+  if (log_size + sizeof(spill_header_t) + rtc_mem[RTC_MEM_NUM_BYTES] > SPILL_LOG_MAX_SIZE) {
+    Serial.println("Spill log is full");
+    return false;
+  }
+
+  len = export_readings(&spill_block.header.base, spill_block.data);
+  spill_block.header.magic = SPILL_BLOCK_MAGIC;
+  spill_block.header.num_bytes = len;
+  spill_block.header.num_frames = rtc_mem[RTC_MEM_NUM_FRAMES];
+  spill_block.header.reserved = 0;
+  spill_block.header.last_timestamp = last->timestamp;
+
+  if (!persistent_append(PERSISTENT_SPILL_LOG, (const uint8_t*)&spill_block, sizeof(spill_header_t) + len))
+    return false;
+
+  Serial.printf("Spilled %u frames (%u bytes) to flash\n", spill_block.header.num_frames, len);
+  clear_readings();
+  flags->flags |= FLAG_BIT_SPILL_LOG;
+
+  return true;
+}
+
+// prepare to iterate through the oldest block of the spill log that still
+// has unacknowledged frames, skipping the ones that were already acknowledged
+// and the next skip frames (which are in flight), even if that crosses blocks
+// returns false if there are no spilled frames left
+// the flag in rtc mem avoids initializing SPIFFS when nothing was spilled
+bool spill_log_rewind(reading_frame_t *frame, unsigned skip)
+{
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+  size_t log_size;
+  uint32_t offset;
+
+  if (0 == (flags->flags & FLAG_BIT_SPILL_LOG))
+    return false;
+
+  log_size = persistent_size(PERSISTENT_SPILL_LOG);
+  if (0 == log_size) {
+    flags->flags &= ~FLAG_BIT_SPILL_LOG;
+    return false;
+  }
+
+  load_cursor();
+  offset = spill_offset;
+  skip += spill_acked;
+  while (offset + sizeof(spill_header_t) <= log_size) {
+    spill_header_t *header = &spill_block.header;
+
+    // a block that was only partially written (power loss) is skipped, the
+    // blocks that were appended after it are still replayed
+    if (!read_block(offset, log_size)) {
+      uint32_t next = resync(offset, log_size);
+
+      Serial.printf("Spill log has a torn block, skipping %u bytes\n", next - offset);
+      if (offset == spill_offset) {
+        spill_offset = next;
+        cursor_dirty = true;
+      }
+      offset = next;
+      continue;
+    }
+
+    if (skip < header->num_frames) {
+      rewind_frames(frame, &header->base, spill_block.data, header->num_bytes, header->num_frames);
+      for (unsigned i=0; i < skip; i++)
+        read_frame(frame);
+      return true;
+    }
+
+    // every frame of this block has been acknowledged or is in flight, move on to the next one
+    skip -= header->num_frames;
+    if ((offset == spill_offset) && (spill_acked >= header->num_frames)) {
+      spill_offset += sizeof(spill_header_t) + header->num_bytes;
+      spill_acked -= header->num_frames;
+      cursor_dirty = true;
+    }
+    offset += sizeof(spill_header_t) + header->num_bytes;
+  }
+
+  return false;
+}
+
+// record that the report server acknowledged the next num frames
+// the blocks whose frames have all been acknowledged are passed by
+// spill_log_rewind and spill_log_commit, the block being replayed stays loaded
+void spill_log_ack(unsigned num)
+{
+  load_cursor();
+  spill_acked += num;
+  cursor_dirty = true;
+}
+
+// store the replay position at the end of an upload
+// the log is deleted once all of its frames have been acknowledged
+void spill_log_commit(void)
+{
+  flags_time_t *flags = (flags_time_t*) &rtc_mem[RTC_MEM_FLAGS_TIME];
+
+  size_t log_size;
+
+  if (!cursor_dirty)
+    return;
+
+  // move past the blocks whose frames have all been acknowledged
+  log_size = persistent_size(PERSISTENT_SPILL_LOG);
+  while (spill_offset + sizeof(spill_header_t) <= log_size) {
+    if (!read_block(spill_offset, log_size)) {
+      spill_offset = resync(spill_offset, log_size);
+      continue;
+    }
+    if (spill_acked < spill_block.header.num_frames)
+      break;
+
+    spill_offset += sizeof(spill_header_t) + spill_block.header.num_bytes;
+    spill_acked -= spill_block.header.num_frames;
+  }
+
+  if (spill_offset >= log_size) {
+    persistent_remove(PERSISTENT_SPILL_LOG);
+    persistent_remove(PERSISTENT_SPILL_CURSOR);
+    flags->flags &= ~FLAG_BIT_SPILL_LOG;
+    spill_offset = 0;
+    spill_acked = 0;
+  } else {
+    persistent_write(PERSISTENT_SPILL_CURSOR, String(spill_offset) + "," + String(spill_acked));
+  }
+  cursor_dirty = false;
+}
+
+// find the timestamp of the newest frame in the spill log
+// returns false if the log is empty
+bool spill_log_last_timestamp(uint64_t *timestamp)
+{
+  size_t log_size = persistent_size(PERSISTENT_SPILL_LOG);
+  uint32_t offset = 0;
+  bool retval = false;
+
+  while (offset + sizeof(spill_header_t) <= log_size) {
+    if (!read_block(offset, log_size)) {
+      offset = resync(offset, log_size);
+      continue;
+    }
+
+    *timestamp = spill_block.header.last_timestamp;
+    retval = true;
+    offset += sizeof(spill_header_t) + spill_block.header.num_bytes;
+  }
+
+  return retval;
+}
+
+// helper to load the replay position ("offset,acked") from SPIFFS once
+static void load_cursor(void)
+{
+  if (cursor_loaded)
+    return;
+
+  if (persistent_size(PERSISTENT_SPILL_CURSOR) > 0) {
+    String cursor = persistent_read(PERSISTENT_SPILL_CURSOR);
+    int comma = cursor.indexOf(',');
+
+    if (comma > 0) {
+      spill_offset = strtoul(cursor.c_str(), NULL, 0);
+      spill_acked = strtoul(cursor.c_str() + comma + 1, NULL, 0);
+    }
+  }
+  cursor_loaded = true;
+}
+
+// helper to read the block at offset into spill_block and check it
+// a block that was only partially written doesn't decode to the size and the
+// newest timestamp in its header, even if later blocks follow it
+static bool read_block(uint32_t offset, size_t log_size)
+{
+  spill_header_t *header = &spill_block.header;
+  reading_frame_t frame;
+  size_t len = persistent_read(PERSISTENT_SPILL_LOG, offset, (uint8_t*)&spill_block, sizeof(spill_block));
+
+  if ((len < sizeof(spill_header_t))
+   || (header->magic != SPILL_BLOCK_MAGIC)
+   || (header->num_bytes > RTC_DATA_SIZE)
+   || (header->num_bytes < header->num_frames*RTC_FRAME_MIN_SIZE)
+   || (offset + sizeof(spill_header_t) + header->num_bytes > log_size)
+   || (len < sizeof(spill_header_t) + header->num_bytes))
+    return false;
+
+  // the decoding wraps around to offset 0 after the last byte of the frames
+  rewind_frames(&frame, &header->base, spill_block.data, header->num_bytes, header->num_frames);
+  while (read_frame(&frame)) {}
+  return (0 == frame.offset) && (frame.state.timestamp == header->last_timestamp);
+}
+
+// helper to find the first valid block after the torn block at offset
+// returns log_size if there is none
+static uint32_t resync(uint32_t offset, size_t log_size)
+{
+  const uint8_t magic[2] = {SPILL_BLOCK_MAGIC & 0xff, SPILL_BLOCK_MAGIC >> 8};
+  uint8_t buf[64];
+
+  for (offset++; offset + sizeof(spill_header_t) <= log_size; offset += sizeof(buf) - 1) {
+    size_t len = persistent_read(PERSISTENT_SPILL_LOG, offset, buf, sizeof(buf));
+
+    for (size_t i=0; i + 1 < len; i++)
+      if ((buf[i] == magic[0]) && (buf[i+1] == magic[1]) && read_block(offset + i, log_size))
+        return offset + i;
+    if (len < sizeof(buf))
+      break;
+  }
+
+  return log_size;
+}
+
+#endif /* !SPILL_LOG_NOR_FLASH */
@@ -0,0 +1,38 @@
+#ifndef _SPILL_LOG_H_
+#define _SPILL_LOG_H_
+
+#include "project_config.h"
+#include "rtc_mem.h"
+
+
+/* Types and Enums */
+#define SPILL_BLOCK_MAGIC (0x5B1D)
+
+// Header of each block in the spill log
+typedef struct spill_header_s {
+  uint16_t      magic;
+  uint16_t      num_bytes;      // size of the encoded frames following the header
+  uint16_t      num_frames;     // number of frames in the block
+  uint16_t      reserved;
+  uint64_t      last_timestamp; // timestamp of the newest frame in the block
+  frame_state_t base;           // state that the oldest frame is delta-encoded against
+} spill_header_t;
+
+// A block holds the whole contents of the rtc mem ring buffer at the time it was spilled
+typedef struct spill_block_s {
+  spill_header_t header;
+  uint8_t        data[RTC_DATA_SIZE];
+} spill_block_t;
+
+
+/* Function Prototypes */
+// implemented by spill_log.cpp (SPIFFS) or spill_log_nor.cpp (raw flash region)
+bool spill_readings(void);
+
+bool spill_log_rewind(reading_frame_t *frame, unsigned skip=0);
+void spill_log_ack(unsigned num);
+void spill_log_commit(void);
+
+bool spill_log_last_timestamp(uint64_t *timestamp);
+
+#endif /* _SPILL_LOG_H_ */
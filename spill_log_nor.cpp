@@ -0,0 +1,470 @@
+#include "project_config.h"
+
+#include <Arduino.h>
+#include <Esp.h>
+#include <flash_hal.h>
+
+#include "rtc_mem.h"
+#include "spill_log.h"
+
+#if SPILL_LOG_NOR_FLASH
+
+/* Types and Enums */
+#define NOR_PAGE_SIZE       (256)
+#define NOR_SECTOR_SIZE     (FLASH_SECTOR_SIZE)
+#define NOR_NUM_SECTORS     (NOR_LOG_SIZE / NOR_SECTOR_SIZE)
+#define NOR_ERASED          (0xFFFFFFFF)
+#define NOR_RECORD_COMMIT   (0x5A5AC33C)
+#define NOR_ACK_SLOTS       (6)
+// acknowledged counts are stored with their complement in the upper half, so
+// that a count torn by power loss while it was programmed can be recognised
+#define NOR_ACK_WORD(n)     ((((~(uint32_t)(n)) & 0xFFFF) << 16) | ((uint32_t)(n) & 0xFFFF))
+
+// Header of each record in the raw flash region
+// Records start on a page boundary and never cross a sector boundary.
+// Fields that are still erased can be programmed later (1 -> 0 bits only),
+// which is how commit, consumed, and acked are updated without an erase.
+typedef struct nor_record_hdr_s {
+  uint32_t seq;                  // increasing sequence number (NOR_ERASED for a free page)
+  uint16_t num_pages;            // pages occupied by the record
+  uint16_t reserved;
+  uint32_t commit;               // NOR_RECORD_COMMIT once the whole record has been programmed
+  uint32_t consumed;             // programmed to 0 once all frames were acknowledged
+  uint32_t acked[NOR_ACK_SLOTS]; // NOR_ACK_WORD of acknowledged frame counts, the last valid slot is current
+} nor_record_hdr_t;
+
+typedef struct nor_record_s {
+  nor_record_hdr_t hdr;
+  spill_block_t    block;
+} nor_record_t;
+
+
+/* Global Data Structures */
+static nor_record_t nor_record;     // the record being written or replayed
+static bool nor_scanned = false;    // recovery scan has been performed for this wake
+static uint32_t nor_head = 0;       // offset in the region where the next record will be written
+static uint32_t nor_tail = 0;       // offset of the oldest record that may have unacknowledged frames
+static uint32_t nor_next_seq = 0;   // sequence number of the next record
+static uint32_t nor_acked = 0;      // frames of the record at nor_tail acknowledged during this upload
+static bool nor_dirty = false;      // nor_acked has not been programmed yet
+
+
+/* Function Prototypes */
+static bool nor_region_ok(void);
+static bool nor_read(uint32_t offset, void *buf, size_t size);
+static bool nor_program(uint32_t offset, const void *buf, size_t size);
+static bool nor_erase(uint32_t sector);
+static bool nor_sector_erased(uint32_t sector);
+static uint32_t nor_next_record(uint32_t offset, const nor_record_hdr_t *hdr);
+static void nor_erase_ahead(uint32_t head_sector);
+static void nor_scan(void);
+static bool nor_record_valid(const nor_record_hdr_t *hdr, const spill_header_t *header);
+static uint32_t nor_current_acked(const nor_record_hdr_t *hdr);
+static void nor_mark_acked(uint32_t offset, const nor_record_hdr_t *hdr, uint32_t acked);
+
+
+/* Functions */
+// move all of the frames in the rtc mem ring buffer into a new record in the
+// raw flash region
+// the sector following the record is erased ahead of time so that the next
+// spill never waits for an erase, dropping the oldest sector if the region is full
+// returns false (leaving the ring buffer untouched) if the write failed
+bool spill_readings(void)
+{
+  frame_state_t *last = (frame_state_t*) &rtc_mem[RTC_MEM_FRAME_LAST];
+  spill_header_t *header = &nor_record.block.header;
+  uint32_t commit = NOR_RECORD_COMMIT;
+  size_t size;
+  unsigned len;
+
+  if (0 == rtc_mem[RTC_MEM_NUM_FRAMES])
+    return true;
+
+  nor_scan();
+  if (!nor_region_ok())
+    return false;
+
+  len = export_readings(&header->base, nor_record.block.data);
+  header->magic = SPILL_BLOCK_MAGIC;
+  header->num_bytes = len;
+  header->num_frames = rtc_mem[RTC_MEM_NUM_FRAMES];
+  header->reserved = 0;
+  header->last_timestamp = last->timestamp;
+
+  size = sizeof(nor_record_hdr_t) + sizeof(spill_header_t) + len;
+  size = (size + 3) & ~3;
+  memset(&nor_record.hdr, 0xff, sizeof(nor_record.hdr));
+  nor_record.hdr.seq = nor_next_seq;
+  nor_record.hdr.num_pages = (size + NOR_PAGE_SIZE - 1) / NOR_PAGE_SIZE;
+  nor_record.hdr.commit = NOR_ERASED; // programmed last to detect a torn write
+
+  // records don't cross sectors, the next sector was already erased ahead
+  if ((nor_head % NOR_SECTOR_SIZE) + nor_record.hdr.num_pages*NOR_PAGE_SIZE > NOR_SECTOR_SIZE) {
+    nor_head = ((nor_head / NOR_SECTOR_SIZE + 1) % NOR_NUM_SECTORS) * NOR_SECTOR_SIZE;
+    nor_erase_ahead(nor_head / NOR_SECTOR_SIZE);
+  }
+
+  if (!nor_program(nor_head, &nor_record, size) ||
+      !nor_program(nor_head + offsetof(nor_record_hdr_t, commit), &commit, sizeof(commit)))
+    return false;
+
+  Serial.printf("Spilled %u frames (%u bytes) to flash record %u\n", header->num_frames, len, nor_record.hdr.seq);
+  clear_readings();
+  nor_next_seq++;
+  nor_head = nor_next_record(nor_head, &nor_record.hdr);
+  if (0 == (nor_head % NOR_SECTOR_SIZE))
+    nor_erase_ahead(nor_head / NOR_SECTOR_SIZE);
+
+  return true;
+}
+
+// prepare to iterate through the oldest record that still has unacknowledged
+// frames, skipping the ones that were already acknowledged and the next skip
+// frames (which are in flight), even if that crosses records
+// returns false if there are no spilled frames left
+bool spill_log_rewind(reading_frame_t *frame, unsigned skip)
+{
+  spill_header_t *header = &nor_record.block.header;
+  uint32_t offset;
+
+  nor_scan();
+  if (!nor_region_ok())
+    return false;
+
+  offset = nor_tail;
+  while (offset != nor_head) {
+    uint32_t acked = 0;
+    bool valid;
+
+    if (!nor_read(offset, &nor_record.hdr, sizeof(nor_record.hdr)))
+      return false;
+
+    // the rest of this sector is unused, the next record is in the next sector
+    if (NOR_ERASED == nor_record.hdr.seq) {
+      if (offset == nor_tail)
+        nor_tail = ((nor_tail / NOR_SECTOR_SIZE + 1) % NOR_NUM_SECTORS) * NOR_SECTOR_SIZE;
+      offset = ((offset / NOR_SECTOR_SIZE + 1) % NOR_NUM_SECTORS) * NOR_SECTOR_SIZE;
+      continue;
+    }
+
+    // acknowledgements are only ever stored in the record at the tail
+    if (offset == nor_tail) {
+      acked = nor_current_acked(&nor_record.hdr);
+      if (nor_acked > acked)
+        acked = nor_acked;
+      nor_acked = acked;
+    }
+
+    valid = nor_read(offset + sizeof(nor_record_hdr_t), &nor_record.block, sizeof(nor_record.block)) &&
+            nor_record_valid(&nor_record.hdr, header);
+
+    if (valid && (acked + skip < header->num_frames)) {
+      rewind_frames(frame, &header->base, nor_record.block.data, header->num_bytes, header->num_frames);
+      for (unsigned i=0; i < acked + skip; i++)
+        read_frame(frame);
+      return true;
+    }
+
+    if (valid && (acked < header->num_frames))
+      skip -= header->num_frames - acked; // the remaining frames are in flight
+
+    // every frame of this record was acknowledged (or it was torn), move on
+    if ((offset == nor_tail) && (!valid || (acked >= header->num_frames))) {
+      if ((NOR_RECORD_COMMIT == nor_record.hdr.commit) && (NOR_ERASED == nor_record.hdr.consumed))
+        nor_mark_acked(nor_tail, &nor_record.hdr, NOR_ERASED);
+      nor_tail = nor_next_record(nor_tail, &nor_record.hdr);
+      nor_acked = 0;
+      nor_dirty = false;
+      offset = nor_tail;
+    } else {
+      offset = nor_next_record(offset, &nor_record.hdr);
+    }
+  }
+
+  return false;
+}
+
+// record that the report server acknowledged the next num frames
+// records whose frames have all been acknowledged are consumed right away, so
+// the acknowledgement can continue into the following records
+void spill_log_ack(unsigned num)
+{
+  nor_record_hdr_t hdr;
+  spill_header_t header;
+
+  nor_acked += num;
+  nor_dirty = true;
+
+  while (nor_tail != nor_head) {
+    if (!nor_read(nor_tail, &hdr, sizeof(hdr)))
+      break;
+
+    if (NOR_ERASED == hdr.seq) {
+      nor_tail = ((nor_tail / NOR_SECTOR_SIZE + 1) % NOR_NUM_SECTORS) * NOR_SECTOR_SIZE;
+      continue;
+    }
+
+    // torn records don't hold any frames, just like in spill_log_rewind
+    if (nor_read(nor_tail + sizeof(nor_record_hdr_t), &header, sizeof(header)) &&
+        nor_record_valid(&hdr, &header)) {
+      if (nor_acked < header.num_frames)
+        break;
+      nor_acked -= header.num_frames;
+    }
+
+    if ((NOR_RECORD_COMMIT == hdr.commit) && (NOR_ERASED == hdr.consumed))
+      nor_mark_acked(nor_tail, &hdr, NOR_ERASED);
+    nor_tail = nor_next_record(nor_tail, &hdr);
+  }
+}
+
+// program the acknowledged frame count of the current record at the end of an upload
+void spill_log_commit(void)
+{
+  nor_record_hdr_t hdr;
+
+  if (!nor_dirty || (nor_tail == nor_head))
+    return;
+
+  if (nor_read(nor_tail, &hdr, sizeof(hdr)) && (NOR_ERASED != hdr.seq))
+    nor_mark_acked(nor_tail, &hdr, nor_acked);
+  nor_dirty = false;
+}
+
+// find the timestamp of the newest frame in the raw flash region
+// returns false if the log is empty
+bool spill_log_last_timestamp(uint64_t *timestamp)
+{
+  uint32_t offset;
+  bool retval = false;
+
+  nor_scan();
+  if (!nor_region_ok())
+    return false;
+
+  // walk every record from the tail to the head
+  offset = nor_tail;
+  while (offset != nor_head) {
+    if (!nor_read(offset, &nor_record, sizeof(nor_record_hdr_t) + sizeof(spill_header_t)))
+      break;
+
+    if (NOR_ERASED == nor_record.hdr.seq) {
+      offset = ((offset / NOR_SECTOR_SIZE + 1) % NOR_NUM_SECTORS) * NOR_SECTOR_SIZE;
+      continue;
+    }
+
+    if ((NOR_RECORD_COMMIT == nor_record.hdr.commit) && (SPILL_BLOCK_MAGIC == nor_record.block.header.magic)) {
+      *timestamp = nor_record.block.header.last_timestamp;
+      retval = true;
+    }
+    offset = nor_next_record(offset, &nor_record.hdr);
+  }
+
+  return retval;
+}
+
+// helper to check that the configured region is usable
+static bool nor_region_ok(void)
+{
+  static bool reported = false;
+  bool retval = (NOR_NUM_SECTORS >= 3) &&
+                (0 == (NOR_LOG_START_ADDR % NOR_SECTOR_SIZE)) &&
+                (NOR_LOG_START_ADDR >= ESP.getSketchSize()) &&
+                (NOR_LOG_START_ADDR + NOR_LOG_SIZE <= FS_PHYS_ADDR);
+
+  if (!retval && !reported) {
+    Serial.println("NOR spill log region overlaps the sketch or filesystem");
+    reported = true;
+  }
+
+  return retval;
+}
+
+// helpers to access the raw flash region, offsets are relative to NOR_LOG_START_ADDR
+static bool nor_read(uint32_t offset, void *buf, size_t size)
+{
+  return ESP.flashRead(NOR_LOG_START_ADDR + offset, (uint32_t*)buf, (size + 3) & ~3);
+}
+
+static bool nor_program(uint32_t offset, const void *buf, size_t size)
+{
+  return ESP.flashWrite(NOR_LOG_START_ADDR + offset, (const uint32_t*)buf, (size + 3) & ~3);
+}
+
+static bool nor_erase(uint32_t sector)
+{
+  return ESP.flashEraseSector(NOR_LOG_START_ADDR / NOR_SECTOR_SIZE + sector);
+}
+
+// helper to check that every byte of a sector is erased
+// uses the record buffer, so it must not be called while replaying
+static bool nor_sector_erased(uint32_t sector)
+{
+  uint32_t *words = (uint32_t*)&nor_record;
+
+  for (uint32_t offset=0; offset < NOR_SECTOR_SIZE; offset += NOR_PAGE_SIZE) {
+    if (!nor_read(sector*NOR_SECTOR_SIZE + offset, words, NOR_PAGE_SIZE))
+      return false;
+    for (unsigned i=0; i < NOR_PAGE_SIZE/sizeof(uint32_t); i++)
+      if (NOR_ERASED != words[i])
+        return false;
+  }
+
+  return true;
+}
+
+// helper to find the offset of the record following the one at offset
+static uint32_t nor_next_record(uint32_t offset, const nor_record_hdr_t *hdr)
+{
+  uint32_t pages = hdr->num_pages;
+
+  // a record that was torn before its header was complete occupies at least a page
+  if ((0 == pages) || (pages*NOR_PAGE_SIZE > NOR_SECTOR_SIZE - (offset % NOR_SECTOR_SIZE)))
+    pages = 1;
+
+  offset += pages*NOR_PAGE_SIZE;
+  if (offset >= NOR_LOG_SIZE)
+    offset = 0;
+
+  return offset;
+}
+
+// helper to erase the sector following the one that the head is in, so that
+// the next spill never has to wait for an erase
+// if that sector holds the oldest records, they are dropped
+static void nor_erase_ahead(uint32_t head_sector)
+{
+  uint32_t ahead = (head_sector + 1) % NOR_NUM_SECTORS;
+
+  if (((nor_tail / NOR_SECTOR_SIZE) == ahead) && (nor_tail != nor_head)) {
+    Serial.println("Spill log wrapped, erasing the oldest sector");
+    nor_tail = ((ahead + 1) % NOR_NUM_SECTORS) * NOR_SECTOR_SIZE;
+    nor_acked = 0;
+    nor_dirty = false;
+  }
+  nor_erase(ahead);
+}
+
+// recovery scan, performed on the first access after boot
+// the head is found from the sector holding the highest sequence number and
+// the tail is the first record of the oldest sector after it
+static void nor_scan(void)
+{
+  nor_record_hdr_t hdr;
+  uint32_t head_sector = 0;
+  uint32_t max_seq = 0;
+  bool found = false;
+
+  if (nor_scanned || !nor_region_ok())
+    return;
+  nor_scanned = true;
+
+  // find the sector holding the newest records
+  for (uint32_t i=0; i < NOR_NUM_SECTORS; i++) {
+    if (!nor_read(i*NOR_SECTOR_SIZE, &hdr, sizeof(hdr)) || (NOR_ERASED == hdr.seq))
+      continue;
+    if (!found || (hdr.seq > max_seq)) {
+      max_seq = hdr.seq;
+      head_sector = i;
+      found = true;
+    }
+  }
+
+  if (!found) {
+    // empty (or never used) region, make sure the first two sectors are erased
+    if (!nor_sector_erased(0))
+      nor_erase(0);
+    if (!nor_sector_erased(1))
+      nor_erase(1);
+    nor_head = 0;
+    nor_tail = 0;
+    nor_next_seq = 0;
+    return;
+  }
+
+  // walk the records of the newest sector to find the first free page
+  nor_head = head_sector*NOR_SECTOR_SIZE;
+  nor_next_seq = max_seq + 1;
+  for (;;) {
+    if (!nor_read(nor_head, &hdr, sizeof(hdr)) || (NOR_ERASED == hdr.seq))
+      break;
+    if (hdr.seq >= nor_next_seq)
+      nor_next_seq = hdr.seq + 1;
+    nor_head = nor_next_record(nor_head, &hdr);
+    if (0 == (nor_head % NOR_SECTOR_SIZE))
+      break; // the sector is full
+  }
+
+  // finish an erase-ahead that was interrupted by power loss
+  // (the sector holding the head and the one after it must be erased)
+  head_sector = nor_head / NOR_SECTOR_SIZE;
+  if ((0 == (nor_head % NOR_SECTOR_SIZE)) && !nor_sector_erased(head_sector))
+    nor_erase(head_sector);
+  if (!nor_sector_erased((head_sector + 1) % NOR_NUM_SECTORS))
+    nor_erase((head_sector + 1) % NOR_NUM_SECTORS);
+
+  // the oldest records are in the first used sector after the head
+  nor_tail = head_sector*NOR_SECTOR_SIZE;
+  for (uint32_t i=1; i < NOR_NUM_SECTORS; i++) {
+    uint32_t sector = (head_sector + i) % NOR_NUM_SECTORS;
+
+    if (nor_read(sector*NOR_SECTOR_SIZE, &hdr, sizeof(hdr)) && (NOR_ERASED != hdr.seq)) {
+      nor_tail = sector*NOR_SECTOR_SIZE;
+      break;
+    }
+  }
+
+#if EXTRA_DEBUG
+  Serial.printf("NOR spill log head=%u tail=%u seq=%u\n", nor_head, nor_tail, nor_next_seq);
+#endif
+}
+
+// helper to check that a record was completely programmed, has frames that
+// were not consumed yet, and holds a plausible spill block
+static bool nor_record_valid(const nor_record_hdr_t *hdr, const spill_header_t *header)
+{
+  return (NOR_RECORD_COMMIT == hdr->commit) && (NOR_ERASED == hdr->consumed) &&
+         (SPILL_BLOCK_MAGIC == header->magic) && (header->num_bytes <= RTC_DATA_SIZE) &&
+         (header->num_bytes >= header->num_frames*RTC_FRAME_MIN_SIZE);
+}
+
+// helper to get the acknowledged frame count stored in a record header
+static uint32_t nor_current_acked(const nor_record_hdr_t *hdr)
+{
+  uint32_t acked = 0;
+
+  for (unsigned i=0; i < NOR_ACK_SLOTS; i++) {
+    if (NOR_ERASED == hdr->acked[i])
+      break;
+    if (NOR_ACK_WORD(hdr->acked[i] & 0xFFFF) == hdr->acked[i])
+      acked = hdr->acked[i] & 0xFFFF;
+  }
+
+  return acked;
+}
+
+// helper to program the acknowledged frame count of a record
+// NOR_ERASED marks the whole record as consumed
+// if all of the ack slots are used up, the remaining frames will be sent again
+static void nor_mark_acked(uint32_t offset, const nor_record_hdr_t *hdr, uint32_t acked)
+{
+  uint32_t zero = 0;
+  uint32_t word = NOR_ACK_WORD(acked);
+
+  if (NOR_ERASED == acked) {
+    nor_program(offset + offsetof(nor_record_hdr_t, consumed), &zero, sizeof(zero));
+    return;
+  }
+
+  if (acked <= nor_current_acked(hdr))
+    return;
+
+  for (unsigned i=0; i < NOR_ACK_SLOTS; i++) {
+    if (NOR_ERASED == hdr->acked[i]) {
+      nor_program(offset + offsetof(nor_record_hdr_t, acked) + i*sizeof(uint32_t), &word, sizeof(word));
+      break;
+    }
+  }
+}
+
+#endif /* SPILL_LOG_NOR_FLASH */
@@ -0,0 +1,170 @@
+// Benchmark of the wake frame encoding (encode_frame) on sensor traces
+// reports the bits used per sample, compared to storing the timestamp (64 bits)
+// and each value (32 bits) raw
+// recorded traces can be given as csv files of
+//   uptime_ms,temperature,humidity,pressure,battery_voltage
+// in the units of store_reading (an empty field is a missing reading, lines that
+// don't start with a number are skipped)
+#include "project_config.h"
+
+#include "../rtc_mem.cpp"
+
+#include <random>
+#include <vector>
+
+#define BENCH_WAKES (24*60*7) // a week of 60 s wakes
+
+typedef std::vector<frame_state_t> trace_t;
+
+const uint32_t preinit_magic = 0xaa55aa55;
+
+// no frames were spilled
+bool spill_log_last_timestamp(uint64_t *timestamp)
+{
+  (void)timestamp;
+  return false;
+}
+
+static void set_value(frame_state_t *frame, sensor_type_t type, int32_t val)
+{
+  frame->values[type - SENSOR_TEMPERATURE] = val;
+  frame->present |= 1 << (type - SENSOR_TEMPERATURE);
+}
+
+// helper to quantise a reading to the resolution of the sensor
+static double quantise(double val, double lsb)
+{
+  return round(val / lsb) * lsb;
+}
+
+// synthetic trace of a node with an SHT30 and an HP303B
+// swing is the daily temperature swing in degrees C, the readings of a wake
+// are the average of num_readings samples
+static trace_t synthetic_trace(unsigned seed, double swing, unsigned num_readings)
+{
+  std::mt19937 rng(seed);
+  std::normal_distribution<double> noise(0.0, 1.0);
+  trace_t trace;
+  uint64_t timestamp = 0;
+  double pressure = 101325;
+
+  for (unsigned wake = 0; wake < BENCH_WAKES; wake++) {
+    frame_state_t frame = {};
+    double day = 2 * M_PI * wake / (24*60);
+    double temperature = 0;
+    double humidity = 0;
+
+    for (unsigned i = 0; i < num_readings; i++) {
+      temperature += quantise(21 + swing/2*sin(day) + 0.02*noise(rng), 175.0/65535);
+      humidity += quantise(45 - swing*sin(day) + 0.1*noise(rng), 100.0/65535);
+    }
+    pressure += 2*noise(rng) + 0.02*sin(day / 3);
+
+    timestamp += 60000 + (rng() % 50);
+    frame.timestamp = timestamp;
+    set_value(&frame, SENSOR_TEMPERATURE, temperature / num_readings * 1000.0 + 0.5);
+    set_value(&frame, SENSOR_HUMIDITY, humidity / num_readings * 1000.0 + 0.5);
+    set_value(&frame, SENSOR_PRESSURE, pressure + 3*noise(rng) + 0.5);
+    set_value(&frame, SENSOR_BATTERY_VOLTAGE, 3900 - wake / 500 + (rng() % 4));
+    trace.push_back(frame);
+  }
+
+  return trace;
+}
+
+static bool load_trace(const char *path, trace_t *trace)
+{
+  static const sensor_type_t columns[] = {SENSOR_TEMPERATURE, SENSOR_HUMIDITY, SENSOR_PRESSURE, SENSOR_BATTERY_VOLTAGE};
+  FILE *f = fopen(path, "r");
+  char line[256];
+
+  if (!f) {
+    printf("%s: can't open\n", path);
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    frame_state_t frame = {};
+    char *field = line;
+    char *end;
+
+    frame.timestamp = strtoull(field, &end, 10);
+    if (end == field)
+      continue;
+
+    for (unsigned i = 0; (i < sizeof(columns)/sizeof(columns[0])) && (',' == *end); i++) {
+      long val;
+
+      field = end + 1;
+      val = strtol(field, &end, 10);
+      if (end != field)
+        set_value(&frame, columns[i], val);
+    }
+    trace->push_back(frame);
+  }
+  fclose(f);
+
+  return !trace->empty();
+}
+
+// encode the frames of trace, only keeping the values in mask
+// returns the number of bytes used
+static uint64_t encode_trace(const trace_t& trace, uint8_t mask, uint64_t *samples)
+{
+  uint8_t buf[RTC_FRAME_MAX_SIZE];
+  frame_state_t state = {};
+  uint64_t bytes = 0;
+
+  *samples = 0;
+  for (const frame_state_t& frame : trace) {
+    uint8_t present = frame.present & mask;
+
+    bytes += encode_frame(buf, &state, &frame, present);
+    *samples += 1 + __builtin_popcount(present);
+  }
+
+  return bytes;
+}
+
+static void report(const char *name, const trace_t& trace)
+{
+  static const char *names[RTC_FRAME_NUM_VALUES] = {"temperature", "humidity", "pressure", "particle 1.0", "particle 2.5", "battery voltage"};
+  uint64_t samples;
+  uint64_t bytes = encode_trace(trace, 0xff, &samples);
+  uint64_t raw = trace.size() * 8 + (samples - trace.size()) * 4;
+  uint64_t timestamp_bytes = encode_trace(trace, 0, &samples);
+
+  encode_trace(trace, 0xff, &samples);
+  printf("%s: %zu frames, %.1f bytes per frame, %.1f bits per sample, %.1fx smaller than raw\n",
+         name, trace.size(), (double)bytes / trace.size(), 8.0 * bytes / samples, (double)raw / bytes);
+
+  // each value is measured as the cost of adding it to the others, frames
+  // are padded to whole bytes, which would hide a value on its own
+  printf("  %-16s %5.1f bits per frame of just the timestamp\n", "timestamp", 8.0 * timestamp_bytes / trace.size());
+  for (unsigned i = 0; i < RTC_FRAME_NUM_VALUES; i++) {
+    uint64_t without = encode_trace(trace, ~(1 << i), &samples);
+    uint64_t num = 0;
+
+    for (const frame_state_t& frame : trace)
+      num += (frame.present >> i) & 1;
+    if (num)
+      printf("  %-16s %5.1f bits per sample\n", names[i], 8.0 * (bytes - without) / num);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  report("indoor", synthetic_trace(1, 2, 1));
+  report("indoor, averaged", synthetic_trace(2, 2, 3));
+  report("outdoor", synthetic_trace(3, 12, 1));
+
+  for (int i = 1; i < argc; i++) {
+    trace_t trace;
+
+    if (!load_trace(argv[i], &trace))
+      return 1;
+    report(argv[i], trace);
+  }
+
+  return 0;
+}
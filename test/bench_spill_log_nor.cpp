@@ -0,0 +1,105 @@
+// Benchmark of the spill log in a raw NOR flash region (spill_log_nor.cpp) on
+// the simulated flash, kept in a file like the flash of a node would be
+// reports the cost of a spill, the flash wear per frame, and the cost of the
+// recovery scan and a full replay after boot
+#include "project_config.h"
+#undef SPILL_LOG_NOR_FLASH
+#define SPILL_LOG_NOR_FLASH (1)
+
+#include "../rtc_mem.cpp"
+#include "../spill_log_nor.cpp"
+
+#include <chrono>
+#include <random>
+
+#include "host.h"
+
+#define BENCH_WRAPS       (20)
+#define BENCH_NOR_CYCLES  (100000) // erase cycles that a NOR sector is rated for
+
+const uint32_t preinit_magic = 0xaa55aa55;
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+static double elapsed_us(bench_clock_t::time_point start)
+{
+  return std::chrono::duration<double, std::micro>(bench_clock_t::now() - start).count();
+}
+
+// store one wake frame of slowly changing readings
+static void store_wake(std::mt19937& rng, uint64_t *timestamp, unsigned wake)
+{
+  std::normal_distribution<double> noise(0.0, 1.0);
+
+  store_reading(SENSOR_TEMPERATURE, 21000 + 3000*sin(wake / 720.0) + 20*noise(rng));
+  store_reading(SENSOR_HUMIDITY, 45000 + 5000*cos(wake / 900.0) + 50*noise(rng));
+  store_reading(SENSOR_PRESSURE, 101325 + 30*noise(rng));
+  store_reading(SENSOR_BATTERY_VOLTAGE, 3900 - wake / 1000 + (rng() % 3));
+  *timestamp += 60000 + (rng() % 40);
+  store_timestamp(*timestamp);
+}
+
+int main(void)
+{
+  std::mt19937 rng(1);
+  reading_frame_t frame;
+  uint64_t timestamp = 0;
+  unsigned wake = 0;
+  unsigned spills = 0;
+  unsigned frames = 0;
+  unsigned replayed = 0;
+  uint32_t max_erases = 0;
+  uint32_t erases = 0;
+  double spill_us = 0;
+  double us;
+
+  host_flash_open("build/bench_nor.bin");
+  host_flash_erase();
+  invalidate_rtc();
+
+  // spill whenever the ring buffer is full, until the region wrapped a few times
+  while (spills < BENCH_WRAPS * NOR_NUM_SECTORS * NOR_SECTOR_SIZE / NOR_PAGE_SIZE) {
+    while (readings_free_space() >= RTC_FRAME_MAX_SIZE)
+      store_wake(rng, &timestamp, wake++);
+    frames += rtc_mem[RTC_MEM_NUM_FRAMES];
+
+    auto start = bench_clock_t::now();
+    spill_readings();
+    spill_us += elapsed_us(start);
+    spills++;
+  }
+
+  for (uint32_t i = 0; i < NOR_NUM_SECTORS; i++) {
+    uint32_t count = host_flash_erase_count(NOR_LOG_START_ADDR / NOR_SECTOR_SIZE + i);
+
+    erases += count;
+    max_erases = std::max(max_erases, count);
+  }
+
+  printf("spill:  %u frames per record, %6.1f us per spill, %.1f flash writes per spill\n",
+         frames / spills, spill_us / spills, (double)host_flash_program_count() / spills);
+  printf("wear:   %5.1f bytes programmed and %.4f sector erases per frame\n",
+         (double)host_flash_program_bytes() / frames, (double)erases / frames);
+  printf("        the region lasts %.0f million frames (%u sector erase cycles)\n",
+         (double)frames / max_erases * BENCH_NOR_CYCLES / 1e6, BENCH_NOR_CYCLES);
+
+  // cold boot with a full region
+  nor_scanned = false;
+  nor_acked = 0;
+  nor_dirty = false;
+  auto start = bench_clock_t::now();
+  nor_scan();
+  us = elapsed_us(start);
+  printf("scan:   %6.1f us after boot\n", us);
+
+  // replay every spilled frame, as an upload would
+  start = bench_clock_t::now();
+  while (spill_log_rewind(&frame, replayed)) {
+    while (read_frame(&frame))
+      replayed++;
+  }
+  us = elapsed_us(start);
+  printf("replay: %u frames, %6.1f us per frame\n", replayed, us / replayed);
+
+  return 0;
+}
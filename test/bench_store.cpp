@@ -0,0 +1,58 @@
+// Benchmark of storing wake frames in the RTC memory ring buffer once it is full
+// every frame then evicts the oldest one (drop_frame), which should cost the same
+// regardless of the size of the ring buffer
+// built once for each NUM_STORAGE_WORDS in BENCH_STORE_WORDS (see Makefile)
+#include "project_config.h"
+#undef NUM_STORAGE_WORDS
+#define NUM_STORAGE_WORDS (BENCH_STORAGE_WORDS)
+
+#include "../rtc_mem.cpp"
+
+#include <chrono>
+#include <random>
+
+#define BENCH_WAKES (200000)
+
+const uint32_t preinit_magic = 0xaa55aa55;
+
+// no frames were spilled
+bool spill_log_last_timestamp(uint64_t *timestamp)
+{
+  (void)timestamp;
+  return false;
+}
+
+// store one wake frame of slowly changing readings
+static void store_wake(std::mt19937& rng, uint64_t *timestamp, unsigned wake)
+{
+  std::normal_distribution<double> noise(0.0, 1.0);
+
+  store_reading(SENSOR_TEMPERATURE, 21000 + 3000*sin(wake / 720.0) + 20*noise(rng));
+  store_reading(SENSOR_HUMIDITY, 45000 + 5000*cos(wake / 900.0) + 50*noise(rng));
+  store_reading(SENSOR_PRESSURE, 101325 + 30*noise(rng));
+  store_reading(SENSOR_BATTERY_VOLTAGE, 3900 - wake / 1000 + (rng() % 3));
+  *timestamp += 60000 + (rng() % 40);
+  store_timestamp(*timestamp);
+}
+
+int main(void)
+{
+  std::mt19937 rng(1);
+  uint64_t timestamp = 0;
+  unsigned wake = 0;
+
+  invalidate_rtc();
+
+  // fill the ring buffer, after that every frame evicts one
+  while (readings_free_space() >= RTC_FRAME_MAX_SIZE)
+    store_wake(rng, &timestamp, wake++);
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < BENCH_WAKES; i++)
+    store_wake(rng, &timestamp, wake++);
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  printf("NUM_STORAGE_WORDS %4u: %4u frames buffered, %6.1f ns per stored frame\n",
+         (unsigned)NUM_STORAGE_WORDS, (unsigned)rtc_mem[RTC_MEM_NUM_FRAMES], ns / BENCH_WAKES);
+  return 0;
+}
@@ -0,0 +1,161 @@
+// Stand-in for the report server of the node-red flows (see report_server.h)
+#include "report_server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REPORT_V3_SEQUENCE_OFFSET (44) // offset of the sequence in report_v3_header_t
+#define REPORT_V3_HEADER_SIZE     (48)
+
+typedef std::chrono::steady_clock server_clock_t;
+
+typedef struct pending_response_s {
+  server_clock_t::time_point due;
+  std::string response;
+} pending_response_t;
+
+
+ReportServer::ReportServer(respond_t respond) : _respond(respond), _delay_ms(0), _stop(false)
+{
+  struct sockaddr_in addr = {};
+  socklen_t len = sizeof(addr);
+  int one = 1;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if ((0 != bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr))) || (0 != listen(_listen_fd, 4)) ||
+      (0 != getsockname(_listen_fd, (struct sockaddr*)&addr, &len))) {
+    perror("report server");
+    exit(1);
+  }
+  _port = ntohs(addr.sin_port);
+  _thread = std::thread(&ReportServer::run, this);
+}
+
+ReportServer::~ReportServer()
+{
+  _stop = true;
+  _thread.join();
+  close(_listen_fd);
+}
+
+std::vector<std::string> ReportServer::messages()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  return _messages;
+}
+
+void ReportServer::clear()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  _messages.clear();
+}
+
+// connections are served one at a time, like the node connects
+void ReportServer::run()
+{
+  while (!_stop) {
+    struct pollfd p = {_listen_fd, POLLIN, 0};
+    int one = 1;
+    int fd;
+
+    if ((poll(&p, 1, 10) <= 0) || ((fd = accept(_listen_fd, NULL, NULL)) < 0))
+      continue;
+    // each response goes out when it is due, not with the next one
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    serve(fd);
+    close(fd);
+  }
+}
+
+void ReportServer::serve(int fd)
+{
+  std::deque<pending_response_t> pending;
+  std::vector<uint32_t> received; // sequence numbers beyond the contiguous prefix
+  uint32_t next_sequence = 0;
+  std::string data;
+  bool open = true;
+
+  while (!_stop && (open || !pending.empty())) {
+    struct pollfd p = {fd, POLLIN, 0};
+    int timeout = 5;
+    char buf[1024];
+    size_t len;
+
+    if (!pending.empty()) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(pending.front().due - server_clock_t::now()).count();
+      timeout = std::max<long>(0, std::min<long>(timeout, wait));
+    }
+
+    if (open && (poll(&p, 1, timeout) > 0)) {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+      if (n <= 0)
+        open = false;
+      else
+        data.append(buf, n);
+    } else if (!open) {
+      usleep(timeout * 1000);
+    }
+
+    // split off every complete message
+    for (;;) {
+      std::string msg, response;
+
+      if (is_binary(data)) {
+        if (data.size() < 4)
+          break;
+        len = 4 + ((uint8_t)data[2] | ((uint8_t)data[3] << 8));
+        if (data.size() < len)
+          break;
+      } else {
+        len = data.find('\0');
+        if (std::string::npos == len)
+          break;
+        len++;
+      }
+      msg = data.substr(0, is_binary(data) ? len : len - 1);
+      data.erase(0, len);
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _messages.push_back(msg);
+      }
+
+      response = _respond(msg);
+      if (is_binary(msg) && (msg.size() >= REPORT_V3_HEADER_SIZE) && (0 == response.compare(0, 2, "OK"))) {
+        uint32_t sequence;
+
+        memcpy(&sequence, &msg[REPORT_V3_SEQUENCE_OFFSET], sizeof(sequence));
+        if ((sequence >= next_sequence) && (std::find(received.begin(), received.end(), sequence) == received.end()))
+          received.push_back(sequence);
+        while (std::find(received.begin(), received.end(), next_sequence) != received.end()) {
+          received.erase(std::find(received.begin(), received.end(), next_sequence));
+          next_sequence++;
+        }
+        response += ",ack=" + std::to_string(next_sequence - 1);
+      }
+      if (!response.empty())
+        pending.push_back({server_clock_t::now() + std::chrono::milliseconds(_delay_ms), response + '\0'});
+    }
+
+    while (!pending.empty() && (pending.front().due <= server_clock_t::now())) {
+      if (open)
+        send(fd, pending.front().response.data(), pending.front().response.size(), MSG_NOSIGNAL);
+      pending.pop_front();
+    }
+  }
+}
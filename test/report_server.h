@@ -0,0 +1,160 @@
+// Stand-in for the report server of the node-red flows on a loopback TCP port,
+// for the host tests of the uploads (see report_server.cpp)
+// the stream of each connection is split into json messages (null-terminated)
+// and binary version 3 messages, which are answered after an injected delay
+// the helpers below set up the readings of the node that uploads to it
+#ifndef _REPORT_SERVER_H_
+#define _REPORT_SERVER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ESP8266WiFi.h>
+
+#include "host.h"
+#include "rtc_mem.h"
+#include "spill_log.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ReportServer {
+public:
+  // returns the response to a message without the terminator, binary messages
+  // that are answered with "OK..." are acknowledged by sequence number like the
+  // flows do (",ack=<n>" is appended)
+  typedef std::function<std::string(const std::string& msg)> respond_t;
+
+  ReportServer(respond_t respond);
+  ~ReportServer();
+
+  uint16_t port() const { return _port; }
+  void set_delay(unsigned ms) { _delay_ms = ms; } // added to every response, like a round trip
+  std::vector<std::string> messages();            // every message received so far
+  void clear();
+
+  static bool is_binary(const std::string& msg) { return !msg.empty() && (0xA5 == (uint8_t)msg[0]); }
+
+private:
+  void run();
+  void serve(int fd);
+
+  respond_t _respond;
+  int _listen_fd;
+  uint16_t _port;
+  std::atomic<unsigned> _delay_ms;
+  std::atomic<bool> _stop;
+  std::mutex _lock;
+  std::vector<std::string> _messages;
+  std::thread _thread;
+};
+
+// the readings of a wake frame
+typedef struct test_frame_s {
+  uint64_t timestamp;
+  uint8_t  present;
+  int32_t  values[RTC_FRAME_NUM_VALUES]; // only the present ones are set
+
+  bool operator==(const struct test_frame_s& o) const { return (timestamp == o.timestamp) && (present == o.present) && !memcmp(values, o.values, sizeof(values)); }
+} test_frame_t;
+
+typedef std::vector<test_frame_t> frames_t;
+
+
+// start a node that lost power, with the stand-in server as its report server
+static inline void boot(const ReportServer& server)
+{
+  host_persistent_clear();
+  host_config.report_host_port = server.port();
+  host_config.temp_calib = -0.75f;
+  host_config.humidity_calib = 2.5f;
+  host_config.pressure_calib = 1.0f / 3;
+  host_config.battery_calib = 0.125f;
+  invalidate_rtc();
+  load_rtc_config();
+  ((flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME])->millis = 10ULL * 24 * 3600 * 1000;
+  WiFi.mode(WIFI_STA);
+}
+
+// store num frames that cover every encoding of the timestamps and values,
+// the ring buffer is spilled whenever it is full, so that the upload replays
+// the spill log first and needs several batches
+// frames without values aren't sent, they are left out of the returned frames
+static inline frames_t store_frames(unsigned num)
+{
+  frames_t frames;
+  uint64_t timestamp = uptime() - 5ULL * 24 * 3600 * 1000;
+
+  for (unsigned n = 0; n < num; n++) {
+    test_frame_t f = {};
+
+    if (readings_free_space() < RTC_FRAME_MAX_SIZE)
+      spill_readings();
+
+    // mostly periodic wakes, with jitter, missed wakes, and a clock correction
+    timestamp += 60000 + ((n % 5) ? 0 : n % 3);
+    if (0 == n % 17)
+      timestamp += 3600000ULL * (n % 4);
+    if (0 == n % 23)
+      timestamp -= 1000;
+    f.timestamp = timestamp;
+
+    // slowly changing values, with steps, sign changes, and the extremes
+    if (n % 11) {
+      f.values[SENSOR_TEMPERATURE - SENSOR_TEMPERATURE] = -2000 + 37 * (int32_t)n - ((n % 13) ? 0 : 5000);
+      f.values[SENSOR_HUMIDITY - SENSOR_TEMPERATURE] = 45000 + ((n & 1) ? 3 : -3);
+      f.present |= (1 << (SENSOR_TEMPERATURE - SENSOR_TEMPERATURE)) | (1 << (SENSOR_HUMIDITY - SENSOR_TEMPERATURE));
+    }
+    if (n % 3) {
+      f.values[SENSOR_PRESSURE - SENSOR_TEMPERATURE] = 101325 + (int32_t)(n % 7);
+      f.present |= 1 << (SENSOR_PRESSURE - SENSOR_TEMPERATURE);
+    }
+    if (0 == n % 7) {
+      f.values[SENSOR_PARTICLE_1_0 - SENSOR_TEMPERATURE] = (n % 14) ? INT32_MAX : INT32_MIN;
+      f.values[SENSOR_PARTICLE_2_5 - SENSOR_TEMPERATURE] = (int32_t)(n * 1000003u);
+      f.present |= (1 << (SENSOR_PARTICLE_1_0 - SENSOR_TEMPERATURE)) | (1 << (SENSOR_PARTICLE_2_5 - SENSOR_TEMPERATURE));
+    }
+    if (n % 19) {
+      f.values[SENSOR_BATTERY_VOLTAGE - SENSOR_TEMPERATURE] = 4100 - (int32_t)n / 4;
+      f.present |= 1 << (SENSOR_BATTERY_VOLTAGE - SENSOR_TEMPERATURE);
+    }
+
+    for (unsigned i = 0; i < RTC_FRAME_NUM_VALUES; i++)
+      if (f.present & (1 << i))
+        store_reading((sensor_type_t)(SENSOR_TEMPERATURE + i), f.values[i]);
+    store_timestamp(f.timestamp);
+    if (f.present)
+      frames.push_back(f);
+  }
+
+  return frames;
+}
+
+// helper to find the value of a member of a flat json object, without the
+// quotes of a string
+static inline std::string json_value(const std::string& msg, const char *name)
+{
+  std::string key = std::string("\"") + name + "\":";
+  size_t start = msg.find(key);
+  size_t end;
+
+  if (std::string::npos == start)
+    return "";
+  start += key.size();
+  if ('"' == msg[start])
+    return msg.substr(start + 1, msg.find('"', start + 1) - start - 1);
+  end = msg.find_first_of(",}", start);
+  return msg.substr(start, end - start);
+}
+
+static inline std::string respond_ok(const std::string& msg)
+{
+  (void)msg;
+  return "OK";
+}
+
+#endif /* _REPORT_SERVER_H_ */
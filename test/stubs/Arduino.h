@@ -0,0 +1,151 @@
+// Host stand-in for the parts of the ESP8266 Arduino core that the firmware uses
+// (see stubs.cpp), just enough to build the hardware-independent modules with g++
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <ctype.h>
+#include <string>
+#include <functional>
+#include <algorithm>
+using std::isnan;
+
+typedef int32_t int32;
+#define HEX 16
+#define DEC 10
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define LED_BUILTIN 2
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define F(x) x
+#define PROGMEM
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void yield(void);
+
+static inline char* utoa(unsigned val, char *buf, int base)
+{
+  sprintf(buf, (16 == base) ? "%x" : "%u", val);
+  return buf;
+}
+
+static inline char* itoa(int val, char *buf, int base)
+{
+  sprintf(buf, (16 == base) ? "%x" : "%d", val);
+  return buf;
+}
+
+static inline char* dtostrf(double val, signed char width, unsigned char prec, char *buf)
+{
+  sprintf(buf, "%*.*f", width, prec, val);
+  return buf;
+}
+
+// String over std::string, only the members that the firmware uses
+class String {
+public:
+  String() {}
+  String(const char *c) { if (c) s = c; }
+  String(const std::string& c) : s(c) {}
+  String(char c) : s(1, c) {}
+  String(int v, unsigned char base=10) { char b[40]; snprintf(b, sizeof(b), (16 == base) ? "%x" : "%d", v); s = b; }
+  String(unsigned v, unsigned char base=10) { char b[40]; snprintf(b, sizeof(b), (16 == base) ? "%x" : "%u", v); s = b; }
+  String(long v, unsigned char base=10) { char b[40]; snprintf(b, sizeof(b), (16 == base) ? "%lx" : "%ld", v); s = b; }
+  String(unsigned long v, unsigned char base=10) { char b[40]; snprintf(b, sizeof(b), (16 == base) ? "%lx" : "%lu", v); s = b; }
+  String(double v, unsigned char decimals=2) { char b[64]; snprintf(b, sizeof(b), "%.*f", decimals, v); s = b; }
+  const char* c_str() const { return s.c_str(); }
+  unsigned length() const { return s.size(); }
+  String& operator+=(const String& o) { s += o.s; return *this; }
+  String& operator+=(const char *o) { s += o; return *this; }
+  String& operator+=(char o) { s += o; return *this; }
+  bool operator==(const String& o) const { return s == o.s; }
+  bool operator==(const char *o) const { return o ? (s == o) : s.empty(); }
+  bool operator!=(const String& o) const { return s != o.s; }
+  bool operator!=(const char *o) const { return !(*this == o); }
+  char operator[](unsigned i) const { return s[i]; }
+  char charAt(unsigned i) const { return s[i]; }
+  void setCharAt(unsigned i, char c) { s[i] = c; }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  bool startsWith(const char *p) const { return 0 == s.rfind(p, 0); }
+  bool endsWith(const char *p) const { size_t l = strlen(p); return (s.size() >= l) && (0 == s.compare(s.size() - l, l, p)); }
+  bool equals(const String& o) const { return s == o.s; }
+  bool equals(const char *o) const { return *this == o; }
+  int indexOf(char c, unsigned from=0) const { size_t p = s.find(c, from); return (std::string::npos == p) ? -1 : (int)p; }
+  String substring(unsigned a) const { return String(s.substr(a)); }
+  String substring(unsigned a, unsigned b) const { return String(s.substr(a, b - a)); }
+  void remove(unsigned i) { s.erase(i); }
+  void trim() { s.erase(0, s.find_first_not_of(" \t\r\n")); s.erase(s.find_last_not_of(" \t\r\n") + 1); }
+  void reserve(unsigned n) { s.reserve(n); }
+
+private:
+  std::string s;
+};
+inline String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+inline String operator+(const String& a, const char *b) { String r(a); r += b; return r; }
+inline String operator+(const char *a, const String& b) { String r(a); r += b; return r; }
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buf, size_t len) { size_t n = 0; while ((n < len) && write(buf[n])) n++; return n; }
+  size_t write(const char *str) { return write((const uint8_t*)str, strlen(str)); }
+  size_t print(const String& s) { return write((const uint8_t*)s.c_str(), s.length()); }
+  size_t print(const char *s) { return write((const uint8_t*)s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v, int base=10) { return print(String(v, base)); }
+  size_t print(unsigned v, int base=10) { return print(String(v, base)); }
+  size_t print(long v, int base=10) { return print(String(v, base)); }
+  size_t print(unsigned long v, int base=10) { return print(String(v, base)); }
+  size_t print(double v, int decimals=2) { return print(String(v, decimals)); }
+  template<class T> size_t println(T v) { size_t n = print(v); return n + print("\n"); }
+  template<class T> size_t println(T v, int b) { size_t n = print(v, b); return n + print("\n"); }
+  size_t println() { return print("\n"); }
+  size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  virtual void flush() {}
+};
+
+// the reads wait up to the timeout for more data, like the core's Stream
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() { return -1; }
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+  size_t readBytes(uint8_t *buf, size_t len) { size_t n = 0; int c; while ((n < len) && ((c = timedRead()) >= 0)) buf[n++] = c; return n; }
+  size_t readBytes(char *buf, size_t len) { return readBytes((uint8_t*)buf, len); }
+  size_t readBytesUntil(char term, char *buf, size_t len) { size_t n = 0; int c; while ((n < len) && ((c = timedRead()) >= 0) && (c != (uint8_t)term)) buf[n++] = c; return n; }
+  String readStringUntil(char term) { String s; int c; while (((c = timedRead()) >= 0) && (c != (uint8_t)term)) s += (char)c; return s; }
+
+protected:
+  int timedRead() { unsigned long start = millis(); do { int c = read(); if (c >= 0) return c; yield(); } while (millis() - start < _timeout); return -1; }
+  unsigned long _timeout = 1000;
+};
+
+// serial output is discarded unless HOST_SERIAL is set in the environment
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t c) override;
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+};
+extern HardwareSerial Serial;
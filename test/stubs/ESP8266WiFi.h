@@ -0,0 +1,73 @@
+// Host stand-in for the WiFi station and WiFiClient (see wifi_stub.cpp)
+// the station is always connected, clients are TCP connections of the host
+#pragma once
+#include <Arduino.h>
+#include <IPAddress.h>
+#include <user_interface.h>
+
+typedef enum {
+  WL_NO_SHIELD = 255,
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL,
+  WL_SCAN_COMPLETED,
+  WL_CONNECTED,
+  WL_CONNECT_FAILED,
+  WL_CONNECTION_LOST,
+  WL_DISCONNECTED,
+} wl_status_t;
+
+typedef enum { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 } WiFiMode_t;
+
+class ESP8266WiFiClass {
+public:
+  static void preinitWiFiOff() {}
+  bool mode(WiFiMode_t m) { _mode = m; return true; }
+  WiFiMode_t getMode() { return _mode; }
+  void setOutputPower(float) {}
+  void persistent(bool p) { _persistent = p; }
+  bool getPersistent() { return _persistent; }
+  bool reconnect() { return true; }
+  bool disconnect(bool = false) { return true; }
+  wl_status_t begin(const char *, const char * = NULL, int32_t = 0, const uint8_t * = NULL, bool = true) { return WL_CONNECTED; }
+  bool config(IPAddress, IPAddress, IPAddress, IPAddress = IPAddress(), IPAddress = IPAddress()) { return true; }
+  wl_status_t status() { return (WIFI_STA & _mode) ? WL_CONNECTED : WL_DISCONNECTED; }
+  bool isConnected() { return WL_CONNECTED == status(); }
+  String SSID() { return "host"; }
+  String psk() { return ""; }
+  uint8_t* BSSID() { static uint8_t bssid[6] = {2, 0, 0, 0, 0, 1}; return bssid; }
+  int32_t channel() { return 1; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+  IPAddress gatewayIP() { return IPAddress(127, 0, 0, 1); }
+  IPAddress subnetMask() { return IPAddress(255, 0, 0, 0); }
+  IPAddress dnsIP(uint8_t = 0) { return IPAddress(127, 0, 0, 1); }
+  int hostByName(const char *name, IPAddress& result);
+
+private:
+  WiFiMode_t _mode = WIFI_OFF;
+  bool _persistent = true;
+};
+extern ESP8266WiFiClass WiFi;
+
+// reads don't block (read() returns -1 without data), like the core's WiFiClient
+class WiFiClient : public Stream {
+public:
+  WiFiClient() {}
+  ~WiFiClient() { stop(); }
+  WiFiClient(const WiFiClient&) = delete;
+  WiFiClient& operator=(const WiFiClient&) = delete;
+
+  int connect(IPAddress ip, uint16_t port);
+  uint8_t connected();
+  void stop();
+  void setNoDelay(bool nodelay);
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t len) override;
+  using Print::write;
+  void flush() override {}
+
+private:
+  int _fd = -1;
+};
@@ -0,0 +1,25 @@
+// Host stand-in for EspClass, RTC user memory and the flash are kept in host
+// memory (the flash in a file with host_flash_open, see host.h)
+// the running image is the start of the flash, updates go to Update
+#pragma once
+#include <Arduino.h>
+
+typedef enum { RF_DEFAULT=0, RF_CAL=1, RF_NO_CAL=2, RF_DISABLED=4 } RFMode;
+
+class EspClass {
+public:
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+  String getResetReason() { return "Deep-Sleep Wake"; }
+  void deepSleepInstant(uint64_t, RFMode=RF_DEFAULT) {}
+  uint32_t getChipId() { return 0x123456; }
+  bool flashEraseSector(uint32_t sector);
+  bool flashWrite(uint32_t address, const uint32_t *data, size_t size);
+  bool flashRead(uint32_t address, uint32_t *data, size_t size);
+  uint32_t getSketchSize();
+  String getSketchMD5();
+  bool updateSketch(Stream& in, uint32_t size, bool restartOnFail = false, bool restartOnSuccess = true);
+  void reset();
+};
+extern EspClass ESP;
+
@@ -0,0 +1,16 @@
+#pragma once
+#include <Arduino.h>
+
+class IPAddress {
+public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : v(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  IPAddress(uint32_t x) : v(x) {}
+  operator uint32_t() const { return v; }
+  bool fromString(const char *s) { unsigned a, b, c, d; char e; if (4 != sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &e)) return false; v = a | (b << 8) | (c << 16) | (d << 24); return true; }
+  bool isSet() const { return 0 != v; }
+  String toString() const { char b[20]; snprintf(b, sizeof(b), "%u.%u.%u.%u", v & 255, (v >> 8) & 255, (v >> 16) & 255, v >> 24); return String(b); }
+
+private:
+  uint32_t v = 0;
+};
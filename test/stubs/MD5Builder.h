@@ -0,0 +1,22 @@
+// Host stand-in for MD5Builder (see update_stub.cpp)
+#pragma once
+#include <Arduino.h>
+
+class MD5Builder {
+public:
+  void begin();
+  void add(const uint8_t *data, size_t len);
+  void add(const char *str) { add((const uint8_t*)str, strlen(str)); }
+  void calculate();
+  void getBytes(uint8_t *out) { memcpy(out, _digest, sizeof(_digest)); }
+  void getChars(char *out);
+  String toString() { char out[33]; getChars(out); return String(out); }
+
+private:
+  void transform(const uint8_t *block);
+
+  uint32_t _state[4];
+  uint64_t _len;
+  uint8_t  _buf[64];
+  uint8_t  _digest[16];
+};
@@ -0,0 +1,28 @@
+// Host stand-in for the OTA updater, the image is kept in host memory
+// (see host_update_image in host.h) and verified against the md5sum in end()
+#pragma once
+#include <Arduino.h>
+#include <MD5Builder.h>
+#include <vector>
+
+class UpdaterClass {
+public:
+  bool begin(size_t size);
+  size_t write(uint8_t *data, size_t len);
+  bool end(bool evenIfRemaining = false);
+  bool setMD5(const char *md5);
+  void onProgress(std::function<void(size_t, size_t)> fn) { _progress = fn; }
+  void printError(Print& out) { out.println(_error ? _error : "no error"); }
+
+private:
+  friend const std::vector<uint8_t>& host_update_image(void);
+  friend bool host_update_done(void);
+
+  std::vector<uint8_t> _image;
+  size_t _size = 0;
+  String _md5;
+  const char *_error = NULL;
+  bool _done = false;
+  std::function<void(size_t, size_t)> _progress;
+};
+extern UpdaterClass Update;
@@ -0,0 +1,24 @@
+// Host stand-in for WiFiManager, the config portal is never started
+#pragma once
+#include <Arduino.h>
+
+class WiFiManagerParameter {
+public:
+  WiFiManagerParameter(const char *id, const char *placeholder, const char *value, int length, const char *custom = "")
+    : _id(id), _value(value ? value : "") { (void)placeholder; (void)length; (void)custom; }
+  const char* getID() { return _id; }
+  const char* getValue() { return _value.c_str(); }
+
+private:
+  const char *_id;
+  String _value;
+};
+
+class WiFiManager {
+public:
+  void addParameter(WiFiManagerParameter *) {}
+  void setConfigPortalTimeout(unsigned long) {}
+  void setBreakAfterConfig(bool) {}
+  void setSaveConfigCallback(void (*)(void)) {}
+  bool startConfigPortal(const char *) { return false; }
+};
@@ -0,0 +1,2 @@
+// a git build of the core, see project_config.h
+#pragma once
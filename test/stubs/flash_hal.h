@@ -0,0 +1,6 @@
+// 4MB flash with the "FS:1MB OTA:~1019KB" layout
+#pragma once
+#include <stdint.h>
+#define FLASH_SECTOR_SIZE 0x1000
+#define FS_PHYS_ADDR      (0x300000)
+#define FS_PHYS_SIZE      (0xFA000)
@@ -0,0 +1,33 @@
+// Hooks into the host stubs for the tests and benchmarks
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "persistent.h"
+
+/* Global Data Structures */
+extern persistent_config_t host_config; // returned by persistent_config()
+
+/* Function Prototypes */
+void host_persistent_clear(void);       // delete every persistent file
+
+// the flash is simulated as a NOR device: an erase sets a sector to 0xff and
+// programming can only clear bits
+void host_flash_open(const char *path); // keep the flash in a file instead of memory
+void host_flash_erase(void);            // erase the whole flash
+void host_flash_fail_after(long bytes); // the power fails after programming this many more bytes, an erase counts as one (-1 never)
+bool host_flash_failed(void);           // the power failed, the flash is inaccessible until the next host_flash_fail_after
+uint32_t host_flash_erase_count(uint32_t sector);
+uint32_t host_flash_program_count(void);
+uint32_t host_flash_program_bytes(void);
+
+// the running image is the first size bytes of the flash (getSketchSize, getSketchMD5)
+void host_sketch_size(uint32_t size);
+const std::vector<uint8_t>& host_update_image(void); // bytes written to Update
+bool host_update_done(void);            // Update.end() verified the image
+unsigned host_reset_count(void);        // calls of ESP.reset(), which returns on the host
+
+#endif /* _HOST_H_ */
@@ -0,0 +1,4 @@
+// Host stand-in for the lwIP TCP settings of the core
+#pragma once
+
+#define TCP_MSS 536
@@ -0,0 +1,102 @@
+// Host stand-in for persistent.cpp, the files are kept in memory
+#include <Arduino.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "persistent.h"
+#include "host.h"
+
+persistent_config_t host_config = {
+  "iotsp-test",     // node_name
+  "127.0.0.1",      // report_host_name
+  1880,             // report_host_port
+  DEFAULT_SLEEP_CLOCK_ADJ,
+  0.0f, 0.0f, 0.0f, 0.0f,
+  (int)DEFAULT_SLEEP_TIME_MS,
+  DEFAULT_HIGH_WATER_SLOT,
+};
+
+// the file names are looked up without a temporary std::string, so that the
+// stub doesn't count against the heap use of the uploads (test_json_writer)
+static std::map<std::string, std::vector<uint8_t>, std::less<>> host_files;
+
+
+void host_persistent_clear(void)
+{
+  host_files.clear();
+}
+
+void persistent_init(void)
+{
+}
+
+const persistent_config_t* persistent_config(void)
+{
+  return &host_config;
+}
+
+String persistent_read(const char *filename)
+{
+  return persistent_read(filename, String(""));
+}
+
+String persistent_read(const char *filename, String default_value)
+{
+  auto file = host_files.find(filename);
+
+  if (file == host_files.end())
+    return default_value;
+  return String(std::string(file->second.begin(), file->second.end()));
+}
+
+bool persistent_write(const char *filename, String data)
+{
+  return persistent_write(filename, (const uint8_t*)data.c_str(), data.length());
+}
+
+bool persistent_write(const char *filename, const uint8_t *buf, size_t size)
+{
+  host_files[filename].assign(buf, buf + size);
+  return true;
+}
+
+bool persistent_append(const char *filename, const uint8_t *buf, size_t size)
+{
+  host_files[filename].insert(host_files[filename].end(), buf, buf + size);
+  return true;
+}
+
+size_t persistent_read(const char *filename, size_t offset, uint8_t *buf, size_t size)
+{
+  auto file = host_files.find(filename);
+
+  if ((file == host_files.end()) || (offset >= file->second.size()))
+    return 0;
+  size = std::min(size, file->second.size() - offset);
+  memcpy(buf, file->second.data() + offset, size);
+  return size;
+}
+
+size_t persistent_size(const char *filename)
+{
+  auto file = host_files.find(filename);
+
+  return (file == host_files.end()) ? 0 : file->second.size();
+}
+
+size_t persistent_free(void)
+{
+  return 0x100000;
+}
+
+bool persistent_remove(const char *filename)
+{
+  auto file = host_files.find(filename);
+
+  if (file == host_files.end())
+    return false;
+  host_files.erase(file);
+  return true;
+}
@@ -0,0 +1,210 @@
+// Host implementations of the core functions declared in the stub headers
+#include <Arduino.h>
+#include <Esp.h>
+
+#include <flash_hal.h>
+
+#include <chrono>
+#include <stdarg.h>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "host.h"
+
+#define HOST_RTC_WORDS      (1024)
+#define HOST_FLASH_SIZE     (0x400000)
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static const auto host_start = std::chrono::steady_clock::now();
+static const bool host_serial = (NULL != getenv("HOST_SERIAL"));
+static uint32_t host_rtc[HOST_RTC_WORDS];
+static uint8_t *host_flash = NULL;
+static std::vector<uint32_t> host_erases(HOST_FLASH_SIZE / FLASH_SECTOR_SIZE);
+static uint32_t host_programs = 0;
+static uint32_t host_program_bytes = 0;
+static long host_budget = -1;
+static bool host_power_failed = false;
+
+
+unsigned long millis(void)
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - host_start).count();
+}
+
+unsigned long micros(void)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - host_start).count();
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield(void)
+{
+  std::this_thread::yield();
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  if (host_serial)
+    fputc(c, stderr);
+  return 1;
+}
+
+size_t Print::printf(const char *fmt, ...)
+{
+  char buf[512];
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (len < 0)
+    return 0;
+  return write((const uint8_t*)buf, ((size_t)len < sizeof(buf)) ? len : sizeof(buf) - 1);
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (offset + size / sizeof(uint32_t) > HOST_RTC_WORDS)
+    return false;
+  memcpy(data, &host_rtc[offset], size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (offset + size / sizeof(uint32_t) > HOST_RTC_WORDS)
+    return false;
+  memcpy(&host_rtc[offset], data, size);
+  return true;
+}
+
+
+// the flash is kept in anonymous memory unless a file was opened
+static uint8_t* flash(void)
+{
+  if (!host_flash) {
+    host_flash = (uint8_t*)mmap(NULL, HOST_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memset(host_flash, 0xff, HOST_FLASH_SIZE);
+  }
+  return host_flash;
+}
+
+void host_flash_open(const char *path)
+{
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  off_t len = (fd >= 0) ? lseek(fd, 0, SEEK_END) : -1;
+  uint8_t *data;
+
+  if ((fd < 0) || (len < 0) || (ftruncate(fd, HOST_FLASH_SIZE) < 0)) {
+    perror(path);
+    exit(1);
+  }
+  data = (uint8_t*)mmap(NULL, HOST_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == data) {
+    perror(path);
+    exit(1);
+  }
+
+  // the part of the file that is new starts out erased
+  if (len < HOST_FLASH_SIZE)
+    memset(data + len, 0xff, HOST_FLASH_SIZE - len);
+  if (host_flash)
+    munmap(host_flash, HOST_FLASH_SIZE);
+  host_flash = data;
+}
+
+void host_flash_erase(void)
+{
+  memset(flash(), 0xff, HOST_FLASH_SIZE);
+  std::fill(host_erases.begin(), host_erases.end(), 0);
+  host_programs = 0;
+  host_program_bytes = 0;
+}
+
+void host_flash_fail_after(long bytes)
+{
+  host_budget = bytes;
+  host_power_failed = false;
+}
+
+bool host_flash_failed(void)
+{
+  return host_power_failed;
+}
+
+uint32_t host_flash_erase_count(uint32_t sector)
+{
+  return host_erases[sector];
+}
+
+uint32_t host_flash_program_count(void)
+{
+  return host_programs;
+}
+
+uint32_t host_flash_program_bytes(void)
+{
+  return host_program_bytes;
+}
+
+// an erase counts as one byte of the budget, if the power fails during an erase
+// only the first half of the sector is erased
+bool EspClass::flashEraseSector(uint32_t sector)
+{
+  uint8_t *dst = flash() + sector * FLASH_SECTOR_SIZE;
+
+  if (host_power_failed || ((sector + 1) * FLASH_SECTOR_SIZE > HOST_FLASH_SIZE))
+    return false;
+  if (0 == host_budget) {
+    memset(dst, 0xff, FLASH_SECTOR_SIZE / 2);
+    host_power_failed = true;
+    return false;
+  }
+  if (host_budget > 0)
+    host_budget--;
+  memset(dst, 0xff, FLASH_SECTOR_SIZE);
+  host_erases[sector]++;
+  return true;
+}
+
+// if the power fails while programming, the bytes before it were programmed
+bool EspClass::flashWrite(uint32_t address, const uint32_t *data, size_t size)
+{
+  const uint8_t *src = (const uint8_t*)data;
+  uint8_t *dst = flash() + address;
+
+  if (host_power_failed || (address % 4) || (size % 4) || (address + size > HOST_FLASH_SIZE))
+    return false;
+  host_programs++;
+  for (size_t i = 0; i < size; i++) {
+    if (0 == host_budget) {
+      host_power_failed = true;
+      return false;
+    }
+    if (host_budget > 0)
+      host_budget--;
+    dst[i] &= src[i];
+    host_program_bytes++;
+  }
+  return true;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t *data, size_t size)
+{
+  if (host_power_failed || (address % 4) || (size % 4) || (address + size > HOST_FLASH_SIZE))
+    return false;
+  memcpy(data, flash() + address, size);
+  return true;
+}
@@ -0,0 +1,232 @@
+// Host implementations of MD5Builder, the OTA updater, and the running image
+#include <Arduino.h>
+#include <Esp.h>
+#include <MD5Builder.h>
+#include <Updater.h>
+
+#include "host.h"
+
+UpdaterClass Update;
+
+static uint32_t host_sketch = 0x60000;
+static unsigned host_resets = 0;
+
+
+// MD5 (RFC 1321)
+#define MD5_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+void MD5Builder::begin()
+{
+  _state[0] = 0x67452301;
+  _state[1] = 0xefcdab89;
+  _state[2] = 0x98badcfe;
+  _state[3] = 0x10325476;
+  _len = 0;
+}
+
+void MD5Builder::add(const uint8_t *data, size_t len)
+{
+  while (len > 0) {
+    size_t used = _len % 64;
+    size_t n = std::min(len, 64 - used);
+
+    memcpy(&_buf[used], data, n);
+    _len += n;
+    data += n;
+    len -= n;
+    if (0 == _len % 64)
+      transform(_buf);
+  }
+}
+
+void MD5Builder::calculate()
+{
+  uint64_t bits = _len * 8;
+  uint8_t pad = 0x80;
+  uint8_t zero = 0;
+  uint8_t length[8];
+
+  for (unsigned i = 0; i < 8; i++)
+    length[i] = bits >> (8 * i);
+  add(&pad, 1);
+  while (56 != _len % 64)
+    add(&zero, 1);
+  add(length, sizeof(length));
+
+  for (unsigned i = 0; i < 16; i++)
+    _digest[i] = _state[i / 4] >> (8 * (i % 4));
+}
+
+void MD5Builder::getChars(char *out)
+{
+  for (unsigned i = 0; i < 16; i++)
+    sprintf(&out[2*i], "%02x", _digest[i]);
+}
+
+void MD5Builder::transform(const uint8_t *block)
+{
+  static const uint32_t k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+  };
+  static const uint8_t r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+  uint32_t m[16];
+  uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+
+  for (unsigned i = 0; i < 16; i++)
+    m[i] = block[4*i] | (block[4*i+1] << 8) | (block[4*i+2] << 16) | ((uint32_t)block[4*i+3] << 24);
+
+  for (unsigned i = 0; i < 64; i++) {
+    uint32_t f, g, t;
+
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5*i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3*i + 5) % 16;
+    } else {
+      f = c ^ (b | ~d);
+      g = (7*i) % 16;
+    }
+    t = d;
+    d = c;
+    c = b;
+    b += MD5_ROTL(a + f + k[i] + m[g], r[4*(i/16) + i%4]);
+    a = t;
+  }
+
+  _state[0] += a;
+  _state[1] += b;
+  _state[2] += c;
+  _state[3] += d;
+}
+
+
+bool UpdaterClass::begin(size_t size)
+{
+  _image.clear();
+  _size = size;
+  _error = NULL;
+  _done = false;
+  return true;
+}
+
+size_t UpdaterClass::write(uint8_t *data, size_t len)
+{
+  if (_image.size() + len > _size) {
+    _error = "image larger than announced";
+    return 0;
+  }
+  _image.insert(_image.end(), data, data + len);
+  if (_progress)
+    _progress(_image.size(), _size);
+  return len;
+}
+
+bool UpdaterClass::end(bool evenIfRemaining)
+{
+  MD5Builder md5;
+
+  (void)evenIfRemaining;
+  if (_image.size() != _size) {
+    _error = "image incomplete";
+    return false;
+  }
+
+  md5.begin();
+  md5.add(_image.data(), _image.size());
+  md5.calculate();
+  if (_md5.length() && !(md5.toString() == _md5)) {
+    _error = "md5sum mismatch";
+    return false;
+  }
+  _done = true;
+  return true;
+}
+
+bool UpdaterClass::setMD5(const char *md5)
+{
+  if (32 != strlen(md5))
+    return false;
+  _md5 = md5;
+  return true;
+}
+
+const std::vector<uint8_t>& host_update_image(void)
+{
+  return Update._image;
+}
+
+bool host_update_done(void)
+{
+  return Update._done;
+}
+
+
+void host_sketch_size(uint32_t size)
+{
+  host_sketch = size;
+}
+
+unsigned host_reset_count(void)
+{
+  return host_resets;
+}
+
+uint32_t EspClass::getSketchSize()
+{
+  return host_sketch;
+}
+
+String EspClass::getSketchMD5()
+{
+  MD5Builder md5;
+  uint32_t buf[64];
+
+  md5.begin();
+  for (uint32_t offset = 0; offset < host_sketch; offset += sizeof(buf)) {
+    uint32_t len = std::min<uint32_t>(sizeof(buf), host_sketch - offset);
+
+    flashRead(offset, buf, sizeof(buf));
+    md5.add((const uint8_t*)buf, len);
+  }
+  md5.calculate();
+  return md5.toString();
+}
+
+bool EspClass::updateSketch(Stream& in, uint32_t size, bool restartOnFail, bool restartOnSuccess)
+{
+  uint8_t buf[512];
+  uint32_t n;
+
+  if (!Update.begin(size))
+    return false;
+  for (n = 0; n < size; ) {
+    size_t len = in.readBytes(buf, std::min<uint32_t>(sizeof(buf), size - n));
+
+    if ((0 == len) || (len != Update.write(buf, len)))
+      break;
+    n += len;
+  }
+  if ((n == size) && Update.end())
+    return restartOnSuccess ? (reset(), true) : true;
+  if (restartOnFail)
+    reset();
+  return false;
+}
+
+// the firmware continues after the reset, the tests check the count
+void EspClass::reset()
+{
+  host_resets++;
+}
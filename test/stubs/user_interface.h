@@ -0,0 +1,14 @@
+// Host stand-in for the SDK station config, there is no stored config
+#pragma once
+#include <stdint.h>
+
+struct station_config {
+  uint8_t ssid[32];
+  uint8_t password[64];
+  uint8_t bssid_set;
+  uint8_t bssid[6];
+};
+
+bool wifi_station_get_config(struct station_config *config);
+bool wifi_station_get_config_default(struct station_config *config);
+bool wifi_station_set_config_current(struct station_config *config);
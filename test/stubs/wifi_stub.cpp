@@ -0,0 +1,132 @@
+// Host implementations of the WiFi station and WiFiClient over TCP sockets
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+ESP8266WiFiClass WiFi;
+
+
+int ESP8266WiFiClass::hostByName(const char *name, IPAddress& result)
+{
+  struct addrinfo hints = {};
+  struct addrinfo *info;
+
+  hints.ai_family = AF_INET;
+  if (0 != getaddrinfo(name, NULL, &hints, &info))
+    return 0;
+  result = IPAddress((uint32_t)((struct sockaddr_in*)info->ai_addr)->sin_addr.s_addr);
+  freeaddrinfo(info);
+  return 1;
+}
+
+bool wifi_station_get_config(struct station_config *config)
+{
+  memset(config, 0, sizeof(*config));
+  return true;
+}
+
+bool wifi_station_get_config_default(struct station_config *config)
+{
+  return wifi_station_get_config(config);
+}
+
+bool wifi_station_set_config_current(struct station_config *config)
+{
+  (void)config;
+  return true;
+}
+
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+  struct sockaddr_in addr = {};
+
+  stop();
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (uint32_t)ip;
+  _fd = socket(AF_INET, SOCK_STREAM, 0);
+  if ((_fd < 0) || (0 != ::connect(_fd, (struct sockaddr*)&addr, sizeof(addr)))) {
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+// like the core, small writes are delayed (Nagle) unless this is set after connecting
+void WiFiClient::setNoDelay(bool nodelay)
+{
+  int val = nodelay;
+
+  if (_fd >= 0)
+    setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
+// like the core, a client stays connected while there is data to read
+uint8_t WiFiClient::connected()
+{
+  char c;
+
+  if (_fd < 0)
+    return 0;
+  if (0 == recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT)) {
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+void WiFiClient::stop()
+{
+  if (_fd >= 0)
+    close(_fd);
+  _fd = -1;
+}
+
+int WiFiClient::available()
+{
+  int n = 0;
+
+  if ((_fd < 0) || (ioctl(_fd, FIONREAD, &n) < 0))
+    return 0;
+  return n;
+}
+
+int WiFiClient::read()
+{
+  uint8_t c;
+
+  if ((_fd < 0) || (1 != recv(_fd, &c, 1, MSG_DONTWAIT)))
+    return -1;
+  return c;
+}
+
+int WiFiClient::peek()
+{
+  uint8_t c;
+
+  if ((_fd < 0) || (1 != recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT)))
+    return -1;
+  return c;
+}
+
+size_t WiFiClient::write(const uint8_t *buf, size_t len)
+{
+  size_t n = 0;
+
+  while ((_fd >= 0) && (n < len)) {
+    ssize_t sent = send(_fd, buf + n, len - n, MSG_NOSIGNAL);
+
+    if (sent <= 0)
+      break;
+    n += sent;
+  }
+  return n;
+}
@@ -0,0 +1,23 @@
+// Minimal checks for the host tests, main() returns test_result()
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+
+static unsigned test_failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+static inline int test_result(const char *name)
+{
+  printf("%s: %s\n", name, test_failures ? "FAILED" : "OK");
+  return test_failures ? 1 : 0;
+}
+
+#endif /* _TEST_H_ */
@@ -0,0 +1,246 @@
+// Firmware updates through apply_firmware: a patch made by firmware_patch.py
+// rebuilds the new image from the running one in flash, a full image is
+// written as it is, and an image or patch that doesn't match is rejected
+#include "project_config.h"
+
+#include "../rtc_mem.cpp"
+#include "../spill_log.cpp"
+#include "../connectivity.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include <flash_hal.h>
+
+#include "host.h"
+#include "test.h"
+
+#define IMAGE_SIZE     (0x28000)
+#define OLD_IMAGE      "build/fw_old.bin"
+#define NEW_IMAGE      "build/fw_new.bin"
+#define PATCH          "build/fw.patch"
+
+typedef std::vector<uint8_t> bytes_t;
+
+// a download that has arrived completely
+class BufferStream : public Stream {
+public:
+  BufferStream(const bytes_t& data) : _data(data) { setTimeout(0); }
+  int available() override { return _data.size() - _pos; }
+  int read() override { return (_pos < _data.size()) ? _data[_pos++] : -1; }
+  int peek() override { return (_pos < _data.size()) ? _data[_pos] : -1; }
+  size_t write(uint8_t c) override { (void)c; return 0; }
+  using Print::write;
+
+private:
+  const bytes_t& _data;
+  size_t _pos = 0;
+};
+
+const uint32_t preinit_magic = 0xfeedf00d;
+
+
+// start a node that lost power
+static void boot(void)
+{
+  host_persistent_clear();
+  invalidate_rtc();
+  load_rtc_config();
+}
+
+// an image with the statistics of machine code: short repeated sequences
+// and addresses that point into the image
+static bytes_t make_image(uint32_t seed, size_t size)
+{
+  bytes_t image;
+  uint32_t x = seed;
+
+  while (image.size() < size) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    if ((x & 7) == 0) {
+      uint32_t addr = 0x40200000 + (x >> 8) % size;
+
+      image.insert(image.end(), (uint8_t*)&addr, (uint8_t*)&addr + sizeof(addr));
+    } else if ((x & 7) < 3) {
+      const uint8_t prologue[] = {0x12, 0xc1, 0xf0, 0x09, 0x31, 0xc9, 0x21, 0x02, 0x61};
+
+      image.insert(image.end(), prologue, prologue + (x >> 28) % sizeof(prologue) + 1);
+    } else {
+      image.push_back(x >> 24);
+    }
+  }
+  image.resize(size);
+  return image;
+}
+
+// the next version: a few functions changed, code inserted and removed,
+// which moves the addresses behind it, and a longer tail
+static bytes_t make_new_image(const bytes_t& old)
+{
+  bytes_t image(old);
+  bytes_t inserted = make_image(7, 0x900);
+
+  for (size_t i = 0x1000; i < 0x1040; i += 3)
+    image[i] ^= 0x5a;
+  image.insert(image.begin() + 0x8000, inserted.begin(), inserted.end());
+  image.erase(image.begin() + 0x14000, image.begin() + 0x14400);
+  for (size_t i = 0x18000; i + 4 <= image.size(); i += 0x40) {
+    uint32_t addr;
+
+    memcpy(&addr, &image[i], sizeof(addr));
+    addr += 0x500;
+    memcpy(&image[i], &addr, sizeof(addr));
+  }
+  image.resize(image.size() + 0x1234, 0xa5);
+  return image;
+}
+
+static bool write_file(const char *path, const bytes_t& data)
+{
+  FILE *f = fopen(path, "wb");
+  bool ok = f && (data.size() == fwrite(data.data(), 1, data.size(), f));
+
+  if (f)
+    fclose(f);
+  return ok;
+}
+
+static bytes_t read_file(const char *path)
+{
+  bytes_t data;
+  FILE *f = fopen(path, "rb");
+  int c;
+
+  while (f && ((c = fgetc(f)) != EOF))
+    data.push_back(c);
+  if (f)
+    fclose(f);
+  return data;
+}
+
+static std::string md5(const bytes_t& data)
+{
+  MD5Builder md5;
+
+  md5.begin();
+  md5.add(data.data(), data.size());
+  md5.calculate();
+  return md5.toString().c_str();
+}
+
+// the running image is at the start of the flash
+static void install(const bytes_t& image)
+{
+  bytes_t padded(image);
+
+  padded.resize((image.size() + 3) & ~3, 0xff);
+  host_flash_erase();
+  for (uint32_t sector = 0; sector * FLASH_SECTOR_SIZE < padded.size(); sector++)
+    CHECK(ESP.flashEraseSector(sector));
+  CHECK(ESP.flashWrite(0, (const uint32_t*)padded.data(), padded.size()));
+  host_sketch_size(image.size());
+}
+
+// a download of size bytes, with the md5sum of the new image
+static firmware_stage_t stage(const std::string& md5sum, bool patch, size_t size)
+{
+  firmware_stage_t stage = {};
+
+  strncpy(stage.md5, md5sum.c_str(), sizeof(stage.md5) - 1);
+  stage.patch = patch;
+  stage.size = size;
+  return stage;
+}
+
+// returns true if apply_firmware wrote and verified an image, and reset the node
+static bool update(const bytes_t& download, const firmware_stage_t& stage)
+{
+  BufferStream in(download);
+  unsigned resets = host_reset_count();
+  bool status;
+
+  Update.begin(0); // forget the previous update
+  status = apply_firmware(in, &stage);
+  CHECK(host_reset_count() == resets + 1);
+  CHECK(status == host_update_done());
+  return status;
+}
+
+static void test_patch(const bytes_t& old_image, const bytes_t& new_image, const bytes_t& patch)
+{
+  CHECK(patch.size() < new_image.size() / 4);
+  install(old_image);
+  CHECK(update(patch, stage(md5(new_image), true, patch.size())));
+  CHECK(host_update_image() == new_image);
+}
+
+static void test_full_image(const bytes_t& old_image, const bytes_t& new_image)
+{
+  install(old_image);
+  CHECK(update(new_image, stage(md5(new_image), false, new_image.size())));
+  CHECK(host_update_image() == new_image);
+}
+
+// an image that doesn't match the md5sum from the server is never committed
+static void test_md5_mismatch(const bytes_t& old_image, const bytes_t& new_image, const bytes_t& patch)
+{
+  bytes_t corrupt(new_image);
+  bytes_t corrupt_patch(patch);
+
+  corrupt[corrupt.size() / 2] ^= 1;
+  install(old_image);
+  CHECK(!update(corrupt, stage(md5(new_image), false, corrupt.size())));
+
+  // a byte in the middle of the patch is either a diff or an extra byte, or
+  // it breaks the records
+  corrupt_patch[corrupt_patch.size() / 2] ^= 0x10;
+  CHECK(!update(corrupt_patch, stage(md5(new_image), true, corrupt_patch.size())));
+
+  CHECK(!update(patch, stage(md5(old_image), true, patch.size())));
+}
+
+// a patch for another image, or one that was cut off, writes nothing
+static void test_bad_patch(const bytes_t& old_image, const bytes_t& new_image, const bytes_t& patch)
+{
+  bytes_t other(old_image);
+  bytes_t truncated(patch.begin(), patch.end() - 100);
+
+  other[0x4000] ^= 0xff;
+  install(other);
+  CHECK(!update(patch, stage(md5(new_image), true, patch.size())));
+  CHECK(host_update_image().empty());
+
+  install(old_image);
+  CHECK(!update(truncated, stage(md5(new_image), true, patch.size())));
+  CHECK(host_update_image().size() < new_image.size());
+}
+
+int main(void)
+{
+  bytes_t old_image = make_image(1, IMAGE_SIZE);
+  bytes_t new_image = make_new_image(old_image);
+  bytes_t patch;
+
+  boot();
+
+  // the patch is made by the tool of the firmware directory
+  CHECK(write_file(OLD_IMAGE, old_image) && write_file(NEW_IMAGE, new_image));
+  CHECK(0 == system("python3 ../firmware_patch.py create " OLD_IMAGE " " NEW_IMAGE " " PATCH " >/dev/null"));
+  patch = read_file(PATCH);
+  CHECK(!patch.empty());
+  printf("patch: %zu bytes for an image of %zu bytes\n", patch.size(), new_image.size());
+
+  if (!patch.empty()) {
+    test_patch(old_image, new_image, patch);
+    test_md5_mismatch(old_image, new_image, patch);
+    test_bad_patch(old_image, new_image, patch);
+  }
+  test_full_image(old_image, new_image);
+
+  return test_result("test_firmware_patch");
+}
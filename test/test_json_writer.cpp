@@ -0,0 +1,300 @@
+// The json messages that are streamed through the fixed buffer of the report
+// writer (writer_begin...writer_end) are compared byte-for-byte to the same
+// messages assembled in Strings, the way transmit_readings, json_header and
+// send_command built them before, and the uploads are checked not to touch
+// the heap
+#include "project_config.h"
+
+#include "../rtc_mem.cpp"
+#include "../spill_log.cpp"
+#include "../connectivity.cpp"
+
+#include <new>
+#include <vector>
+
+#include "host.h"
+#include "report_server.h"
+#include "test.h"
+
+const uint32_t preinit_magic = 0x0badcafe;
+
+// operator new is counted on the thread of the test only, the server thread
+// allocates for every message it receives
+// the replacements are never inlined, the compiler would otherwise see free()
+// called on memory from operator new (-Wmismatched-new-delete)
+static thread_local bool count_allocs = false;
+static unsigned num_allocs = 0;
+
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+  void *p;
+
+  if (count_allocs)
+    num_allocs++;
+  p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t size) noexcept
+{
+  (void)size;
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t size) noexcept
+{
+  (void)size;
+  free(p);
+}
+
+// the uptime measurement of a received message
+static double sent_uptime(const std::string& msg)
+{
+  const char key[] = "{\"type\":\"uptime\",\"value\":";
+  size_t start = msg.find(key);
+
+  return (std::string::npos == start) ? 0.0 : strtod(msg.c_str() + start + strlen(key), NULL);
+}
+
+// json_header() before the report writer
+static String reference_header(void)
+{
+  String json;
+
+  json = "{\"version\":2,";
+  json += "\"node\":\"" + String(host_config.node_name) + "\",";
+  json += "\"firmware\":\"" + String(preinit_magic, HEX) + "\",";
+
+  return json;
+}
+
+// the readings messages of an upload, assembled the way transmit_readings did
+// before the report writer, from the frames that are waiting to be uploaded
+// the uptime and time offset depend on when the messages were sent, they are
+// taken from the messages (by index) that were received
+static std::vector<std::string> reference_readings(const std::vector<std::string>& received)
+{
+  std::vector<std::string> messages;
+  float calibrations[4] = {*(float*)&rtc_mem[RTC_MEM_TEMP_CAL], *(float*)&rtc_mem[RTC_MEM_HUMIDITY_CAL],
+                           *(float*)&rtc_mem[RTC_MEM_PRESSURE_CAL], *(float*)&rtc_mem[RTC_MEM_BATTERY_CAL]};
+  report_host_t *report_host = (report_host_t*)&rtc_mem[RTC_MEM_REPORT_HOST];
+  sht30_stats_t *sht30_stats = (sht30_stats_t*)&rtc_mem[RTC_MEM_SHT30_STATS];
+  reading_frame_t frame;
+  unsigned spilled = 0;
+  bool spill_done = false;
+
+  frame.index = 0;
+  frame.num_frames = 0;
+  while (true) {
+    const char typestrings[RTC_FRAME_NUM_VALUES][17] = {
+      "temperature",
+      "humidity",
+      "pressure",
+      "particles 1.0µm",
+      "particles 2.5µm",
+      "battery",
+    };
+    std::string sent = (messages.size() < received.size()) ? received[messages.size()] : "";
+    String json;
+
+    if ((frame.index == frame.num_frames) && !spill_done && !spill_log_rewind(&frame, spilled)) {
+      spill_done = true;
+      rewind_frames(&frame);
+    }
+    if (frame.index == frame.num_frames)
+      break;
+
+    // frames without measurements aren't sent
+    CHECK(read_frame(&frame));
+    if (!spill_done)
+      spilled++;
+    if (0 == frame.present)
+      continue;
+
+    json = reference_header();
+    json += "\"measurements\":[";
+
+    // format measurements
+    for (unsigned i = 0; i < RTC_FRAME_NUM_VALUES; i++) {
+      float calibrated_reading = frame.state.values[i]/1000.0;
+
+      if (0 == (frame.present & (1 << i)))
+        continue;
+
+      switch (SENSOR_TEMPERATURE + i) {
+        case SENSOR_TEMPERATURE:
+          calibrated_reading += calibrations[0];
+        break;
+
+        case SENSOR_HUMIDITY:
+          calibrated_reading += calibrations[1];
+        break;
+
+        case SENSOR_PRESSURE:
+          calibrated_reading += calibrations[2];
+        break;
+
+        case SENSOR_PARTICLE_1_0:
+        case SENSOR_PARTICLE_2_5:
+          calibrated_reading = frame.state.values[i] * 1000.0;
+        break;
+
+        case SENSOR_BATTERY_VOLTAGE:
+          calibrated_reading += calibrations[3];
+        break;
+      }
+
+      json += "{\"type\":\"";
+      json += typestrings[i];
+      json += "\",\"value\":";
+      json += String(calibrated_reading, 3);
+      json += "},";
+    }
+
+    // add a bonus "uptime" reading and the counters
+    if (spill_done && (frame.index == frame.num_frames)) {
+      json += "{\"type\":\"uptime\",";
+      json += "\"value\":" + String(sent_uptime(sent), 3);
+      json += "}";
+      json += ",{\"type\":\"dns_hits\",\"value\":" + String(report_host->dns_hits) + "}";
+      json += ",{\"type\":\"dns_misses\",\"value\":" + String(report_host->dns_misses) + "}";
+      json += ",{\"type\":\"sht30_low\",\"value\":" + String((unsigned)sht30_stats->rpt_low) + "}";
+      json += ",{\"type\":\"sht30_med\",\"value\":" + String((unsigned)sht30_stats->rpt_med) + "}";
+      json += ",{\"type\":\"sht30_high\",\"value\":" + String((unsigned)sht30_stats->rpt_high) + "}";
+      json += ",{\"type\":\"sht30_crc_errors\",\"value\":" + String((unsigned)sht30_stats->crc_errors) + "}";
+    } else if (json.endsWith("},")) {
+      json.remove(json.length()-1); // remove the extraneous comma
+    }
+
+    // close off the array of readings
+    json += "],";
+
+    // send the current calibration values in the last packet
+    if (spill_done && (frame.index == frame.num_frames)) {
+      json += "\"calibrations\":[";
+      json +=  "{\"type\":\"temperature\",\"value\":" + String(calibrations[0], 3) + "}";
+      json += ",{\"type\":\"humidity\",\"value\":" + String(calibrations[1], 3) + "}";
+      json += ",{\"type\":\"pressure\",\"value\":" + String(calibrations[2], 3) + "}";
+      json += ",{\"type\":\"battery\",\"value\":" + String(calibrations[3], 3) + "}";
+      json += "],";
+    }
+
+    // append a timestamp
+    json += "\"time_offset\":-";
+    json += String(json_value(sent, "time_offset").substr(1).c_str());
+
+    // terminate the json object
+    json += "}";
+
+    messages.push_back(json.c_str());
+  }
+
+  return messages;
+}
+
+// the readings messages of an upload that spans several batches, some of them
+// larger than a segment of the writer
+static void test_readings(void)
+{
+  ReportServer server(respond_ok);
+  report_host_t *report_host = (report_host_t*)&rtc_mem[RTC_MEM_REPORT_HOST];
+  sht30_stats_t *sht30_stats = (sht30_stats_t*)&rtc_mem[RTC_MEM_SHT30_STATS];
+  std::vector<std::string> received;
+  std::vector<std::string> expected;
+  bool segments = false;
+
+  boot(server);
+  store_frames(200);
+  report_host->dns_hits = 12;
+  report_host->dns_misses = 1;
+  sht30_stats->rpt_low = 100;
+  sht30_stats->crc_errors = 9;
+
+  // the expected messages are assembled before the upload releases the frames
+  // and resets the counters, with the times of the received messages
+  num_allocs = 0;
+  count_allocs = true;
+  upload_readings();
+  count_allocs = false;
+  received = server.messages();
+  CHECK(0 == rtc_mem[RTC_MEM_NUM_FRAMES]);
+
+  boot(server);
+  store_frames(200);
+  report_host->dns_hits = 12;
+  report_host->dns_misses = 1;
+  sht30_stats->rpt_low = 100;
+  sht30_stats->crc_errors = 9;
+  expected = reference_readings(received);
+
+  CHECK(received.size() > 1);
+  CHECK(expected.size() == received.size());
+  for (size_t i = 0; (i < expected.size()) && (i < received.size()); i++) {
+    if (expected[i] != received[i])
+      printf("expected: %s\nreceived: %s\n", expected[i].c_str(), received[i].c_str());
+    CHECK(expected[i] == received[i]);
+    segments |= (received[i].size() + 1 > REPORT_WRITER_SIZE);
+  }
+  CHECK(segments);
+  printf("heap allocations during the upload: %u\n", num_allocs);
+  CHECK(0 == num_allocs);
+}
+
+// the commands of the config updates
+static void test_commands(void)
+{
+  ReportServer server(respond_ok);
+  WiFiClient client;
+  std::string long_arg(2 * REPORT_WRITER_SIZE, 'x');
+  std::vector<std::string> received;
+  String expected[3];
+
+  boot(server);
+  CHECK(client.connect(IPAddress(127, 0, 0, 1), server.port()));
+
+  num_allocs = 0;
+  count_allocs = true;
+  CHECK(send_command(client, "get_config_manifest", ""));
+  CHECK(send_command(client, "get_configs", "node.cfg,sleep.cfg"));
+  CHECK(send_command(client, "delete_config", long_arg.c_str()));
+  count_allocs = false;
+  CHECK(0 == num_allocs);
+
+  expected[0] = reference_header() + "\"command\":\"get_config_manifest\",\"arg\":\"\"}";
+  expected[1] = reference_header() + "\"command\":\"get_configs\",\"arg\":\"node.cfg,sleep.cfg\"}";
+  expected[2] = reference_header() + "\"command\":\"delete_config\",\"arg\":\"" + String(long_arg.c_str()) + "\"}";
+
+  for (unsigned retry = 0; (retry < 100) && (server.messages().size() < 3); retry++)
+    delay(10);
+  received = server.messages();
+  CHECK(3 == received.size());
+  for (size_t i = 0; (i < 3) && (i < received.size()); i++)
+    CHECK(expected[i].c_str() == received[i]);
+  client.stop();
+}
+
+int main(void)
+{
+  test_readings();
+  test_commands();
+
+  return test_result("test_json_writer");
+}
@@ -0,0 +1,317 @@
+// Round trip of the readings uploads (transmit_readings) through the stand-in
+// report server: the binary version 3 messages are decoded independently of
+// rtc_mem.cpp, following the description of the frame format at frame_state_t,
+// and compared to the stored readings, as are the calibrated measurements of
+// the json (version 2) messages
+#include "project_config.h"
+
+#include "../rtc_mem.cpp"
+#include "../spill_log.cpp"
+#include "../connectivity.cpp"
+
+#include <math.h>
+
+#include <vector>
+
+#include "host.h"
+#include "report_server.h"
+#include "test.h"
+
+typedef struct bit_reader_s {
+  const uint8_t *data;
+  size_t size;
+  size_t bit;
+  bool overrun;
+} bit_reader_t;
+
+const uint32_t preinit_magic = 0x1f2e3d4c;
+
+static_assert(48 == sizeof(report_v3_header_t), "the stand-in server parses the header at fixed offsets");
+
+
+static uint64_t read_bits(bit_reader_t *r, unsigned num)
+{
+  uint64_t val = 0;
+
+  while (num--) {
+    if (r->bit >= 8 * r->size) {
+      r->overrun = true;
+      return 0;
+    }
+    val = (val << 1) | ((r->data[r->bit / 8] >> (7 - r->bit % 8)) & 1);
+    r->bit++;
+  }
+
+  return val;
+}
+
+static int64_t unzigzag(uint64_t val)
+{
+  return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+// decode num frames starting from an empty state, the timestamps are relative
+// to the first frame
+// returns the number of bytes of the frames
+static size_t decode_frames(const uint8_t *data, size_t size, unsigned num, frames_t *frames)
+{
+  bit_reader_t r = {data, size, 0, false};
+  int32_t values[RTC_FRAME_NUM_VALUES] = {};
+  unsigned widths[RTC_FRAME_NUM_VALUES] = {};
+  uint8_t present = 0;
+  int64_t timestamp = 0;
+  int64_t interval = 0;
+
+  for (unsigned n = 0; n < num; n++) {
+    test_frame_t f = {};
+    uint64_t dod;
+
+    if (read_bits(&r, 1))
+      present = read_bits(&r, RTC_FRAME_NUM_VALUES);
+
+    if (!read_bits(&r, 1))
+      dod = 0;
+    else if (!read_bits(&r, 1))
+      dod = read_bits(&r, 7);
+    else if (!read_bits(&r, 1))
+      dod = read_bits(&r, 9);
+    else if (!read_bits(&r, 1))
+      dod = read_bits(&r, 12);
+    else
+      dod = read_bits(&r, 48);
+    interval += unzigzag(dod);
+    timestamp += interval;
+
+    for (unsigned i = 0; i < RTC_FRAME_NUM_VALUES; i++) {
+      uint64_t delta = 0;
+
+      if (0 == (present & (1 << i)))
+        continue;
+      if (read_bits(&r, 1)) {
+        if (read_bits(&r, 1))
+          widths[i] = read_bits(&r, 4);
+        delta = read_bits(&r, 2 * (widths[i] + 1));
+      }
+      values[i] = (int32_t)((uint32_t)values[i] + (uint32_t)unzigzag(delta));
+      f.values[i] = values[i];
+    }
+
+    f.timestamp = timestamp;
+    f.present = present;
+    frames->push_back(f);
+    r.bit = (r.bit + 7) & ~7;
+  }
+  CHECK(!r.overrun);
+
+  return r.bit / 8;
+}
+
+// check that the decoded frames of a message match the next stored frames
+static void check_frames(const frames_t& decoded, const frames_t& expected, size_t *next)
+{
+  CHECK(*next + decoded.size() <= expected.size());
+  for (size_t i = 0; (i < decoded.size()) && (*next + i < expected.size()); i++) {
+    test_frame_t f = expected[*next + i];
+
+    f.timestamp -= expected[*next].timestamp;
+    CHECK(decoded[i] == f);
+  }
+  *next += decoded.size();
+}
+
+// check that the measurements of a json message are those of a stored frame,
+// calibrated with the calibrations of boot()
+static void check_json_frame(const std::string& msg, const test_frame_t& expected)
+{
+  const char *types[RTC_FRAME_NUM_VALUES] = {"temperature", "humidity", "pressure", "particles 1.0µm", "particles 2.5µm", "battery"};
+  const float calibrations[RTC_FRAME_NUM_VALUES] = {host_config.temp_calib, host_config.humidity_calib, host_config.pressure_calib,
+                                                    0.0f, 0.0f, host_config.battery_calib};
+
+  for (unsigned i = 0; i < RTC_FRAME_NUM_VALUES; i++) {
+    std::string key = std::string("{\"type\":\"") + types[i] + "\",\"value\":";
+    size_t start = msg.find(key);
+    double value;
+    double reference;
+
+    CHECK((std::string::npos != start) == !!(expected.present & (1 << i)));
+    if (std::string::npos == start)
+      continue;
+    value = strtod(msg.c_str() + start + key.size(), NULL);
+    if ((SENSOR_PARTICLE_1_0 - SENSOR_TEMPERATURE == i) || (SENSOR_PARTICLE_2_5 - SENSOR_TEMPERATURE == i))
+      reference = expected.values[i] * 1000.0;
+    else
+      reference = expected.values[i] / 1000.0 + calibrations[i];
+    CHECK(fabs(value - reference) <= 0.0005 + fabs(reference) * 1e-6);
+  }
+}
+
+static std::string respond_v3(const std::string& msg)
+{
+  return ReportServer::is_binary(msg) ? "OK" : "OK,v3";
+}
+
+// a node that knows the server accepts binary messages sends them all,
+// pipelined, and releases every frame once they are acknowledged
+static void test_binary(void)
+{
+  ReportServer server(respond_ok);
+  report_host_t *report_host = (report_host_t*)&rtc_mem[RTC_MEM_REPORT_HOST];
+  sht30_stats_t *sht30_stats = (sht30_stats_t*)&rtc_mem[RTC_MEM_SHT30_STATS];
+  uint32_t hash = 2166136261UL;
+  frames_t expected;
+  size_t next = 0;
+  uint64_t upload_start;
+  std::vector<std::string> messages;
+
+  boot(server);
+  for (const char *c = host_config.node_name; *c; c++)
+    hash = (hash ^ (uint8_t)*c) * 16777619UL;
+  expected = store_frames(400);
+  report_host->dns_hits = 7;
+  report_host->dns_misses = 2;
+  sht30_stats->rpt_low = 3;
+  sht30_stats->rpt_med = 4;
+  sht30_stats->rpt_high = 5;
+  sht30_stats->crc_errors = 6;
+  ((flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME])->flags |= FLAG_BIT_REPORT_V3;
+
+  upload_start = uptime();
+  upload_readings();
+  messages = server.messages();
+  CHECK(messages.size() > REPORT_WINDOW_SIZE);
+
+  for (size_t m = 0; m < messages.size(); m++) {
+    const std::string& msg = messages[m];
+    const uint8_t *data = (const uint8_t*)msg.data();
+    bool last = (m + 1 == messages.size());
+    report_v3_header_t header;
+    report_v3_sensor_stats_t stats;
+    report_v3_telemetry_t telemetry;
+    frames_t decoded;
+    size_t len;
+
+    CHECK(ReportServer::is_binary(msg) && (msg.size() >= sizeof(header)));
+    if (!ReportServer::is_binary(msg) || (msg.size() < sizeof(header)))
+      continue;
+    memcpy(&header, data, sizeof(header));
+    CHECK(3 == header.version);
+    CHECK(msg.size() == 4 + header.length);
+    CHECK(hash == header.node_hash);
+    CHECK(preinit_magic == header.firmware);
+    CHECK(REPORT_V3_TYPE_READINGS == header.type);
+    CHECK(m == header.sequence);
+    CHECK(host_config.temp_calib == header.calibrations[0]);
+    CHECK(host_config.humidity_calib == header.calibrations[1]);
+    CHECK(host_config.pressure_calib == header.calibrations[2]);
+    CHECK(host_config.battery_calib == header.calibrations[3]);
+    CHECK(header.flags == (last ? (REPORT_V3_FLAG_LAST | REPORT_V3_FLAG_TELEMETRY | REPORT_V3_FLAG_SENSOR_STATS) : 0));
+
+    len = decode_frames(data + sizeof(header), msg.size() - sizeof(header), header.num_frames, &decoded);
+    check_frames(decoded, expected, &next);
+
+    // the age of the oldest frame places the frames in time
+    CHECK(header.time_offset >= upload_start - expected[next - decoded.size()].timestamp);
+    CHECK(header.time_offset <= uptime() - expected[next - decoded.size()].timestamp);
+
+    if (!last) {
+      CHECK(sizeof(header) + len == msg.size());
+      continue;
+    }
+    CHECK(sizeof(header) + len + sizeof(stats) + sizeof(telemetry) == msg.size());
+    if (sizeof(header) + len + sizeof(stats) + sizeof(telemetry) != msg.size())
+      continue;
+    memcpy(&stats, data + sizeof(header) + len, sizeof(stats));
+    memcpy(&telemetry, data + sizeof(header) + len + sizeof(stats), sizeof(telemetry));
+    CHECK((3 == stats.sht30_low) && (4 == stats.sht30_med) && (5 == stats.sht30_high) && (6 == stats.sht30_crc_errors));
+    CHECK((7 == telemetry.dns_hits) && (2 == telemetry.dns_misses));
+    CHECK((header.uptime >= upload_start) && (header.uptime <= uptime()));
+  }
+  CHECK(next == expected.size());
+
+  // everything was acknowledged
+  reading_frame_t frame;
+  CHECK(0 == rtc_mem[RTC_MEM_NUM_FRAMES]);
+  CHECK(!spill_log_rewind(&frame, 0));
+  CHECK(0 == report_host->dns_hits);
+  CHECK(0 == sht30_stats->rpt_low);
+}
+
+// a server that doesn't accept binary messages gets the same frames in json
+// messages, one frame at a time
+static void test_json(void)
+{
+  ReportServer server(respond_ok);
+  frames_t expected;
+  uint64_t upload_start;
+  std::vector<std::string> messages;
+
+  boot(server);
+  expected = store_frames(150);
+  upload_start = uptime();
+  upload_readings();
+  messages = server.messages();
+  CHECK(messages.size() == expected.size());
+
+  for (size_t m = 0; (m < messages.size()) && (m < expected.size()); m++) {
+    const std::string& msg = messages[m];
+    bool last = (m + 1 == messages.size());
+    uint64_t time_offset;
+
+    CHECK(!ReportServer::is_binary(msg));
+    CHECK("2" == json_value(msg, "version"));
+    CHECK(host_config.node_name == json_value(msg, "node"));
+    check_json_frame(msg, expected[m]);
+    CHECK(last == (std::string::npos != msg.find("{\"type\":\"uptime\"")));
+    CHECK(last == !json_value(msg, "calibrations").empty());
+
+    // the age of the frame places it in time
+    CHECK('-' == json_value(msg, "time_offset")[0]);
+    time_offset = strtoull(json_value(msg, "time_offset").c_str() + 1, NULL, 10);
+    CHECK(time_offset >= upload_start - expected[m].timestamp);
+    CHECK(time_offset <= uptime() - expected[m].timestamp);
+  }
+  CHECK(0 == rtc_mem[RTC_MEM_NUM_FRAMES]);
+}
+
+// a server that advertises the binary protocol in response to json readings
+// gets the remaining batches in binary messages
+static void test_negotiation(void)
+{
+  ReportServer server(respond_v3);
+  frames_t expected;
+  size_t next = 0;
+  std::vector<std::string> messages;
+
+  boot(server);
+  expected = store_frames(150);
+  upload_readings();
+  messages = server.messages();
+  CHECK(messages.size() > 2);
+
+  for (size_t m = 0; m < messages.size(); m++) {
+    frames_t decoded;
+
+    CHECK(ReportServer::is_binary(messages[m]) == (m > 0));
+    if (ReportServer::is_binary(messages[m])) {
+      report_v3_header_t header;
+
+      memcpy(&header, messages[m].data(), sizeof(header));
+      CHECK(m - 1 == header.sequence);
+      decode_frames((const uint8_t*)messages[m].data() + sizeof(header), messages[m].size() - sizeof(header), header.num_frames, &decoded);
+      check_frames(decoded, expected, &next);
+    } else if (next < expected.size()) {
+      check_json_frame(messages[m], expected[next++]);
+    }
+  }
+  CHECK(next == expected.size());
+  CHECK(((flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME])->flags & FLAG_BIT_REPORT_V3);
+}
+
+int main(void)
+{
+  test_binary();
+  test_json();
+  test_negotiation();
+
+  return test_result("test_report_v3");
+}
@@ -0,0 +1,147 @@
+// Tests of the spill log in SPIFFS (spill_log.cpp): blocks that were only
+// partially written are skipped without losing the blocks appended after them
+#include "project_config.h"
+
+#include "../rtc_mem.cpp"
+#include "../spill_log.cpp"
+
+#include <vector>
+
+#include "host.h"
+#include "test.h"
+
+typedef std::vector<uint64_t> timestamps_t;
+
+const uint32_t preinit_magic = 0x5b1d5b1d;
+
+static uint64_t now = 0;
+
+
+// a node that lost power, the log in SPIFFS is kept unless it is cleared
+static void boot(bool clear)
+{
+  if (clear)
+    host_persistent_clear();
+  invalidate_rtc();
+  load_rtc_config();
+  if (!clear)
+    ((flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME])->flags |= FLAG_BIT_SPILL_LOG;
+  cursor_loaded = false;
+  cursor_dirty = false;
+  spill_offset = 0;
+  spill_acked = 0;
+}
+
+// spill a block of num frames, returns their timestamps
+static timestamps_t spill(unsigned num)
+{
+  timestamps_t timestamps;
+
+  for (unsigned i = 0; i < num; i++) {
+    now += 60000 + i % 3;
+    store_reading(SENSOR_TEMPERATURE, 2000 + (int32_t)(now / 60000) % 40);
+    store_reading(SENSOR_PRESSURE, 100000 + (int32_t)i);
+    store_timestamp(now);
+    timestamps.push_back(now);
+  }
+  CHECK(spill_readings());
+  return timestamps;
+}
+
+// cut the log off len bytes before its end, like a power failure during the last spill
+static void tear(size_t len)
+{
+  std::vector<uint8_t> log(persistent_size(PERSISTENT_SPILL_LOG));
+
+  CHECK(persistent_read(PERSISTENT_SPILL_LOG, 0, log.data(), log.size()) == log.size());
+  CHECK(persistent_write(PERSISTENT_SPILL_LOG, log.data(), log.size() - len));
+}
+
+// the timestamps of the frames that spill_log_rewind replays, skipping the first skip
+static timestamps_t replay(unsigned skip)
+{
+  timestamps_t timestamps;
+  reading_frame_t frame;
+
+  while (spill_log_rewind(&frame, skip)) {
+    while (read_frame(&frame)) {
+      timestamps.push_back(frame.state.timestamp);
+      skip++;
+    }
+  }
+  return timestamps;
+}
+
+static void append(timestamps_t *to, const timestamps_t& from)
+{
+  to->insert(to->end(), from.begin(), from.end());
+}
+
+// torn blocks at the start, in the middle, and at the end of the log
+static void test_torn(void)
+{
+  timestamps_t expected;
+  uint64_t last;
+
+  boot(true);
+  spill(30);
+  tear(100);
+  append(&expected, spill(25));
+  append(&expected, spill(40));
+  spill(35);
+  tear(sizeof(spill_header_t) + 10);
+  append(&expected, spill(20));
+  spill(30);
+  tear(1);
+
+  boot(false);
+  CHECK(spill_log_last_timestamp(&last) && (last == expected.back()));
+  CHECK(replay(0) == expected);
+
+  // the torn block at the start is passed when the first block is acknowledged
+  spill_log_ack(25);
+  spill_log_commit();
+  boot(false);
+  CHECK(replay(0) == timestamps_t(expected.begin() + 25, expected.end()));
+
+  // acknowledgements continue past the torn block in the middle
+  spill_log_ack(50);
+  spill_log_commit();
+  boot(false);
+  CHECK(replay(0) == timestamps_t(expected.begin() + 75, expected.end()));
+  CHECK(replay(5) == timestamps_t(expected.begin() + 80, expected.end()));
+
+  // the log is deleted once every block before the torn one at the end is acknowledged
+  spill_log_ack(10);
+  spill_log_commit();
+  CHECK(0 == persistent_size(PERSISTENT_SPILL_LOG));
+  CHECK(!spill_log_rewind(NULL, 0));
+}
+
+// a header that was written completely in front of data that wasn't is
+// followed by the next block, which must not be read as its frames
+static void test_torn_data(void)
+{
+  timestamps_t expected;
+
+  boot(true);
+  append(&expected, spill(30));
+  spill(45);
+  tear(40);
+  append(&expected, spill(45));
+  append(&expected, spill(10));
+
+  boot(false);
+  CHECK(replay(0) == expected);
+  spill_log_ack(expected.size());
+  spill_log_commit();
+  CHECK(0 == persistent_size(PERSISTENT_SPILL_LOG));
+}
+
+int main(void)
+{
+  test_torn();
+  test_torn_data();
+
+  return test_result("test_spill_log");
+}
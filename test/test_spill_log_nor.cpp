@@ -0,0 +1,307 @@
+// Tests of the spill log in a raw NOR flash region (spill_log_nor.cpp) on the
+// simulated flash: record allocation, wrapping, wear levelling, and recovery
+// from power failures at every point of a spill or an acknowledgement
+#include "project_config.h"
+#undef SPILL_LOG_NOR_FLASH
+#define SPILL_LOG_NOR_FLASH (1)
+
+#include "../rtc_mem.cpp"
+#include "../spill_log_nor.cpp"
+
+#include <vector>
+
+#include "host.h"
+#include "test.h"
+
+typedef struct test_frame_s {
+  uint64_t timestamp;
+  int32_t  values[RTC_FRAME_NUM_VALUES]; // indexed by (sensor_type_t - SENSOR_TEMPERATURE)
+
+  bool operator==(const struct test_frame_s& o) const { return (timestamp == o.timestamp) && !memcmp(values, o.values, sizeof(values)); }
+} test_frame_t;
+
+typedef std::vector<test_frame_t> frames_t;
+
+const uint32_t preinit_magic = 0xaa55aa55;
+
+static frames_t spilled;   // every frame that was spilled successfully, oldest first
+static frames_t pending;   // frames in the rtc mem ring buffer
+static uint64_t now = 0;
+
+
+// store num wake frames in the ring buffer, the values identify the frame
+static void store_frames(unsigned num)
+{
+  for (unsigned i = 0; i < num; i++) {
+    test_frame_t f = {};
+
+    now += 60000 + (now / 60000) % 7;
+    f.timestamp = now;
+    f.values[SENSOR_TEMPERATURE - SENSOR_TEMPERATURE] = 21000 + (int32_t)(now / 60000) % 50;
+    f.values[SENSOR_HUMIDITY - SENSOR_TEMPERATURE] = 45000 - (int32_t)(now / 60000) % 90;
+    f.values[SENSOR_PRESSURE - SENSOR_TEMPERATURE] = 101325 + (int32_t)(now / 30000) % 11;
+    f.values[SENSOR_BATTERY_VOLTAGE - SENSOR_TEMPERATURE] = 3900;
+    for (unsigned type = SENSOR_TEMPERATURE; type < SENSOR_TIMESTAMP_OFFS; type++) {
+      if (f.values[type - SENSOR_TEMPERATURE])
+        store_reading((sensor_type_t)type, f.values[type - SENSOR_TEMPERATURE]);
+    }
+    store_timestamp(now);
+    pending.push_back(f);
+  }
+}
+
+static bool spill(unsigned num)
+{
+  store_frames(num);
+  if (!spill_readings())
+    return false;
+  spilled.insert(spilled.end(), pending.begin(), pending.end());
+  pending.clear();
+  return true;
+}
+
+// decode every unacknowledged frame of the log, as an upload would
+static frames_t replay(void)
+{
+  reading_frame_t frame;
+  frames_t frames;
+  unsigned skip = 0;
+
+  while (spill_log_rewind(&frame, skip)) {
+    while (read_frame(&frame)) {
+      test_frame_t f = {};
+
+      f.timestamp = frame.state.timestamp;
+      for (unsigned i = 0; i < RTC_FRAME_NUM_VALUES; i++) {
+        if (frame.present & (1 << i))
+          f.values[i] = frame.state.values[i];
+      }
+      frames.push_back(f);
+      skip++;
+    }
+  }
+
+  return frames;
+}
+
+static void ack(unsigned num)
+{
+  spill_log_ack(num);
+  spill_log_commit();
+}
+
+// restart the firmware, a power loss also clears the rtc memory
+static void boot(bool power_lost)
+{
+  nor_scanned = false;
+  nor_acked = 0;
+  nor_dirty = false;
+  if (power_lost) {
+    invalidate_rtc();
+    pending.clear();
+  }
+}
+
+// start over with an erased flash
+static void format(void)
+{
+  host_flash_fail_after(-1);
+  host_flash_erase();
+  spilled.clear();
+  boot(true);
+}
+
+// true if a is the end of b
+static bool is_suffix(const frames_t& a, const frames_t& b)
+{
+  return (a.size() <= b.size()) && std::equal(a.begin(), a.end(), b.end() - a.size());
+}
+
+// check that the records from the tail to the head are page aligned and don't
+// cross sector boundaries
+static void check_records(void)
+{
+  nor_record_hdr_t hdr;
+  uint32_t offset = nor_tail;
+  unsigned num = 0;
+
+  while ((offset != nor_head) && (num++ < NOR_LOG_SIZE / NOR_PAGE_SIZE)) {
+    CHECK(nor_read(offset, &hdr, sizeof(hdr)));
+    CHECK(0 == (offset % NOR_PAGE_SIZE));
+    if (NOR_ERASED == hdr.seq) {
+      offset = ((offset / NOR_SECTOR_SIZE + 1) % NOR_NUM_SECTORS) * NOR_SECTOR_SIZE;
+      continue;
+    }
+    CHECK((offset % NOR_SECTOR_SIZE) + hdr.num_pages * NOR_PAGE_SIZE <= NOR_SECTOR_SIZE);
+    offset = nor_next_record(offset, &hdr);
+  }
+  CHECK(offset == nor_head);
+}
+
+// records of any size are replayed in order, acknowledged frames are not sent
+// again, also after a restart
+static void test_allocator(void)
+{
+  unsigned total = 0;
+
+  format();
+  for (unsigned i = 1; i <= 40; i++) {
+    CHECK(spill(1 + (i * 7) % RTC_MAX_FRAMES % 60));
+    total += 1 + (i * 7) % RTC_MAX_FRAMES % 60;
+  }
+  check_records();
+  CHECK(replay() == spilled);
+
+  // acknowledgements across records
+  ack(25);
+  ack(70);
+  CHECK(replay() == frames_t(spilled.begin() + 95, spilled.end()));
+  boot(false);
+  CHECK(replay() == frames_t(spilled.begin() + 95, spilled.end()));
+  boot(true);
+  CHECK(replay() == frames_t(spilled.begin() + 95, spilled.end()));
+
+  // the uptime continues from the newest spilled frame after a power loss
+  CHECK(uptime() >= spilled.back().timestamp);
+
+  ack(total - 95);
+  CHECK(replay().empty());
+}
+
+// a full region drops its oldest sector, the newest frames are kept
+static void test_wrap(void)
+{
+  size_t max_frames = 0;
+
+  format();
+  for (unsigned i = 0; i < 3 * NOR_NUM_SECTORS * NOR_SECTOR_SIZE / NOR_PAGE_SIZE; i++) {
+    frames_t frames;
+
+    CHECK(spill(20));
+    if (0 == i % 97) {
+      check_records();
+      frames = replay();
+      CHECK(is_suffix(frames, spilled));
+      max_frames = std::max(max_frames, frames.size());
+    }
+  }
+  boot(true);
+  CHECK(is_suffix(replay(), spilled));
+
+  // only the sectors at the head are ever lost
+  CHECK(max_frames >= 20 * (NOR_NUM_SECTORS - 2) * (NOR_SECTOR_SIZE / NOR_PAGE_SIZE) / 2);
+}
+
+// a log that is uploaded after every few spills wears the sectors evenly
+static void test_wear(void)
+{
+  uint32_t min_erases = UINT32_MAX;
+  uint32_t max_erases = 0;
+
+  format();
+  for (unsigned i = 0; i < 10 * NOR_NUM_SECTORS * NOR_SECTOR_SIZE / NOR_PAGE_SIZE; i++) {
+    CHECK(spill(5 + i % 40));
+    if (3 == i % 4) {
+      frames_t frames = replay();
+
+      CHECK(frames.size() == spilled.size());
+      ack(frames.size());
+      spilled.clear();
+    }
+  }
+
+  for (uint32_t i = 0; i < NOR_NUM_SECTORS; i++) {
+    min_erases = std::min(min_erases, host_flash_erase_count(NOR_LOG_START_ADDR / NOR_SECTOR_SIZE + i));
+    max_erases = std::max(max_erases, host_flash_erase_count(NOR_LOG_START_ADDR / NOR_SECTOR_SIZE + i));
+  }
+  printf("sector erases: min %u, max %u\n", min_erases, max_erases);
+  CHECK(min_erases > 0);
+  CHECK(max_erases - min_erases <= 1);
+
+  // nothing outside of the region was touched
+  CHECK(0 == host_flash_erase_count(NOR_LOG_START_ADDR / NOR_SECTOR_SIZE - 1));
+  CHECK(0 == host_flash_erase_count((NOR_LOG_START_ADDR + NOR_LOG_SIZE) / NOR_SECTOR_SIZE));
+}
+
+// the power fails after every possible number of programmed bytes of a spill,
+// with the head at every position of a sector, then the log has either all of
+// the new record or none of it, and keeps working
+static void test_power_fail_spill(void)
+{
+  unsigned cases = 0;
+
+  for (unsigned fill = 0; fill < NOR_SECTOR_SIZE / NOR_PAGE_SIZE + 2; fill++) {
+    for (long budget = 0; ; budget += 7) {
+      frames_t before, after;
+      size_t acked;
+      bool done;
+
+      format();
+      for (unsigned i = 0; i < fill; i++)
+        spill(10);
+      acked = std::min<size_t>(4, spilled.size());
+      ack(acked);
+      before = replay();
+
+      host_flash_fail_after(budget);
+      done = spill(12);
+      host_flash_fail_after(-1);
+      boot(true);
+      after = replay();
+      cases++;
+
+      if (done) {
+        CHECK(after == frames_t(spilled.begin() + acked, spilled.end()));
+      } else {
+        CHECK(after == before); // the frames were lost with the rtc memory
+      }
+
+      CHECK(spill(3));
+      after = replay();
+      CHECK(after == frames_t(spilled.begin() + acked, spilled.end()));
+      check_records();
+      if (done)
+        break;
+    }
+  }
+  printf("power failures during a spill: %u\n", cases);
+}
+
+// the power fails while an acknowledgement is programmed, then at most the
+// acknowledged frames are dropped, and never a record that wasn't acknowledged
+static void test_power_fail_ack(void)
+{
+  for (unsigned num = 1; num <= 60; num += 3) {
+    for (long budget = 0; budget < 16; budget++) {
+      frames_t before, after;
+
+      format();
+      for (unsigned i = 0; i < 5; i++)
+        spill(10);
+      ack(3);
+      before = replay();
+
+      host_flash_fail_after(budget);
+      ack(num);
+      host_flash_fail_after(-1);
+      boot(true);
+      after = replay();
+
+      CHECK(is_suffix(after, before));
+      CHECK(after.size() >= before.size() - std::min<size_t>(num, before.size()));
+    }
+  }
+}
+
+int main(void)
+{
+  host_flash_open("build/nor.bin");
+
+  test_allocator();
+  test_wrap();
+  test_wear();
+  test_power_fail_spill();
+  test_power_fail_ack();
+
+  return test_result("test_spill_log_nor");
+}
@@ -0,0 +1,233 @@
+// Upload time of the readings against the stand-in report server with an
+// injected round trip time, json messages (one frame each) are sent one at a
+// time while the binary version 3 messages are pipelined (REPORT_WINDOW_SIZE),
+// the release of exactly the acknowledged frames when a message is lost, and
+// the release of the frames without measurements, which aren't sent
+#include "project_config.h"
+
+#include "../rtc_mem.cpp"
+#include "../spill_log.cpp"
+#include "../connectivity.cpp"
+
+#include <chrono>
+#include <vector>
+
+#include "host.h"
+#include "report_server.h"
+#include "test.h"
+
+#define NUM_FRAMES      (800)
+#define NUM_JSON_FRAMES (50)  // json uploads take a round trip per frame
+#define NUM_EMPTY       (20)
+#define LOST_SEQUENCE   (2)
+
+const uint32_t preinit_magic = 0x600dcafe;
+
+static const unsigned rtts[] = {0, 20, 50};
+
+
+// start a node with num frames of readings, which uploads to server
+static void boot(const ReportServer& server, unsigned num, bool v3)
+{
+  boot(server);
+  store_frames(num);
+  if (v3)
+    ((flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME])->flags |= FLAG_BIT_REPORT_V3;
+}
+
+// store num frames without measurements after the newest frame, like the
+// wakes of a node whose sensors are absent
+static void store_empty_frames(unsigned num)
+{
+  uint64_t timestamp = ((frame_state_t*)&rtc_mem[RTC_MEM_FRAME_LAST])->timestamp;
+
+  for (unsigned n = 0; n < num; n++) {
+    if (readings_free_space() < RTC_FRAME_MAX_SIZE)
+      CHECK(spill_readings());
+    timestamp += 60000;
+    store_timestamp(timestamp);
+  }
+}
+
+// the frames that are waiting to be uploaded
+static unsigned num_pending(void)
+{
+  reading_frame_t frame;
+  unsigned num = 0;
+
+  while (spill_log_rewind(&frame, num))
+    num += frame.num_frames - frame.index;
+  return num + rtc_mem[RTC_MEM_NUM_FRAMES];
+}
+
+static uint16_t num_frames(const std::string& msg)
+{
+  report_v3_header_t header;
+
+  memcpy(&header, msg.data(), sizeof(header));
+  return header.num_frames;
+}
+
+// the frames of a binary message, with the trailers if there are any
+static std::string frames(const std::string& msg)
+{
+  return msg.substr(sizeof(report_v3_header_t));
+}
+
+// binary message LOST_SEQUENCE never arrives
+static std::string respond_lost(const std::string& msg)
+{
+  report_v3_header_t header;
+
+  memcpy(&header, msg.data(), sizeof(header));
+  return (LOST_SEQUENCE == header.sequence) ? "" : "OK";
+}
+
+// returns the time in ms that upload_readings takes
+static unsigned timed_upload(void)
+{
+  auto start = std::chrono::steady_clock::now();
+
+  upload_readings();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the json uploads wait for a round trip per frame, the binary uploads for
+// about one per window of batches
+static void test_latency(void)
+{
+  ReportServer server(respond_ok);
+
+  printf("rtt ms  json frames  json ms  v3 frames  batches  v3 ms\n");
+  for (unsigned rtt : rtts) {
+    unsigned json_ms, v3_ms;
+    size_t json_batches, v3_batches;
+
+    server.set_delay(rtt);
+    boot(server, NUM_JSON_FRAMES, false);
+    json_ms = timed_upload();
+    json_batches = server.messages().size();
+    CHECK(0 == num_pending());
+    server.clear();
+
+    boot(server, NUM_FRAMES, true);
+    v3_ms = timed_upload();
+    v3_batches = server.messages().size();
+    CHECK(0 == num_pending());
+    server.clear();
+
+    printf("%6u  %11u  %7u  %9u  %7zu  %5u\n", rtt, NUM_JSON_FRAMES, json_ms, NUM_FRAMES, v3_batches, v3_ms);
+    CHECK(v3_batches > 2 * REPORT_WINDOW_SIZE);
+    CHECK(NUM_JSON_FRAMES == json_batches);
+    CHECK(json_ms >= json_batches * rtt);
+    CHECK(v3_ms < v3_batches * rtt / 2 + 100);
+  }
+}
+
+// the batches before the lost message are released, the lost one and the
+// ones after it are sent again by the next upload, starting with the same
+// frames
+static void test_lost(void)
+{
+  ReportServer lossy(respond_lost);
+  ReportServer server(respond_ok);
+  std::vector<std::string> first;
+  std::vector<std::string> second;
+  unsigned released = 0;
+  unsigned num_ring;
+
+  boot(lossy, NUM_FRAMES, true);
+  num_ring = rtc_mem[RTC_MEM_NUM_FRAMES];
+  // only spilled frames were acknowledged, which still counts as progress
+  CHECK(upload_readings());
+  CHECK(rtc_mem[RTC_MEM_NUM_FRAMES] == num_ring);
+  first = lossy.messages();
+  CHECK(first.size() == LOST_SEQUENCE + REPORT_WINDOW_SIZE);
+  for (unsigned i = 0; i < LOST_SEQUENCE; i++)
+    released += num_frames(first[i]);
+  CHECK(num_pending() == NUM_FRAMES - released);
+  CHECK(!(((flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME])->flags & FLAG_BIT_REPORT_V3));
+
+  host_config.report_host_port = server.port();
+  load_rtc_config();
+  ((flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME])->flags |= FLAG_BIT_REPORT_V3;
+  CHECK(upload_readings());
+  second = server.messages();
+  CHECK(second.size() >= REPORT_WINDOW_SIZE);
+  for (unsigned i = 0; (i < REPORT_WINDOW_SIZE) && (i < second.size()); i++) {
+    CHECK(num_frames(second[i]) == num_frames(first[LOST_SEQUENCE + i]));
+    CHECK(frames(second[i]) == frames(first[LOST_SEQUENCE + i]));
+  }
+  CHECK(0 == num_pending());
+
+  // nothing is acknowledged by a server that doesn't respond
+  boot(lossy, NUM_FRAMES, true);
+  lossy.set_delay(2 * REPORT_RESPONSE_TIMEOUT);
+  CHECK(!upload_readings());
+  CHECK(num_pending() == NUM_FRAMES);
+}
+
+// the frames without measurements are released without an acknowledgement,
+// instead of waiting for the response to a message that was never sent, and
+// the last message still carries the uptime and counters
+static void test_empty(void)
+{
+  ReportServer server(respond_ok);
+
+  for (bool v3 : {true, false}) {
+    flags_time_t *flags = (flags_time_t*)&rtc_mem[RTC_MEM_FLAGS_TIME];
+    std::vector<std::string> messages;
+    std::string last;
+    report_v3_header_t header;
+    size_t num_sent;
+
+    // a tail of empty frames in the ring buffer is sent with the last frames
+    boot(server, NUM_JSON_FRAMES, v3);
+    store_empty_frames(NUM_EMPTY);
+    CHECK(timed_upload() < REPORT_RESPONSE_TIMEOUT);
+    CHECK(0 == num_pending());
+    CHECK(!v3 == !(flags->flags & FLAG_BIT_REPORT_V3));
+    messages = server.messages();
+    num_sent = messages.size();
+    CHECK(v3 ? (num_sent > 0) : (NUM_JSON_FRAMES == num_sent));
+    last = messages.empty() ? "" : messages.back();
+    if (v3 && (last.size() >= sizeof(header))) {
+      memcpy(&header, last.data(), sizeof(header));
+      CHECK(header.flags & REPORT_V3_FLAG_LAST);
+    } else {
+      CHECK(!v3 && (std::string::npos != last.find("{\"type\":\"uptime\"")));
+    }
+    server.clear();
+
+    // a spill log block of only empty frames, and a ring buffer of only empty
+    // frames, which is sent as a last message with just the uptime and counters
+    boot(server, NUM_JSON_FRAMES, v3);
+    CHECK(spill_readings());
+    store_empty_frames(NUM_EMPTY);
+    CHECK(spill_readings());
+    store_empty_frames(NUM_EMPTY);
+    CHECK(timed_upload() < REPORT_RESPONSE_TIMEOUT);
+    CHECK(0 == num_pending());
+    CHECK(!v3 == !(flags->flags & FLAG_BIT_REPORT_V3));
+    messages = server.messages();
+    CHECK(messages.size() == num_sent + 1); // the same messages and the uptime
+    last = messages.empty() ? "" : messages.back();
+    if (v3 && (last.size() >= sizeof(header))) {
+      memcpy(&header, last.data(), sizeof(header));
+      CHECK(header.flags & REPORT_V3_FLAG_LAST);
+      CHECK(0 == header.num_frames);
+    } else {
+      CHECK(!v3 && (std::string::npos != last.find("\"measurements\":[{\"type\":\"uptime\"")));
+    }
+    server.clear();
+  }
+}
+
+int main(void)
+{
+  test_latency();
+  test_lost();
+  test_empty();
+
+  return test_result("test_upload_latency");
+}